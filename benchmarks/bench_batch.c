@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// Compares ticking 100k agents as separate FSMs (a loop of fsm_run) against 100k instances of a
+// shared definition, ticked one at a time with fsm_instance_run, and all at once with fsm_run_batch.
+
+#define INSTANCE_COUNT 100000
+#define TICK_COUNT 100
+
+#define STAMINA_MAX 20
+#define STAMINA_LOW 5
+
+typedef struct agent_context {
+  int stamina;
+  int distance;
+  int padding[14];  // make the context span a cache line, like a real agent would
+} agent_context_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void idle_on_update(fsm_t *fsm, void *context) { ((agent_context_t *)context)->stamina++; }
+
+static void walk_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina--;
+  ((agent_context_t *)context)->distance++;
+}
+
+static void run_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina -= 2;
+  ((agent_context_t *)context)->distance += 2;
+}
+
+static fsm_bool is_rested(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina >= STAMINA_MAX; }
+
+static fsm_bool is_tired(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= STAMINA_LOW; }
+
+static fsm_bool is_exhausted(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= 0; }
+
+static fsm_bool is_far(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->distance % 64 == 0; }
+
+static fsm_t *build_agent(agent_context_t *context) {
+  fsm_t *fsm = fsm_create(malloc, free, context, sizeof(agent_context_t));
+
+  fsm_add_state(fsm, (fsm_state_t){.name = "Idle", .on_update = idle_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Walk", .on_update = walk_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Run", .on_update = run_on_update});
+
+  fsm_add_transition(fsm, "Idle", "Run", FSM_PREDICATE_GROUP(is_rested, is_far));
+  fsm_add_transition(fsm, "Idle", "Walk", FSM_PREDICATE_GROUP(is_rested));
+  fsm_add_transition(fsm, "Walk", "Idle", FSM_PREDICATE_GROUP(is_exhausted));
+  fsm_add_transition(fsm, "Run", "Walk", FSM_PREDICATE_GROUP(is_tired));
+
+  fsm_set_state(fsm, "Idle");
+  return fsm;
+}
+
+static agent_context_t initial_context(int i) { return (agent_context_t){.stamina = i % STAMINA_MAX}; }
+
+int main() {
+  // 1. One FSM per agent, ticked with fsm_run
+  fsm_t **fsms = malloc(sizeof(fsm_t *) * INSTANCE_COUNT);
+  for (int i = 0; i < INSTANCE_COUNT; i++) {
+    agent_context_t context = initial_context(i);
+    fsms[i] = build_agent(&context);
+  }
+
+  double start = now_seconds();
+  for (int tick = 0; tick < TICK_COUNT; tick++) {
+    for (int i = 0; i < INSTANCE_COUNT; i++) {
+      fsm_run(fsms[i]);
+    }
+  }
+  double fsm_run_time = now_seconds() - start;
+
+  long fsm_run_distance = 0;
+  for (int i = 0; i < INSTANCE_COUNT; i++) {
+    fsm_run_distance += FSM_GET_CONTEXT(fsms[i], agent_context_t)->distance;
+    fsm_destroy(fsms[i]);
+  }
+  free(fsms);
+
+  // 2. One shared definition, one instance per agent
+  fsm_definition_t *definition = fsm_definition_create(build_agent(NULL));
+  fsm_instance_t *instances = malloc(sizeof(fsm_instance_t) * INSTANCE_COUNT);
+  agent_context_t **contexts = malloc(sizeof(agent_context_t *) * INSTANCE_COUNT);
+
+  double times[2];
+  long distances[2];
+  for (int mode = 0; mode < 2; mode++) {
+    for (int i = 0; i < INSTANCE_COUNT; i++) {
+      contexts[i] = malloc(sizeof(agent_context_t));
+      *contexts[i] = initial_context(i);
+      fsm_instance_init(definition, &instances[i], contexts[i]);
+    }
+
+    start = now_seconds();
+    for (int tick = 0; tick < TICK_COUNT; tick++) {
+      if (mode == 0) {
+        for (int i = 0; i < INSTANCE_COUNT; i++) {
+          fsm_instance_run(definition, &instances[i]);
+        }
+      } else {
+        fsm_run_batch(definition, instances, INSTANCE_COUNT);
+      }
+    }
+    times[mode] = now_seconds() - start;
+
+    distances[mode] = 0;
+    for (int i = 0; i < INSTANCE_COUNT; i++) {
+      distances[mode] += contexts[i]->distance;
+      free(contexts[i]);
+    }
+  }
+
+  free(contexts);
+  free(instances);
+  fsm_definition_release(definition);
+
+  double ticks = (double)INSTANCE_COUNT * TICK_COUNT;
+  printf("%d instances, %d ticks\n", INSTANCE_COUNT, TICK_COUNT);
+  printf("%-22s %10s %10s %10s %10s\n", "", "ns/tick", "speedup", "vs inst", "distance");
+  printf("%-22s %10.2f %10.2f %10s %10ld\n", "fsm_run loop", fsm_run_time * 1e9 / ticks, 1.0, "", fsm_run_distance);
+  printf("%-22s %10.2f %10.2f %10.2f %10ld\n", "fsm_instance_run loop", times[0] * 1e9 / ticks,
+         fsm_run_time / times[0], 1.0, distances[0]);
+  printf("%-22s %10.2f %10.2f %10.2f %10ld\n", "fsm_run_batch", times[1] * 1e9 / ticks, fsm_run_time / times[1],
+         times[0] / times[1], distances[1]);
+  return 0;
+}
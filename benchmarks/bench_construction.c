@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// Measures how long it takes to wire up a large, generated FSM by name.
+// Construction should scale linearly: the ns/state column should stay flat as the FSM grows.
+
+#define NAME_LENGTH 16
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static fsm_bool never(fsm_t *fsm, void *context) { return false; }
+
+static void state_name(char *buffer, int i) { snprintf(buffer, NAME_LENGTH, "State%d", i); }
+
+static double build(int state_count) {
+  char from[NAME_LENGTH];
+  char to[NAME_LENGTH];
+
+  double start = now_seconds();
+
+  fsm_t *fsm = fsm_create(malloc, free, NULL, 0);
+
+  for (int i = 0; i < state_count; i++) {
+    state_name(from, i);
+    fsm_add_state(fsm, (fsm_state_t){.name = from});
+  }
+
+  // Two transitions out of every state, looked up by name
+  for (int i = 0; i < state_count; i++) {
+    state_name(from, i);
+    state_name(to, (i + 1) % state_count);
+    fsm_add_transition(fsm, from, to, FSM_PREDICATE_GROUP(never));
+    state_name(to, (i * 7 + 3) % state_count);
+    fsm_add_transition(fsm, from, to, FSM_PREDICATE_GROUP(never));
+  }
+
+  state_name(from, 0);
+  fsm_set_state(fsm, from);
+  fsm_run(fsm);
+
+  double elapsed = now_seconds() - start;
+  fsm_destroy(fsm);
+  return elapsed;
+}
+
+int main() {
+  printf("%10s %12s %14s\n", "states", "total (ms)", "ns/state");
+  for (int state_count = 1000; state_count <= 32000; state_count *= 2) {
+    double elapsed = build(state_count);
+    printf("%10d %12.2f %14.1f\n", state_count, elapsed * 1e3, elapsed * 1e9 / state_count);
+  }
+  return 0;
+}
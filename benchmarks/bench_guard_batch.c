@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// Checks "stamina >= 20 && speed < 1.5" against 10k agent contexts, by calling predicate functions in
+// a loop (the way a transition is checked) and with fsm_guard_eval_batch at every SIMD level the CPU
+// supports, for contexts laid out as an array of structs and as a struct of arrays.
+
+#define CONTEXT_COUNT 10000
+#define REPEAT_COUNT 2000
+#define MASK_WORDS ((CONTEXT_COUNT + 63) / 64)
+
+#define STAMINA_MAX 20
+#define SPEED_SLOW 1.5f
+
+typedef struct agent_context {
+  int stamina;
+  int distance;
+  float speed;
+  int padding[13];  // make the context span a cache line, like a real agent would
+} agent_context_t;
+
+typedef struct agent_columns {
+  int stamina[CONTEXT_COUNT];
+  int distance[CONTEXT_COUNT];
+  float speed[CONTEXT_COUNT];
+} agent_columns_t;
+
+static agent_context_t agents[CONTEXT_COUNT];
+static agent_columns_t columns;
+static uint64_t mask[MASK_WORDS];
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static fsm_bool is_rested(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina >= STAMINA_MAX; }
+
+static fsm_bool is_slow(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->speed < SPEED_SLOW; }
+
+static long count_set(void) {
+  long count = 0;
+  for (int i = 0; i < MASK_WORDS; i++) {
+    count += __builtin_popcountll(mask[i]);
+  }
+  return count;
+}
+
+static void report(const char *name, double seconds, double baseline) {
+  double checks = (double)CONTEXT_COUNT * REPEAT_COUNT;
+  printf("%-28s %10.2f %10.2f %10ld\n", name, seconds * 1e9 / checks, baseline / seconds, count_set());
+}
+
+int main() {
+  for (int i = 0; i < CONTEXT_COUNT; i++) {
+    agents[i] = (agent_context_t){.stamina = (i * 7) % 32, .distance = i, .speed = (float)((i * 13) % 8) * 0.5f};
+    columns.stamina[i] = agents[i].stamina;
+    columns.distance[i] = agents[i].distance;
+    columns.speed[i] = agents[i].speed;
+  }
+
+  fsm_t *fsm = fsm_create(malloc, free, NULL, sizeof(agent_context_t));
+  fsm_predicate_group_t predicates = FSM_PREDICATE_GROUP(is_rested, is_slow);
+  fsm_guard_id guard =
+      fsm_guard_and(fsm, FSM_GUARD_FIELD(fsm, agent_context_t, stamina, FSM_GE, STAMINA_MAX),
+                    FSM_GUARD_FIELD(fsm, agent_context_t, speed, FSM_LT, SPEED_SLOW));
+  fsm_guard_id column_guard = fsm_guard_and(
+      fsm, fsm_guard_compare_int(fsm, offsetof(agent_columns_t, stamina), FSM_FIELD_I32, FSM_GE, STAMINA_MAX),
+      fsm_guard_compare_float(fsm, offsetof(agent_columns_t, speed), FSM_FIELD_F32, FSM_LT, SPEED_SLOW));
+
+  printf("%d contexts, %d repeats\n", CONTEXT_COUNT, REPEAT_COUNT);
+  printf("%-28s %10s %10s %10s\n", "", "ns/context", "speedup", "matches");
+
+  // 1. Predicate functions, called for every context until one fails
+  double start = now_seconds();
+  for (int repeat = 0; repeat < REPEAT_COUNT; repeat++) {
+    for (int i = 0; i < MASK_WORDS; i++) {
+      mask[i] = 0;
+    }
+    for (int i = 0; i < CONTEXT_COUNT; i++) {
+      fsm_bool ok = true;
+      for (fsm_size_t p = 0; p < predicates.predicate_count && ok; p++) {
+        ok = predicates.predicates[p](fsm, &agents[i]);
+      }
+      mask[i / 64] |= (uint64_t)ok << (i % 64);
+    }
+  }
+  double baseline = now_seconds() - start;
+  report("predicate loop", baseline, baseline);
+
+  // 2. The guard, at every level up to what the CPU supports
+  static const char *level_names[] = {"scalar", "sse2", "avx2"};
+  fsm_simd_level_t supported = fsm_guard_batch_level();
+  for (int level = FSM_SIMD_SCALAR; level <= (int)supported; level++) {
+    fsm_guard_batch_limit((fsm_simd_level_t)level);
+    for (int layout = 0; layout < 2; layout++) {
+      start = now_seconds();
+      for (int repeat = 0; repeat < REPEAT_COUNT; repeat++) {
+        if (layout == 0) {
+          fsm_guard_eval_batch(fsm, guard, agents, sizeof(agent_context_t), CONTEXT_COUNT, mask);
+        } else {
+          fsm_guard_eval_batch(fsm, column_guard, &columns, FSM_GUARD_SOA, CONTEXT_COUNT, mask);
+        }
+      }
+      char name[64];
+      snprintf(name, sizeof(name), "guard batch, %s, %s", level_names[level], layout == 0 ? "structs" : "arrays");
+      report(name, now_seconds() - start, baseline);
+    }
+  }
+
+  fsm_destroy(fsm);
+  return 0;
+}
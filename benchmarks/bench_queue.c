@@ -0,0 +1,103 @@
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_THREADS 1
+#define FSM_IMPL
+#include "fsm.h"
+
+// Posts events to one FSM from 1 to 32 producer threads while the main thread drains them, and reports
+// the throughput with both overflow policies. With FSM_QUEUE_REJECT, producers yield and retry until
+// their event is accepted, and the number of rejected posts is reported too.
+
+#define EVENT_COUNT 1000000
+#define QUEUE_CAPACITY 1024
+
+enum { EVENT_PING };
+
+typedef struct counter_context {
+  long entered;
+} counter_context_t;
+
+typedef struct producer {
+  fsm_t *fsm;
+  long events;
+  long rejected;
+  pthread_t thread;
+} producer_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void count_on_enter(fsm_t *fsm, void *context) { ((counter_context_t *)context)->entered++; }
+
+static void *produce(void *arg) {
+  producer_t *producer = (producer_t *)arg;
+  for (long i = 0; i < producer->events; i++) {
+    while (!fsm_post(producer->fsm, EVENT_PING, NULL)) {
+      producer->rejected++;
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// Runs one round and returns the time it took, from starting the producers to draining the last event
+static double run_round(int producer_count, fsm_queue_overflow_t overflow, long *rejected) {
+  counter_context_t context = {0};
+  fsm_t *fsm = FSM_CREATE(&context);
+  fsm_add_state(fsm, (fsm_state_t){.name = "Ping", .on_enter = count_on_enter});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Pong", .on_enter = count_on_enter});
+  fsm_add_event_transition(fsm, "Ping", EVENT_PING, "Pong", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_add_event_transition(fsm, "Pong", EVENT_PING, "Ping", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_finalize(fsm);
+  fsm_attach_queue(fsm, QUEUE_CAPACITY, overflow);
+
+  producer_t producers[32];
+  double start = now_seconds();
+  for (int p = 0; p < producer_count; p++) {
+    producers[p] = (producer_t){.fsm = fsm, .events = EVENT_COUNT / producer_count};
+    pthread_create(&producers[p].thread, NULL, produce, &producers[p]);
+  }
+
+  long expected = (EVENT_COUNT / producer_count) * producer_count;
+  long drained = 0;
+  while (drained < expected) {
+    fsm_size_t batch = fsm_drain_events(fsm, (fsm_size_t)-1);
+    if (batch == 0) {
+      sched_yield();  // nothing posted yet, let the producers run
+    }
+    drained += (long)batch;
+  }
+  double time = now_seconds() - start;
+
+  *rejected = 0;
+  for (int p = 0; p < producer_count; p++) {
+    pthread_join(producers[p].thread, NULL);
+    *rejected += producers[p].rejected;
+  }
+
+  // The first event also enters the initial state
+  if (FSM_GET_CONTEXT(fsm, counter_context_t)->entered != expected + 1) {
+    printf("lost events!\n");
+  }
+  fsm_destroy(fsm);
+  return time;
+}
+
+int main() {
+  printf("%d events, queue capacity %d\n", EVENT_COUNT, QUEUE_CAPACITY);
+  printf("%-10s %16s %16s %14s\n", "producers", "spin Mevents/s", "reject Mevents/s", "rejected");
+
+  for (int producers = 1; producers <= 32; producers *= 2) {
+    long rejected;
+    double spin_time = run_round(producers, FSM_QUEUE_SPIN, &rejected);
+    double reject_time = run_round(producers, FSM_QUEUE_REJECT, &rejected);
+    printf("%-10d %16.2f %16.2f %14ld\n", producers, EVENT_COUNT / spin_time * 1e-6, EVENT_COUNT / reject_time * 1e-6,
+           rejected);
+  }
+  return 0;
+}
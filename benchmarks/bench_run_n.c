@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// Compares ticking one agent 10M times with a loop of fsm_run against a single fsm_run_n call, and
+// against fsm_run_until with a stop predicate that never holds before the last tick.
+
+#define TICK_COUNT 10000000
+
+#define STAMINA_MAX 20
+#define STAMINA_LOW 5
+
+typedef struct agent_context {
+  int stamina;
+  long distance;
+} agent_context_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void idle_on_update(fsm_t *fsm, void *context) { ((agent_context_t *)context)->stamina++; }
+
+static void walk_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina--;
+  ((agent_context_t *)context)->distance++;
+}
+
+static void run_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina -= 2;
+  ((agent_context_t *)context)->distance += 2;
+}
+
+static fsm_bool is_rested(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina >= STAMINA_MAX; }
+
+static fsm_bool is_tired(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= STAMINA_LOW; }
+
+static fsm_bool is_exhausted(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= 0; }
+
+static fsm_bool is_far(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->distance % 64 == 0; }
+
+static fsm_bool is_done(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->distance < 0; }
+
+static fsm_t *build_agent(agent_context_t *context) {
+  fsm_t *fsm = fsm_create(malloc, free, context, sizeof(agent_context_t));
+
+  fsm_add_state(fsm, (fsm_state_t){.name = "Idle", .on_update = idle_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Walk", .on_update = walk_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Run", .on_update = run_on_update});
+
+  fsm_add_transition(fsm, "Idle", "Run", FSM_PREDICATE_GROUP(is_rested, is_far));
+  fsm_add_transition(fsm, "Idle", "Walk", FSM_PREDICATE_GROUP(is_rested));
+  fsm_add_transition(fsm, "Walk", "Idle", FSM_PREDICATE_GROUP(is_exhausted));
+  fsm_add_transition(fsm, "Run", "Walk", FSM_PREDICATE_GROUP(is_tired));
+
+  fsm_set_state(fsm, "Idle");
+  fsm_finalize(fsm);
+  return fsm;
+}
+
+int main() {
+  static const char *names[] = {"fsm_run loop", "fsm_run_n", "fsm_run_until"};
+  double times[3];
+  long distances[3];
+  fsm_size_t transitions[3] = {0, 0, 0};
+
+  for (int mode = 0; mode < 3; mode++) {
+    agent_context_t context = {0, 0};
+    fsm_t *fsm = build_agent(&context);
+
+    double start = now_seconds();
+    if (mode == 0) {
+      for (int tick = 0; tick < TICK_COUNT; tick++) {
+        fsm_run(fsm);
+      }
+    } else if (mode == 1) {
+      transitions[mode] = fsm_run_n(fsm, TICK_COUNT).transitions;
+    } else {
+      transitions[mode] = fsm_run_until(fsm, is_done, TICK_COUNT).transitions;
+    }
+    times[mode] = now_seconds() - start;
+
+    distances[mode] = FSM_GET_CONTEXT(fsm, agent_context_t)->distance;
+    fsm_destroy(fsm);
+  }
+
+  printf("1 agent, %d ticks\n", TICK_COUNT);
+  printf("%-16s %10s %10s %12s %12s\n", "", "ns/tick", "speedup", "distance", "transitions");
+  for (int mode = 0; mode < 3; mode++) {
+    char counted[24] = "-";  // a loop of fsm_run doesn't count its transitions
+    if (mode > 0) {
+      snprintf(counted, sizeof(counted), "%zu", transitions[mode]);
+    }
+    printf("%-16s %10.2f %10.2f %12ld %12s\n", names[mode], times[mode] * 1e9 / TICK_COUNT, times[0] / times[mode],
+           distances[mode], counted);
+  }
+  return 0;
+}
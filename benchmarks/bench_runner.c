@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FSM_THREADS 1
+#define FSM_IMPL
+#include "fsm.h"
+
+// Ticks a pool of 1M agents with fsm_pool_tick, then with runners of 1, 2, 4, ... threads up to the
+// number of online processors, and reports how the runner scales. Every run must end with the same
+// total distance, since the runner's result doesn't depend on the schedule.
+
+#define INSTANCE_COUNT 1000000
+#define TICK_COUNT 20
+
+#define STAMINA_MAX 20
+#define STAMINA_LOW 5
+
+typedef struct agent_context {
+  int stamina;
+  int distance;
+  int padding[14];  // make the context span a cache line, like a real agent would
+} agent_context_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void idle_on_update(fsm_t *fsm, void *context) { ((agent_context_t *)context)->stamina++; }
+
+static void walk_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina--;
+  ((agent_context_t *)context)->distance++;
+}
+
+static void run_on_update(fsm_t *fsm, void *context) {
+  ((agent_context_t *)context)->stamina -= 2;
+  ((agent_context_t *)context)->distance += 2;
+}
+
+static fsm_bool is_rested(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina >= STAMINA_MAX; }
+
+static fsm_bool is_tired(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= STAMINA_LOW; }
+
+static fsm_bool is_exhausted(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->stamina <= 0; }
+
+static fsm_bool is_far(fsm_t *fsm, void *context) { return ((agent_context_t *)context)->distance % 64 == 0; }
+
+static fsm_definition_t *build_definition(void) {
+  fsm_t *fsm = fsm_create(malloc, free, NULL, sizeof(agent_context_t));
+
+  fsm_add_state(fsm, (fsm_state_t){.name = "Idle", .on_update = idle_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Walk", .on_update = walk_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Run", .on_update = run_on_update});
+
+  fsm_add_transition(fsm, "Idle", "Run", FSM_PREDICATE_GROUP(is_rested, is_far));
+  fsm_add_transition(fsm, "Idle", "Walk", FSM_PREDICATE_GROUP(is_rested));
+  fsm_add_transition(fsm, "Walk", "Idle", FSM_PREDICATE_GROUP(is_exhausted));
+  fsm_add_transition(fsm, "Run", "Walk", FSM_PREDICATE_GROUP(is_tired));
+
+  fsm_set_state(fsm, "Idle");
+  return fsm_definition_create(fsm);
+}
+
+// Runs one pool for TICK_COUNT ticks, with fsm_pool_tick if threads is 0, and returns the time taken
+static double run_pool(fsm_definition_t *definition, agent_context_t *contexts, fsm_size_t threads, long *distance,
+                       fsm_size_t *stolen) {
+  fsm_pool_t *pool = fsm_pool_create(definition);
+  for (int i = 0; i < INSTANCE_COUNT; i++) {
+    contexts[i] = (agent_context_t){.stamina = i % STAMINA_MAX};
+    fsm_pool_add(pool, &contexts[i]);
+  }
+
+  fsm_runner_t *runner = threads ? fsm_runner_create(malloc, free, threads, 0) : NULL;
+
+  double start = now_seconds();
+  for (int tick = 0; tick < TICK_COUNT; tick++) {
+    if (runner) {
+      fsm_runner_tick(runner, pool);
+    } else {
+      fsm_pool_tick(pool);
+    }
+  }
+  double time = now_seconds() - start;
+
+  *stolen = 0;
+  for (fsm_size_t t = 0; runner && t < fsm_runner_thread_count(runner); t++) {
+    *stolen += fsm_runner_stats(runner, t).chunks_stolen;
+  }
+  *distance = 0;
+  for (int i = 0; i < INSTANCE_COUNT; i++) {
+    *distance += contexts[i].distance;
+  }
+
+  fsm_runner_destroy(runner);
+  fsm_pool_destroy(pool);
+  return time;
+}
+
+int main() {
+  fsm_definition_t *definition = build_definition();
+  agent_context_t *contexts = malloc(sizeof(agent_context_t) * INSTANCE_COUNT);
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (online < 1) online = 1;
+
+  double ticks = (double)INSTANCE_COUNT * TICK_COUNT;
+  long distance;
+  fsm_size_t stolen;
+  double base_time = run_pool(definition, contexts, 0, &distance, &stolen);
+
+  printf("%d instances, %d ticks, %ld online processors\n", INSTANCE_COUNT, TICK_COUNT, online);
+  printf("%-16s %10s %10s %10s %12s\n", "", "ns/tick", "speedup", "stolen", "distance");
+  printf("%-16s %10.2f %10.2f %10s %12ld\n", "fsm_pool_tick", base_time * 1e9 / ticks, 1.0, "-", distance);
+
+  for (long threads = 1;; threads *= 2) {
+    if (threads > online) threads = online;
+    double time = run_pool(definition, contexts, (fsm_size_t)threads, &distance, &stolen);
+    char label[32];
+    snprintf(label, sizeof(label), "runner x%ld", threads);
+    printf("%-16s %10.2f %10.2f %10zu %12ld\n", label, time * 1e9 / ticks, base_time / time, stolen, distance);
+    if (threads == online) break;
+  }
+
+  free(contexts);
+  fsm_definition_release(definition);
+  return 0;
+}
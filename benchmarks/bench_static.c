@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <time.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// Compares ticking one agent 10M times as a finalized FSM with fsm_run and fsm_run_n, against the same
+// machine written as an FSM_STATIC_DEFINE table, whose state functions and guards inline into a switch.
+
+#define TICK_COUNT 10000000
+
+#define STAMINA_MAX 20
+#define STAMINA_LOW 5
+
+typedef struct agent_context {
+  int stamina;
+  long distance;
+} agent_context_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// The state functions and guards, shared by both machines
+static inline void idle_update(agent_context_t *context) { context->stamina++; }
+
+static inline void walk_update(agent_context_t *context) {
+  context->stamina--;
+  context->distance++;
+}
+
+static inline void run_update(agent_context_t *context) {
+  context->stamina -= 2;
+  context->distance += 2;
+}
+
+static inline fsm_bool rested(agent_context_t *context) { return context->stamina >= STAMINA_MAX; }
+
+static inline fsm_bool rested_and_far(agent_context_t *context) {
+  return context->stamina >= STAMINA_MAX && context->distance % 64 == 0;
+}
+
+static inline fsm_bool tired(agent_context_t *context) { return context->stamina <= STAMINA_LOW; }
+
+static inline fsm_bool exhausted(agent_context_t *context) { return context->stamina <= 0; }
+
+// 1. The runtime FSM
+static void idle_on_update(fsm_t *fsm, void *context) { idle_update(context); }
+
+static void walk_on_update(fsm_t *fsm, void *context) { walk_update(context); }
+
+static void run_on_update(fsm_t *fsm, void *context) { run_update(context); }
+
+static fsm_bool is_rested(fsm_t *fsm, void *context) { return rested(context); }
+
+static fsm_bool is_rested_and_far(fsm_t *fsm, void *context) { return rested_and_far(context); }
+
+static fsm_bool is_tired(fsm_t *fsm, void *context) { return tired(context); }
+
+static fsm_bool is_exhausted(fsm_t *fsm, void *context) { return exhausted(context); }
+
+static fsm_t *build_agent(agent_context_t *context) {
+  fsm_t *fsm = fsm_create(malloc, free, context, sizeof(agent_context_t));
+
+  fsm_add_state(fsm, (fsm_state_t){.name = "Idle", .on_update = idle_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Walk", .on_update = walk_on_update});
+  fsm_add_state(fsm, (fsm_state_t){.name = "Run", .on_update = run_on_update});
+
+  fsm_add_transition(fsm, "Idle", "Run", FSM_PREDICATE_GROUP(is_rested_and_far));
+  fsm_add_transition(fsm, "Idle", "Walk", FSM_PREDICATE_GROUP(is_rested));
+  fsm_add_transition(fsm, "Walk", "Idle", FSM_PREDICATE_GROUP(is_exhausted));
+  fsm_add_transition(fsm, "Run", "Walk", FSM_PREDICATE_GROUP(is_tired));
+
+  fsm_set_state(fsm, "Idle");
+  fsm_finalize(fsm);
+  return fsm;
+}
+
+// 2. The static FSM
+#define AGENT_TABLE(STATE, TRANSITION)                             \
+  STATE(AGENT_IDLE, FSM_STATIC_NONE, idle_update, FSM_STATIC_NONE) \
+  TRANSITION(AGENT_RUN, rested_and_far)                            \
+  TRANSITION(AGENT_WALK, rested)                                   \
+  STATE(AGENT_WALK, FSM_STATIC_NONE, walk_update, FSM_STATIC_NONE) \
+  TRANSITION(AGENT_IDLE, exhausted)                                \
+  STATE(AGENT_RUN, FSM_STATIC_NONE, run_update, FSM_STATIC_NONE)   \
+  TRANSITION(AGENT_WALK, tired)
+
+FSM_STATIC_DEFINE(agent, agent_context_t, AGENT_TABLE)
+
+int main() {
+  static const char *names[] = {"fsm_run loop", "fsm_run_n", "static run loop", "static run_n"};
+  double times[4];
+  long distances[4];
+
+  for (int mode = 0; mode < 4; mode++) {
+    agent_context_t context = {0, 0};
+    fsm_t *fsm = mode < 2 ? build_agent(&context) : NULL;
+    agent_t agent;
+    agent_init(&agent, &context);
+
+    double start = now_seconds();
+    if (mode == 0) {
+      for (int tick = 0; tick < TICK_COUNT; tick++) {
+        fsm_run(fsm);
+      }
+    } else if (mode == 1) {
+      fsm_run_n(fsm, TICK_COUNT);
+    } else if (mode == 2) {
+      for (int tick = 0; tick < TICK_COUNT; tick++) {
+        agent_run(&agent);
+      }
+    } else {
+      agent_run_n(&agent, TICK_COUNT);
+    }
+    times[mode] = now_seconds() - start;
+
+    if (fsm) {
+      distances[mode] = FSM_GET_CONTEXT(fsm, agent_context_t)->distance;
+      fsm_destroy(fsm);
+    } else {
+      distances[mode] = context.distance;
+    }
+  }
+
+  printf("1 agent, %d ticks\n", TICK_COUNT);
+  printf("%-16s %10s %10s %12s\n", "", "ns/tick", "speedup", "distance");
+  for (int mode = 0; mode < 4; mode++) {
+    printf("%-16s %10.2f %10.2f %12ld\n", names[mode], times[mode] * 1e9 / TICK_COUNT, times[0] / times[mode],
+           distances[mode]);
+  }
+  return 0;
+}
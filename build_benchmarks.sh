@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+
+mkdir -p build
+for cfile in benchmarks/*.c
+do
+    echo "Building $cfile"
+    gcc -Wall -O2 -I. -o "build/$(basename "$cfile" .c)" "$cfile" -pthread
+done
@@ -0,0 +1,131 @@
+#include <stdio.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// A vending machine driven by events: coins, selections and cancels are dispatched with fsm_dispatch, and
+// their payload is read by the predicates and state functions through fsm_event_payload. Dispatching only
+// calls on_exit / on_enter, fsm_run then updates the machine and takes its other transitions. Where the
+// machine goes after vending comes from a table, one of whose entries isn't a state: the selector
+// returning it is logged and treated like FSM_STAY.
+
+#define PRICE 100
+#define SLOT_COUNT 4
+
+enum { EVENT_COIN, EVENT_SELECT, EVENT_CANCEL };
+
+typedef struct vending_context {
+  int credit;  // the coins put in, in cents
+  int slot;    // the slot being vended
+} vending_context_t;
+
+fsm_state_id g_idle, g_paying, g_vending, g_change;
+
+// Where to go once a slot is vended, the last entry is a mistake
+fsm_state_id g_after_vending[SLOT_COUNT];
+
+void idle_on_enter(fsm_t *fsm, void *context) {
+  vending_context_t *vending = (vending_context_t *)context;
+  if (vending->credit > 0) {
+    printf("  [idle] Enter! Refunding %d\n", vending->credit);
+    vending->credit = 0;
+  } else {
+    printf("  [idle] Enter!\n");
+  }
+}
+void idle_on_exit(fsm_t *fsm, void *context) { printf("  [idle] Exit!\n"); }
+
+// Paying is entered again for every coin, which adds it to the credit
+void paying_on_enter(fsm_t *fsm, void *context) {
+  vending_context_t *vending = (vending_context_t *)context;
+  vending->credit += *(int *)fsm_event_payload(fsm);
+  printf("  [paying] Enter! Credit: %d\n", vending->credit);
+}
+void paying_on_exit(fsm_t *fsm, void *context) { printf("  [paying] Exit!\n"); }
+
+void vending_on_enter(fsm_t *fsm, void *context) {
+  vending_context_t *vending = (vending_context_t *)context;
+  vending->slot = *(int *)fsm_event_payload(fsm);
+  vending->credit -= PRICE;
+  printf("  [vending] Enter! Slot %d\n", vending->slot);
+}
+void vending_on_update(fsm_t *fsm, void *context) { printf("  [vending] Update!\n"); }
+void vending_on_exit(fsm_t *fsm, void *context) { printf("  [vending] Exit!\n"); }
+
+void change_on_enter(fsm_t *fsm, void *context) {
+  printf("  [change] Enter! Returning %d\n", ((vending_context_t *)context)->credit);
+  ((vending_context_t *)context)->credit = 0;
+}
+void change_on_exit(fsm_t *fsm, void *context) { printf("  [change] Exit!\n"); }
+
+fsm_bool can_afford(fsm_t *fsm, void *context) {
+  int slot = *(int *)fsm_event_payload(fsm);
+  return slot >= 0 && slot < SLOT_COUNT && ((vending_context_t *)context)->credit >= PRICE;
+}
+
+fsm_bool always(fsm_t *fsm, void *context) { return true; }
+
+fsm_state_id after_vending(fsm_t *fsm, void *context) {
+  vending_context_t *vending = (vending_context_t *)context;
+  return vending->credit > 0 ? g_change : g_after_vending[vending->slot];
+}
+
+void dispatch(fsm_t *fsm, const char *what, fsm_event_id event, int payload) {
+  printf("%s\n", what);
+  fsm_bool taken = fsm_dispatch(fsm, event, &payload);
+  printf("  -> %s%s\n", fsm_current_state(fsm), taken ? "" : " (no transition)");
+}
+
+void run(fsm_t *fsm) {
+  printf("Run\n");
+  fsm_run(fsm);
+  printf("  -> %s\n", fsm_current_state(fsm));
+}
+
+int main() {
+  vending_context_t context = {0};
+  fsm_t *fsm = FSM_CREATE(&context);
+
+  g_idle = fsm_add_state(fsm, (fsm_state_t){.name = "Idle", .on_enter = idle_on_enter, .on_exit = idle_on_exit});
+  g_paying =
+      fsm_add_state(fsm, (fsm_state_t){.name = "Paying", .on_enter = paying_on_enter, .on_exit = paying_on_exit});
+  g_vending = fsm_add_state(fsm, (fsm_state_t){.name = "Vending",
+                                               .on_enter = vending_on_enter,
+                                               .on_update = vending_on_update,
+                                               .on_exit = vending_on_exit});
+  g_change =
+      fsm_add_state(fsm, (fsm_state_t){.name = "Change", .on_enter = change_on_enter, .on_exit = change_on_exit});
+
+  g_after_vending[0] = g_idle;
+  g_after_vending[1] = g_idle;
+  g_after_vending[2] = g_idle;
+  g_after_vending[3] = 7;
+
+  fsm_add_event_transition(fsm, "Idle", EVENT_COIN, "Paying", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_add_event_transition(fsm, "Paying", EVENT_COIN, "Paying", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_add_event_transition(fsm, "Paying", EVENT_SELECT, "Vending", FSM_PREDICATE_GROUP(can_afford));
+  fsm_add_event_transition(fsm, "Paying", EVENT_CANCEL, "Idle", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_add_event_transition(fsm, "Vending", EVENT_CANCEL, "Idle", FSM_PREDICATE_GROUP_EMPTY);
+  fsm_add_selector_transition(fsm, "Vending", FSM_PREDICATE_GROUP(always), after_vending);
+  fsm_add_transition(fsm, "Change", "Idle", FSM_PREDICATE_GROUP(always));
+
+  fsm_set_state(fsm, "Idle");
+
+  // The first dispatch enters Idle, like the first fsm_run would
+  dispatch(fsm, "Select slot 1", EVENT_SELECT, 1);
+  dispatch(fsm, "Coin 25", EVENT_COIN, 25);
+  dispatch(fsm, "Select slot 1", EVENT_SELECT, 1);
+  dispatch(fsm, "Coin 100", EVENT_COIN, 100);
+  dispatch(fsm, "Select slot 9", EVENT_SELECT, 9);
+  dispatch(fsm, "Select slot 1", EVENT_SELECT, 1);
+  run(fsm);  // there's change to give
+  run(fsm);
+
+  dispatch(fsm, "Coin 100", EVENT_COIN, 100);
+  dispatch(fsm, "Select slot 3", EVENT_SELECT, 3);
+  run(fsm);  // slot 3 goes to a state that doesn't exist, so Vending stays
+  dispatch(fsm, "Cancel", EVENT_CANCEL, 0);
+
+  fsm_destroy(fsm);
+  return 0;
+}
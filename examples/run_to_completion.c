@@ -0,0 +1,100 @@
+#include <stdio.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// A device booting up, with FSM_OPTION_RUN_TO_COMPLETION: a tick keeps taking transitions until none
+// applies, so the boot sequence runs in one tick, calling every on_exit / on_enter in order on the way.
+// It also shows a selector and a step function returning FSM_STAY, and one returning an id that isn't a
+// state, which is logged and treated like FSM_STAY.
+
+typedef struct device_context {
+  int self_test_runs;  // how many times the self test ran
+  int ready_ticks;     // ticks spent in Ready
+  fsm_bool broken;     // makes the self test fail
+} device_context_t;
+
+fsm_state_id g_power_on, g_self_test, g_ready, g_fault;
+
+void power_on_on_enter(fsm_t *fsm, void *context) { printf("  [power_on] Enter!\n"); }
+void power_on_on_exit(fsm_t *fsm, void *context) { printf("  [power_on] Exit!\n"); }
+
+void self_test_on_enter(fsm_t *fsm, void *context) {
+  ((device_context_t *)context)->self_test_runs++;
+  printf("  [self_test] Enter! Run %d\n", ((device_context_t *)context)->self_test_runs);
+}
+void self_test_on_exit(fsm_t *fsm, void *context) { printf("  [self_test] Exit!\n"); }
+
+void ready_on_enter(fsm_t *fsm, void *context) { printf("  [ready] Enter!\n"); }
+void ready_on_update(fsm_t *fsm, void *context) { printf("  [ready] Update!\n"); }
+void ready_on_exit(fsm_t *fsm, void *context) { printf("  [ready] Exit!\n"); }
+
+void fault_on_enter(fsm_t *fsm, void *context) { printf("  [fault] Enter!\n"); }
+void fault_on_exit(fsm_t *fsm, void *context) { printf("  [fault] Exit!\n"); }
+
+// Ready counts its ticks: on the third it asks for a state that doesn't exist, on the fifth it faults
+fsm_state_id ready_on_step(fsm_t *fsm, void *context) {
+  device_context_t *device = (device_context_t *)context;
+  device->ready_ticks++;
+  if (device->ready_ticks == 3) {
+    printf("  [ready] Step! Asking for state 42\n");
+    return 42;
+  }
+  if (device->ready_ticks == 5) {
+    printf("  [ready] Step! Faulting\n");
+    device->broken = true;
+    return g_fault;
+  }
+  return FSM_STAY;
+}
+
+// The self test passes unless the device is broken, in which case the selector stays, and the next
+// transition out of SelfTest (to Fault) is checked instead
+fsm_state_id self_test_select(fsm_t *fsm, void *context) {
+  return ((device_context_t *)context)->broken ? FSM_STAY : g_ready;
+}
+
+fsm_bool always(fsm_t *fsm, void *context) { return true; }
+
+int main() {
+  device_context_t context = {0};
+  fsm_t *fsm = FSM_CREATE(&context);
+  device_context_t *device = FSM_GET_CONTEXT(fsm, device_context_t);
+
+  g_power_on = fsm_add_state(fsm, (fsm_state_t){.name = "PowerOn",
+                                                .on_enter = power_on_on_enter,
+                                                .on_exit = power_on_on_exit});
+  g_self_test = fsm_add_state(fsm, (fsm_state_t){.name = "SelfTest",
+                                                 .on_enter = self_test_on_enter,
+                                                 .on_exit = self_test_on_exit});
+  g_ready = fsm_add_state(fsm, (fsm_state_t){.name = "Ready",
+                                             .on_enter = ready_on_enter,
+                                             .on_update = ready_on_update,
+                                             .on_exit = ready_on_exit,
+                                             .on_step = ready_on_step});
+  g_fault = fsm_add_state(fsm, (fsm_state_t){.name = "Fault",
+                                             .on_enter = fault_on_enter,
+                                             .on_exit = fault_on_exit});
+
+  fsm_add_transition(fsm, "PowerOn", "SelfTest", FSM_PREDICATE_GROUP(always));
+  fsm_add_selector_transition(fsm, "SelfTest", FSM_PREDICATE_GROUP(always), self_test_select);
+  fsm_add_transition(fsm, "SelfTest", "Fault", FSM_PREDICATE_GROUP(always));
+  fsm_add_transition(fsm, "Fault", "PowerOn", FSM_PREDICATE_GROUP(always));
+
+  fsm_set_options(fsm, FSM_OPTION_RUN_TO_COMPLETION);
+  fsm_set_step_bound(fsm, 6);
+  fsm_set_state(fsm, "PowerOn");
+
+  // PowerOn -> SelfTest -> Ready in the first tick, then Ready stays until its step function faults.
+  // The fault loops PowerOn -> SelfTest -> Fault -> PowerOn forever, which the step bound cuts short.
+  for (int tick = 1; tick <= 7; tick++) {
+    printf("Tick %d\n", tick);
+    fsm_run_result_t result = fsm_run_n(fsm, 1);
+    printf("  -> %s after %zu transitions%s\n", fsm_current_state(fsm), result.transitions,
+           fsm_step_bound_hit(fsm) ? ", stopped at the step bound" : "");
+  }
+
+  printf("Self test ran %d times\n", device->self_test_runs);
+  fsm_destroy(fsm);
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+
+#define FSM_IMPL
+#include "fsm.h"
+
+// A traffic light written as a static FSM: the states and transitions are an X-macro table that
+// FSM_STATIC_DEFINE turns into an enum and a few functions, with no allocation or function pointers.
+// A state stays put while none of its guards hold, and the transitions out of a state are checked in
+// table order, so the pedestrian button wins over the timer on green.
+
+typedef struct light_context {
+  int ticks;                // ticks spent in the current state
+  fsm_bool button_pressed;  // a pedestrian asked to cross
+} light_context_t;
+
+static void reset_ticks(light_context_t *context) { context->ticks = 0; }
+static void count_tick(light_context_t *context) { context->ticks++; }
+
+static void green_on_enter(light_context_t *context) {
+  printf("  [green] Enter!\n");
+  reset_ticks(context);
+}
+static void green_on_exit(light_context_t *context) { printf("  [green] Exit!\n"); }
+
+static void yellow_on_enter(light_context_t *context) {
+  printf("  [yellow] Enter!\n");
+  reset_ticks(context);
+}
+static void yellow_on_exit(light_context_t *context) { printf("  [yellow] Exit!\n"); }
+
+static void red_on_enter(light_context_t *context) {
+  printf("  [red] Enter! Pedestrians cross\n");
+  reset_ticks(context);
+  context->button_pressed = false;
+}
+static void red_on_exit(light_context_t *context) { printf("  [red] Exit!\n"); }
+
+static fsm_bool button_pressed(light_context_t *context) { return context->button_pressed; }
+static fsm_bool green_done(light_context_t *context) { return context->ticks >= 4; }
+static fsm_bool yellow_done(light_context_t *context) { return context->ticks >= 1; }
+static fsm_bool red_done(light_context_t *context) { return context->ticks >= 2; }
+
+#define LIGHT_TABLE(STATE, TRANSITION)                                \
+  STATE(LIGHT_GREEN, green_on_enter, count_tick, green_on_exit)       \
+  TRANSITION(LIGHT_YELLOW, button_pressed)                            \
+  TRANSITION(LIGHT_YELLOW, green_done)                                \
+  STATE(LIGHT_YELLOW, yellow_on_enter, count_tick, yellow_on_exit)    \
+  TRANSITION(LIGHT_RED, yellow_done)                                  \
+  STATE(LIGHT_RED, red_on_enter, count_tick, red_on_exit)             \
+  TRANSITION(LIGHT_GREEN, red_done)
+
+FSM_STATIC_DEFINE(light, light_context_t, LIGHT_TABLE)
+
+static void tick(light_t *light, int number) {
+  printf("Tick %d\n", number);
+  fsm_bool taken = light_run(light);
+  printf("  -> %s%s\n", light_current_state(light), taken ? "" : " (stayed)");
+}
+
+int main() {
+  light_context_t context = {0};
+  light_t light;
+  light_init(&light, &context);
+
+  printf("%zu states, %zu transitions\n", light_state_count(), light_transition_count());
+
+  // The first tick enters LIGHT_GREEN, then the timer cycles the light
+  int number = 1;
+  for (; number <= 9; number++) {
+    tick(&light, number);
+  }
+
+  // The button cuts green short
+  context.button_pressed = true;
+  tick(&light, number++);
+
+  // Setting the state exits the current one and enters the new one, ids past the table are ignored
+  printf("Set LIGHT_RED\n");
+  light_set_state(&light, LIGHT_RED);
+  printf("Set state 7\n");
+  light_set_state(&light, (light_state_t)7);
+  printf("  -> %s\n", light_current_state(&light));
+
+  fsm_run_result_t result = light_run_n(&light, 6);
+  printf("Ran %zu ticks, %zu transitions -> %s\n", result.ticks, result.transitions, light_current_state(&light));
+  return 0;
+}
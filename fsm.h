@@ -24,9 +24,10 @@
  * 3. Create a new FSM using fsm_create
  * 4. Add states and transitions to the FSM using fsm_add_state and
  *    fsm_add_transition
- * 5. Run the FSM using fsm_run
- * 6. Stop the FSM using fsm_stop
- * 7. Destroy the FSM using fsm_destroy
+ * 5. Optionally, freeze the FSM's definition using fsm_finalize
+ * 6. Run the FSM using fsm_run, and/or send it events using fsm_dispatch
+ * 7. Stop the FSM using fsm_stop
+ * 8. Destroy the FSM using fsm_destroy
  *
  * For exampe usage please refer to:
  * https://github.com/Evan-Bertis-Sample/c-fsm/tree/main/examples
@@ -43,6 +44,7 @@ extern "C" {
 // Only used for bool & size_t
 // If you don't have stdbool.h or stdint.h, you can define these yourself
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -51,6 +53,57 @@ extern "C" {
 #define FSM_DEBUG 1
 #endif  // FSM_DEBUG
 
+// How many instances ahead fsm_run_batch prefetches contexts
+#ifndef FSM_BATCH_PREFETCH_DISTANCE
+#define FSM_BATCH_PREFETCH_DISTANCE 8
+#endif  // FSM_BATCH_PREFETCH_DISTANCE
+
+// Enable/disable the multithreaded parts of the library, which need pthreads and C11 atomics
+// Define this to 1 before including "fsm.h" everywhere, and link with -pthread
+#ifndef FSM_THREADS
+#define FSM_THREADS 0
+#endif  // FSM_THREADS
+
+// Enable/disable counting predicate calls in fsm_stats_t, which costs a little on every predicate call
+#ifndef FSM_STATS
+#define FSM_STATS 0
+#endif  // FSM_STATS
+
+// Enable/disable the SSE2 / AVX2 paths of fsm_guard_eval_batch on x86, picked at runtime by what the CPU supports
+#ifndef FSM_SIMD
+#define FSM_SIMD 1
+#endif
+
+// With FSM_OPTION_ADAPTIVE_ORDER, how often fsm_run times the predicates of a transition scan, once every N scans
+#ifndef FSM_ADAPTIVE_SAMPLE_INTERVAL
+#define FSM_ADAPTIVE_SAMPLE_INTERVAL 16
+#endif
+
+// With FSM_OPTION_ADAPTIVE_ORDER, how many timed scans between two reorderings of the predicates
+#ifndef FSM_ADAPTIVE_PERIOD
+#define FSM_ADAPTIVE_PERIOD 256
+#endif
+
+// With FSM_OPTION_DEPENDENCY_TRACKING, how many bytes of the context share one bit of the written / read masks
+#ifndef FSM_TRACKING_GRANULE
+#define FSM_TRACKING_GRANULE 8
+#endif
+
+// With FSM_OPTION_RUN_TO_COMPLETION, how many transitions one tick takes at most, unless fsm_set_step_bound changes it
+#ifndef FSM_STEP_BOUND
+#define FSM_STEP_BOUND 32
+#endif
+
+// How many posted events the consumer copies out of an event queue at once, before dispatching them
+#ifndef FSM_QUEUE_DRAIN_BATCH
+#define FSM_QUEUE_DRAIN_BATCH 32
+#endif  // FSM_QUEUE_DRAIN_BATCH
+
+#if FSM_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif  // FSM_THREADS
+
 /**========================================================================
  *                           Types and Functions
  *========================================================================**/
@@ -61,12 +114,45 @@ typedef size_t fsm_size_t;
 /// @brief typedef for bool, just in case it's not defined
 typedef bool fsm_bool;
 
+/// @brief Handle to a state in the FSM, this is the index of the state in the order it was added
+/// @note State ids are stable for the lifetime of the FSM, adding more states never invalidates them
+typedef fsm_size_t fsm_state_id;
+
+/// @brief Returned in place of an fsm_state_id when a state doesn't exist or couldn't be added
+#define FSM_INVALID_STATE ((fsm_state_id)-1)
+
+/// @brief Used as the `from` of a transition to have it checked in every state, see fsm_add_transition_from_all
+#define FSM_ANY_STATE ((fsm_state_id)-2)
+
+/// @brief Identifies an event sent with fsm_dispatch, the values are up to you (an enum works well)
+typedef uint32_t fsm_event_id;
+
+/// @brief Reserved, marks transitions that fsm_run checks every tick rather than on an event
+#define FSM_NO_EVENT ((fsm_event_id)-1)
+
+/// @brief Handle to a declarative guard built with the fsm_guard_xxx functions
+typedef uint32_t fsm_guard_id;
+
+/// @brief Returned in place of an fsm_guard_id when a guard couldn't be built, and marks transitions without one
+#define FSM_NO_GUARD ((fsm_guard_id)-1)
+
 /// @brief Forward declaration of the FSM structure
 struct fsm;
 
 /// @brief Function pointer types for the state functions
 typedef void (*fsm_state_fn)(struct fsm *fsm, void *context);
 
+/// @brief Function pointer type for a state's step function, an update that returns the state to go to next
+/// @return The id of the state to transition to, or FSM_STAY to remain in the current state
+typedef fsm_state_id (*fsm_state_step_fn)(struct fsm *fsm, void *context);
+
+/// @brief Returned by a step function to remain in the current state
+#define FSM_STAY FSM_INVALID_STATE
+
+/// @brief Function pointer type for the selector of a transition, which picks its target once its predicates hold
+/// @return The id of the state to transition to, or FSM_STAY to have the next transition checked instead
+typedef fsm_state_id (*fsm_transition_selector_fn)(struct fsm *fsm, void *context);
+
 /// @brief Function pointer type for the transition predicates, which take an fsm, a context, and return a fsm_bool
 typedef fsm_bool (*fsm_transition_predicate_fn)(struct fsm *fsm, void *context);
 
@@ -80,6 +166,9 @@ typedef struct fsm_state {
     fsm_state_fn on_enter;
     fsm_state_fn on_update;
     fsm_state_fn on_exit;
+    /// @brief Optional, runs right after on_update, and transitions to the state it returns within the same
+    ///        tick (on_exit, then on_enter) without checking any predicate
+    fsm_state_step_fn on_step;
 } fsm_state_t;
 
 /// @brief Describes a transition in the FSM
@@ -94,15 +183,281 @@ typedef struct fsm_predicate_group {
         .predicate_count = sizeof((fsm_transition_predicate_fn[]){__VA_ARGS__}) / sizeof(fsm_transition_predicate_fn) \
     }
 
+/// @brief A predicate group without predicates, for transitions that should always be taken
+#define FSM_PREDICATE_GROUP_EMPTY ((fsm_predicate_group_t){.predicates = NULL, .predicate_count = 0})
+
 /// @brief Describes a transition in the FSM
 /// @note This is an internal structure used to store transitions
 ///      in the FSM, do not use this directly
 typedef struct __fsm_transition {
-    fsm_state_t *from;
-    fsm_state_t *to;
-    fsm_predicate_group_t *predicates;
+    fsm_state_id from;
+    fsm_state_id to;
+    fsm_event_id event;                // FSM_NO_EVENT for the transitions fsm_run checks
+    fsm_guard_id guard;                // FSM_NO_GUARD if the transition only has predicates
+    fsm_predicate_group_t predicates;  // the predicate array is owned by the FSM
+    fsm_transition_selector_fn selector;  // picks the target at run time (then `to` is unused), or NULL
 } __fsm_transition_t;
 
+/// @brief The type of a context field compared by a guard
+typedef enum fsm_field_type {
+    FSM_FIELD_I8,
+    FSM_FIELD_I16,
+    FSM_FIELD_I32,
+    FSM_FIELD_I64,
+    FSM_FIELD_U8,
+    FSM_FIELD_U16,
+    FSM_FIELD_U32,
+    FSM_FIELD_U64,
+    FSM_FIELD_F32,
+    FSM_FIELD_F64,
+} fsm_field_type_t;
+
+/// @brief How a guard compares a context field (on the left) to its constant (on the right)
+typedef enum fsm_compare_op {
+    FSM_EQ,
+    FSM_NE,
+    FSM_LT,
+    FSM_LE,
+    FSM_GT,
+    FSM_GE,
+} fsm_compare_op_t;
+
+/// @brief The constant a guard compares a field to, `f` for float fields, `i` / `u` for the others
+/// @note This is an internal structure, do not use this directly
+typedef union __fsm_guard_value {
+    int64_t i;
+    uint64_t u;
+    double f;
+} __fsm_guard_value_t;
+
+#define __FSM_GUARD_COMPARE 0
+#define __FSM_GUARD_AND 1
+#define __FSM_GUARD_OR 2
+#define __FSM_GUARD_NOT 3
+
+/// @brief A node of a declarative guard, as built -- a field comparison, or AND / OR / NOT of other guards
+/// @note This is an internal structure, do not use this directly
+/// @note Nodes are hash-consed, so equal guards share a node and can be evaluated once
+typedef struct __fsm_guard_node {
+    uint8_t kind;     // __FSM_GUARD_xxx
+    uint8_t type;     // fsm_field_type_t, for comparisons
+    uint8_t compare;  // fsm_compare_op_t, for comparisons
+    uint32_t offset;  // of the field in the context, for comparisons
+    __fsm_guard_value_t constant;
+    fsm_guard_id operands[2];  // for AND / OR (both) and NOT (the first)
+    uint32_t cost;  // a rough cost of evaluating the guard, operands are evaluated cheapest first
+    uint32_t size;  // the number of instructions the guard compiles to
+    uint64_t reads;  // the context granules the guard reads, see FSM_OPTION_DEPENDENCY_TRACKING
+} __fsm_guard_node_t;
+
+#define __FSM_GUARD_OP_END 0
+#define __FSM_GUARD_OP_JUMP_IF_FALSE 1
+#define __FSM_GUARD_OP_JUMP_IF_TRUE 2
+#define __FSM_GUARD_OP_NOT 3
+/// @brief Comparisons have one opcode per field type and fsm_compare_op_t, so they dispatch in one go
+#define __FSM_GUARD_OP_COMPARE(type, compare) (4 + (type) * 6 + (compare))
+
+/// @brief An instruction of a compiled guard
+/// @note This is an internal structure, do not use this directly
+/// @note The guard interpreter has a single boolean register. Comparisons set it, jumps test it,
+///       and END returns it, so AND / OR short-circuit by jumping over the remaining operands.
+typedef struct __fsm_guard_insn {
+    uint8_t op;       // __FSM_GUARD_OP_xxx
+    uint8_t memo;     // the memo slot of the comparison, or FSM_MEMO_NONE
+    uint16_t __unused;
+    uint32_t offset;  // the field offset for comparisons, the target (from the start of the guard) for jumps
+    __fsm_guard_value_t constant;
+} __fsm_guard_insn_t;
+
+/// @brief A slot in the FSM's state name hash table
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_name_slot {
+    fsm_size_t hash;
+    fsm_state_id state;  // FSM_INVALID_STATE if the slot is empty
+} __fsm_name_slot_t;
+
+/// @brief A block of memory in an FSM's arena, the allocations follow this header
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_arena_block {
+    struct __fsm_arena_block *next;
+    fsm_size_t size;  // usable bytes after the header
+    fsm_size_t used;
+} __fsm_arena_block_t;
+
+/// @brief The header of an arena allocation that can be reused once it's freed, see __fsm_alloc_reusable
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_arena_chunk {
+    struct __fsm_arena_chunk *next;  // the next free chunk, while this one is free
+    fsm_size_t size;                 // usable bytes after the header
+} __fsm_arena_chunk_t;
+
+/// @brief Groups with at most this many predicates are stored inside the compiled transition record
+#define FSM_INLINE_PREDICATES 2
+
+/// @brief Alignment of the sections of a compiled FSM image, one cache line
+#define FSM_IMAGE_ALIGNMENT 64
+
+/// @brief A state in a compiled FSM image -- the hot data fsm_run needs for the state
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_image_state {
+    fsm_state_fn on_enter;
+    fsm_state_fn on_update;
+    fsm_state_fn on_exit;
+    fsm_state_step_fn on_step;
+    uint32_t transition_begin;  // outgoing transitions are transitions[begin .. end - 1]
+    uint32_t transition_end;
+} __fsm_image_state_t;
+
+/// @brief Set in the `to` of a compiled transition whose target is picked by a selector, the rest of `to` is
+///        the selector's index in the image's `selectors`
+#define __FSM_TARGET_SELECTOR 0x80000000u
+
+/// @brief A transition in a compiled FSM image
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_image_transition {
+    uint32_t to;  // the target, or __FSM_TARGET_SELECTOR | the selector's index
+    uint32_t guard;  // where the transition's guard code starts in the image's guard_code, or UINT32_MAX
+    uint32_t predicate_count;
+    union {
+        /// @brief Used when predicate_count <= FSM_INLINE_PREDICATES
+        fsm_transition_predicate_fn inline_predicates[FSM_INLINE_PREDICATES];
+        /// @brief Used for bigger groups, points into the image's predicate pool
+        fsm_transition_predicate_fn *predicates;
+    } group;
+} __fsm_image_transition_t;
+
+/// @brief Marks a predicate that isn't memoized, see __fsm_image_t.memo_slots
+#define FSM_MEMO_NONE 0xFFu
+
+/// @brief The most distinct predicates memoized per state, one bit each
+#define FSM_MEMO_MAX 64
+
+/// @brief One distinct predicate or guard of a state's transitions, see __fsm_image_t.select_bits
+/// @note This is an internal structure, do not use this directly
+/// @note Bit i of the masks stands for the state's i-th transition. Each state's bits start with a header,
+///       whose `guard` is the number of bits that follow, `blocks` the transitions the state doesn't have,
+///       and `settles` the transitions that need nothing.
+typedef struct __fsm_image_select_bit {
+    fsm_transition_predicate_fn predicate;  // NULL for a guard (and the header)
+    uint32_t guard;                         // where the guard's code starts in the image's guard_code
+    uint64_t blocks;                        // the transitions that need this to hold
+    uint64_t settles;                       // the transitions this is the last requirement of
+} __fsm_image_select_bit_t;
+
+/// @brief The most transitions out of a state that can be selected with bitmasks, one bit each
+#define FSM_SELECT_MAX 64
+
+/// @brief What FSM_OPTION_ADAPTIVE_ORDER has observed of one predicate of a transition
+typedef struct fsm_predicate_stats {
+    fsm_transition_predicate_fn predicate;
+    uint64_t samples;  // how many timed calls, halved after every reordering so old behaviour fades
+    uint64_t passes;   // how many of those returned true
+    uint64_t cycles;   // the time spent in those, in CPU cycles (0 where there's no cycle counter)
+} fsm_predicate_stats_t;
+
+/// @brief The predicate statistics of an FSM using FSM_OPTION_ADAPTIVE_ORDER, rebuilt with its image
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_adaptive {
+    uint32_t *offsets;             // per state (and the any-state range), where its predicates start in `stats`
+    fsm_predicate_stats_t *stats;  // per predicate of the transitions fsm_run checks, in scan order
+    uint64_t scans;                // transition scans so far
+    uint64_t sampled_scans;        // timed transition scans so far
+} __fsm_adaptive_t;
+
+/// @brief The context granules a predicate declared it reads, see fsm_predicate_reads
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_predicate_reads {
+    fsm_transition_predicate_fn predicate;
+    uint64_t reads;
+} __fsm_predicate_reads_t;
+
+/// @brief The cached transition results of an FSM using FSM_OPTION_DEPENDENCY_TRACKING, rebuilt with its image
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_tracking {
+    /// @brief Per transition fsm_run checks, the context granules its guard and predicates read, or 0 if
+    ///        one of its predicates didn't declare its reads (then it's always checked)
+    uint64_t *reads;
+    /// @brief Per transition a scan of `state` checks (its own, then the any-state ones), a bit set once it was
+    ///        false, cleared when something it reads is written
+    uint64_t *known_false;
+    fsm_size_t known_false_words;
+    uint32_t state;    // the state known_false is about, UINT32_MAX before the first scan
+    fsm_bool settled;  // every transition out of `state` is known to be false
+} __fsm_tracking_t;
+
+/// @brief A slot in a compiled image's event table, mapping a (state, event) pair to its transitions
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_image_event_slot {
+    uint32_t state;  // UINT32_MAX if the slot is empty
+    uint32_t event;
+    uint32_t transition_begin;  // the pair's transitions are event_transitions[begin .. end - 1]
+    uint32_t transition_end;
+} __fsm_image_event_slot_t;
+
+/// @brief A compiled, read-only runtime image of an FSM definition
+/// @note This is an internal structure, do not use this directly
+/// @note Everything lives in one allocation, each section starting on a cache line.
+///       The hot sections (states, transitions, event table, predicate pool) come first, the names last.
+typedef struct __fsm_image {
+    /// @brief state_count + 1 entries, the last one is only the range of the any-state transitions (see
+    ///        FSM_ANY_STATE), which every state checks after its own. The per-state sections below have an
+    ///        entry for it too, except the names.
+    __fsm_image_state_t *states;
+    __fsm_image_transition_t *transitions;  // only the transitions fsm_run checks, grouped by state
+    __fsm_image_transition_t *event_transitions;  // grouped by (state, event), see event_table
+    __fsm_image_event_slot_t *event_table;        // open-addressing hash table, a power of two in size
+    fsm_transition_predicate_fn *predicate_pool;
+    fsm_transition_selector_fn *selectors;
+    __fsm_guard_insn_t *guard_code;
+
+    /// @brief Per state, where its memo slots start in `memo_slots`, or UINT32_MAX if no predicate
+    ///        appears twice among its transitions (then nothing is memoized)
+    uint32_t *memo_offsets;
+    /// @brief Per predicate of a memoized state's transitions (in scan order), the bit caching its result
+    ///        during a tick, or FSM_MEMO_NONE for predicates that only appear once
+    uint8_t *memo_slots;
+
+    /// @brief Per state, where its header starts in `select_bits`, or UINT32_MAX if its transitions
+    ///        are scanned in order (see FSM_OPTION_BITMASK_SELECTION)
+    uint32_t *select_offsets;
+    __fsm_image_select_bit_t *select_bits;
+
+    uint32_t *name_offsets;  // offset of each state's name in `names`
+    char *names;
+
+    fsm_size_t state_count;
+    fsm_size_t transition_count;
+    fsm_size_t event_transition_count;
+    fsm_size_t event_table_capacity;  // 0 if the FSM has no event transitions
+
+    void *__block;  // the allocation backing all of the above
+} __fsm_image_t;
+
+/// @brief The running state of one instance of an FSM definition -- which state it's in, and its context
+/// @note This is all the per-machine data, the states and transitions live in the definition.
+///       It's 16 bytes on 64-bit targets, so millions of instances can share one definition.
+/// @note Please interact with instances using the fsm_instance_xxx functions
+typedef struct fsm_instance {
+    uint32_t __state;
+    uint32_t __flags;
+    /// @brief Context passed to state functions, not owned by the instance
+    void *context;
+} fsm_instance_t;
+
+/// @brief Set in fsm_instance_t.__flags once the instance has entered its first state
+#define FSM_INSTANCE_RUNNING 0x1u
+
+/// @brief Set in fsm_instance_t.__flags when its last tick stopped at the step bound, see FSM_OPTION_RUN_TO_COMPLETION
+#define FSM_INSTANCE_STEP_BOUND_HIT 0x2u
+
+/// @brief Counters of the work an FSM did, only updated when FSM_STATS is enabled
+/// @note Counters of a definition are shared by all its instances, and are approximate when
+///       several threads tick the instances at once
+typedef struct fsm_stats {
+    fsm_size_t predicate_calls;        // predicates actually called while checking transitions
+    fsm_size_t predicate_calls_saved;  // predicate checks answered with a result memoized earlier in the tick
+} fsm_stats_t;
+
 /// @brief Describes a Finite State Machine
 /// @note This is the main structure used to store the FSM
 /// @note Please interact with the FSM using the functions provided
@@ -113,19 +468,76 @@ typedef struct fsm {
     /// @brief Array of states in the FSM -- strong reference, we own this memory
     fsm_state_t *states;
 
-    /// @brief Array of transitions in the FSM -- strong reference, we own this memory
+    /// @brief Array of transitions in the FSM, in the order they were added -- strong reference, we own this memory
     __fsm_transition_t *transitions;
 
+    /// @brief The compiled runtime image fsm_run works from -- strong reference, we own this memory
+    /// @note Transitions are grouped by their `from` state here, keeping the order they were added in
+    __fsm_image_t __image;
+
+    /// @brief Open-addressing hash table mapping state names to ids, __name_table_capacity slots
+    /// @note Slots reference the names interned in `states`, which the FSM owns
+    __fsm_name_slot_t *__name_table;
+    fsm_size_t __name_table_capacity;
+
     /// @brief Memory allocation function
     fsm_alloc_fn __alloc_fn;
     fsm_dealloc_fn __dealloc_fn;
 
+    /// @brief Arena blocks, newest first, NULL unless created with fsm_create_arena
+    /// @note In arena mode every allocation is carved out of these blocks, and they are only
+    ///       handed back to __dealloc_fn in fsm_destroy
+    __fsm_arena_block_t *__arena;
+    fsm_size_t __arena_block_size;
+    __fsm_arena_chunk_t *__arena_free;  // freed reusable chunks, e.g. the images of earlier compiles
+
     fsm_size_t __context_size;
     fsm_size_t __state_count;
+    fsm_size_t __state_capacity;
     fsm_size_t __transition_count;
-    fsm_size_t __current_state_idx;
+    fsm_size_t __transition_capacity;
+
+    /// @brief The FSM's own running state, its context points at `context`
+    fsm_instance_t __instance;
+
+    /// @brief The payload of the event being dispatched, NULL outside of fsm_dispatch
+    void *__event_payload;
 
-    fsm_bool __is_running;
+    /// @brief Queue of events posted from other threads, NULL unless fsm_attach_queue was called
+    struct __fsm_event_queue *__queue;
+
+    fsm_stats_t __stats;
+
+    /// @brief Predicate statistics for FSM_OPTION_ADAPTIVE_ORDER, NULL when it's off
+    __fsm_adaptive_t *__adaptive;
+
+    /// @brief Cached transition results for FSM_OPTION_DEPENDENCY_TRACKING, NULL when it's off
+    __fsm_tracking_t *__tracking;
+    /// @brief The context granules written since the last transition scan, see fsm_context_write
+    uint64_t __written;
+    /// @brief Bumped on every reported change of the context, see fsm_context_touch
+    uint64_t __context_generation;
+    /// @brief With FSM_OPTION_SKIP_UNCHANGED, the state whose transitions were all false at
+    ///        __settled_generation, UINT32_MAX if there's none
+    uint32_t __settled_state;
+    uint64_t __settled_generation;
+    /// @brief The reads declared with fsm_predicate_reads, one entry per predicate
+    __fsm_predicate_reads_t *__predicate_reads;
+    fsm_size_t __predicate_reads_count;
+    fsm_size_t __predicate_reads_capacity;
+
+    /// @brief The declarative guards built for this FSM, indexed by fsm_guard_id
+    __fsm_guard_node_t *__guards;
+    fsm_size_t __guard_count;
+    fsm_size_t __guard_capacity;
+    /// @brief Open-addressing hash table of guard ids, used to hash-cons the guards
+    fsm_guard_id *__guard_table;
+    fsm_size_t __guard_table_capacity;
+
+    uint32_t __options;       // FSM_OPTION_xxx flags
+    fsm_size_t __step_bound;  // the most transitions per tick with FSM_OPTION_RUN_TO_COMPLETION
+    fsm_bool __is_finalized;  // set by fsm_finalize, the definition can't change anymore
+    fsm_bool __image_dirty;   // true when __image needs recompiling
 } fsm_t;
 
 /// @brief Creates a new FSM, starting with no states or transitions
@@ -136,10 +548,125 @@ typedef struct fsm {
 /// @return A new FSM, allocated using alloc_fn
 fsm_t *fsm_create(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, void *context, size_t context_size);
 
+/// @brief Creates a new FSM whose whole definition lives in a few contiguous arena blocks
+/// @param alloc_fn Memory allocation function, used to allocate the arena blocks
+/// @param dealloc_fn Memory deallocation function, used to free the arena blocks
+/// @param context Context passed to state functions
+/// @param context_size Size of the context
+/// @param arena_size Size of each arena block, more blocks are allocated when one fills up
+/// @return A new FSM, allocated inside the first arena block
+/// @note The FSM, its context, states, names and transitions are all bump-allocated from the arena,
+///       so a transition walk touches adjacent memory, and fsm_destroy only frees the blocks.
+///       Memory released while building (e.g. when an array grows) isn't reused until fsm_destroy,
+///       so pair this with fsm_reserve_states / fsm_reserve_transitions when the sizes are known. The
+///       compiled image is the exception, each recompile reuses an earlier image's memory when it fits.
+fsm_t *fsm_create_arena(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, void *context, size_t context_size,
+                        size_t arena_size);
+
 /// @brief Runs the FSM, starting from the first state
 /// @param fsm The FSM to run
 void fsm_run(fsm_t *fsm);
 
+/// @brief What fsm_run_n and fsm_run_until did
+typedef struct fsm_run_result {
+    fsm_size_t ticks;        // how many ticks ran, each like one fsm_run
+    fsm_size_t transitions;  // how many transitions those ticks took, including the ones on_step asked for
+} fsm_run_result_t;
+
+/// @brief Runs the FSM for n ticks, like calling fsm_run n times without the per-call overhead
+/// @param fsm The FSM to run
+/// @param n The number of ticks to run
+/// @return The ticks run and the transitions they took
+/// @note It stops early if a state function stops the FSM with fsm_stop
+fsm_run_result_t fsm_run_n(fsm_t *fsm, fsm_size_t n);
+
+/// @brief Runs the FSM until a predicate holds, checking it before every tick, or for at most max_ticks ticks
+/// @param fsm The FSM to run
+/// @param stop_predicate Checked with the FSM's context before every tick, running stops once it returns true
+/// @param max_ticks The most ticks to run
+/// @return The ticks run and the transitions they took
+/// @note It stops early if a state function stops the FSM with fsm_stop
+fsm_run_result_t fsm_run_until(fsm_t *fsm, fsm_transition_predicate_fn stop_predicate, fsm_size_t max_ticks);
+
+/// @brief Freezes the FSM's definition, compiling it into a packed, cache-aligned runtime image
+/// @param fsm The FSM to finalize
+/// @return true if the FSM was compiled, false if an allocation failed
+/// @note Once finalized, the fsm_add_xxx and fsm_reserve_xxx functions report an error instead of
+///       changing the FSM. Non-finalized FSMs are compiled lazily whenever they change, so this
+///       isn't required, it just moves the work up front and guards against accidental changes.
+fsm_bool fsm_finalize(fsm_t *fsm);
+
+/// @brief Makes fsm_run evaluate each distinct predicate and guard of the current state's transitions at most
+///        once, into a bitmask of the transitions still possible, and take the first transition left standing
+/// @note Every transition keeps its priority, but a predicate may be called even though an earlier transition
+///       turns out to be taken, and the predicates of a transition aren't called in order. For states with
+///       many transitions sharing predicates, selection then costs about one call per distinct predicate,
+///       instead of one per predicate of every transition checked. States with more than FSM_SELECT_MAX
+///       transitions are still scanned in order.
+#define FSM_OPTION_BITMASK_SELECTION 0x1u
+
+/// @brief Makes fsm_run time the predicates of every FSM_ADAPTIVE_SAMPLE_INTERVAL-th transition scan, and every
+///        FSM_ADAPTIVE_PERIOD timed scans reorder the predicates of each transition so the cheapest, most
+///        often false ones are checked first (by cycles / (1 - pass rate)), see fsm_get_predicate_stats
+/// @note Only the order within a transition changes, transitions keep their priority. States selected with
+///       FSM_OPTION_BITMASK_SELECTION aren't reordered. fsm_definition_create rejects this option, as instances
+///       may run on several threads.
+#define FSM_OPTION_ADAPTIVE_ORDER 0x2u
+
+/// @brief Makes fsm_run remember which transitions out of the current state were false, and skip them until
+///        one of the context fields they read is written with fsm_context_write
+/// @note A transition is only skipped when its guard and all of its predicates have known reads: guards know
+///       theirs, predicates declare them with fsm_predicate_reads. Predicates must then only depend on those
+///       fields, and every write to them must be reported, or a transition may be missed. The cache is reset
+///       whenever the state changes. Fields are tracked in FSM_TRACKING_GRANULE-byte granules folded into 64
+///       bits, so fields sharing a bit only cost extra checks. States selected with FSM_OPTION_BITMASK_SELECTION
+///       are checked as usual. fsm_definition_create rejects this option.
+#define FSM_OPTION_DEPENDENCY_TRACKING 0x4u
+
+/// @brief Makes fsm_run skip the whole transition scan while the context generation hasn't moved since the
+///        current state's transitions were last all false, see fsm_context_touch
+/// @note Predicates and guards must then only depend on the context, and every change to it must be reported
+///       (with fsm_context_touch, fsm_context_write or FSM_CONTEXT_SET), including the ones state functions
+///       make. It's coarser than FSM_OPTION_DEPENDENCY_TRACKING but needs no declarations, and the two combine.
+///       fsm_definition_create rejects this option.
+#define FSM_OPTION_SKIP_UNCHANGED 0x8u
+
+/// @brief Makes a tick keep taking transitions until none applies, or until it took as many as the step bound
+///        (FSM_STEP_BOUND, see fsm_set_step_bound), instead of taking at most one
+/// @note Every transition calls on_exit and on_enter as usual, on_update (and on_step) only runs once, on the
+///       state the tick settled in. fsm_step_bound_hit tells if the last tick stopped at the bound with a
+///       transition still ready, which is how a cycle of transitions that are always ready shows up. To know,
+///       a tick that reaches the bound scans the transitions once more without taking the one it finds, so
+///       the predicates and selectors of that scan run (and count in FSM_STATS) one extra time. Instances of
+///       a definition run this way too, but pools still take one transition per tick.
+#define FSM_OPTION_RUN_TO_COMPLETION 0x10u
+
+/// @brief Sets the FSM's opt-in behaviours
+/// @param fsm The FSM to set the options of
+/// @param options The FSM_OPTION_xxx flags to enable, all others are disabled
+/// @return true if the options were set, false if the FSM is finalized
+fsm_bool fsm_set_options(fsm_t *fsm, uint32_t options);
+
+/// @brief Sets how many transitions one tick takes at most with FSM_OPTION_RUN_TO_COMPLETION
+/// @param fsm The FSM to set the step bound of
+/// @param step_bound The most transitions per tick, at least 1
+/// @return true if the bound was set, false if it's 0
+/// @note This doesn't change the definition, so it can be called on a finalized FSM
+fsm_bool fsm_set_step_bound(fsm_t *fsm, fsm_size_t step_bound);
+
+/// @brief Declares that a predicate reads a field of the context, see FSM_OPTION_DEPENDENCY_TRACKING
+/// @param fsm The FSM the predicate is used in
+/// @param predicate The predicate, wherever it's used in the FSM
+/// @param offset The offset of the field in the context
+/// @param size The size of the field
+/// @return true if the read was recorded, false if the FSM is finalized or an allocation failed
+/// @note Call this once per field the predicate reads
+fsm_bool fsm_predicate_reads(fsm_t *fsm, fsm_transition_predicate_fn predicate, fsm_size_t offset, fsm_size_t size);
+
+/// @brief Declares that a predicate reads `field` of a context of type `type`
+#define FSM_PREDICATE_READS(fsm, predicate, type, field) \
+    fsm_predicate_reads(fsm, predicate, offsetof(type, field), sizeof(((type *)0)->field))
+
 /// @brief Stops the FSM, preventing it from running
 /// @param fsm The FSM to stop
 void fsm_stop(fsm_t *fsm);
@@ -148,6 +675,14 @@ void fsm_stop(fsm_t *fsm);
 /// @param fsm The FSM to destroy
 void fsm_destroy(fsm_t *fsm);
 
+/// @brief Finds a state in the FSM by name
+/// @param fsm The FSM to search
+/// @param state_name The name of the state to find
+/// @return The id of the state, or FSM_INVALID_STATE if there is no state with that name
+/// @note This is a hash table lookup, so it takes O(1) regardless of the number of states.
+///       If several states share a name, the first one added is returned.
+fsm_state_id fsm_find_state(fsm_t *fsm, const char *state_name);
+
 /// @brief Sets the current state of the FSM
 /// @param fsm The FSM to set the state of
 /// @param state_name The name of the state to set
@@ -155,6 +690,12 @@ void fsm_destroy(fsm_t *fsm);
 ///       This is mainly so you can set the initial state of the FSM, which defaults to the first state
 void fsm_set_state(fsm_t *fsm, char *state_name);
 
+/// @brief Sets the current state of the FSM by id, without looking up the state by name
+/// @param fsm The FSM to set the state of
+/// @param state The id of the state to set, as returned by fsm_add_state
+/// @note Behaves exactly like fsm_set_state
+void fsm_set_state_id(fsm_t *fsm, fsm_state_id state);
+
 /*
  * Note about the fsm_add_xxx functions:
  * Whenever you add a state or transition to the FSM, the FSM will take ownership of the memory
@@ -167,30 +708,80 @@ void fsm_set_state(fsm_t *fsm, char *state_name);
 /// @brief Adds a state to the FSM
 /// @param fsm The FSM to add the state to
 /// @param state The state to add
+/// @return The id of the new state, or FSM_INVALID_STATE if it couldn't be added
 /// @note The FSM will take ownership of the memory of the state, making a copy of it
-void fsm_add_state(fsm_t *fsm, fsm_state_t state);
+fsm_state_id fsm_add_state(fsm_t *fsm, fsm_state_t state);
+
+/// @brief Reserves room for a number of states, so adding up to that many doesn't allocate
+/// @param fsm The FSM to reserve states in
+/// @param state_count The total number of states the FSM should have room for
+/// @return true if the FSM has room for state_count states, false if an allocation failed
+/// @note The arrays grow geometrically anyway, this just avoids the intermediate allocations
+fsm_bool fsm_reserve_states(fsm_t *fsm, fsm_size_t state_count);
+
+/// @brief Reserves room for a number of transitions, so adding up to that many doesn't grow the transition array
+/// @param fsm The FSM to reserve transitions in
+/// @param transition_count The total number of transitions the FSM should have room for
+/// @return true if the FSM has room for transition_count transitions, false if an allocation failed
+/// @note Remember that fsm_add_transition_to_all adds one transition per state
+fsm_bool fsm_reserve_transitions(fsm_t *fsm, fsm_size_t transition_count);
 
 /// @brief Adds a transition to the FSM
 /// @param fsm The FSM to add the transition to
 /// @param from The name of the state to transition from
 /// @param to The name of the state to transition to
 /// @param predicates The predicates that must be true for the transition to occur
+/// @return true if the transition was added
+/// @note The FSM will take ownership of the memory of the predicates, making a copy of it
+fsm_bool fsm_add_transition(fsm_t *fsm, char *from, char *to, fsm_predicate_group_t predicates);
+
+/// @brief Adds a transition to the FSM by state id, without looking up the states by name
+/// @param fsm The FSM to add the transition to
+/// @param from The id of the state to transition from
+/// @param to The id of the state to transition to
+/// @param predicates The predicates that must be true for the transition to occur
+/// @return true if the transition was added
 /// @note The FSM will take ownership of the memory of the predicates, making a copy of it
-void fsm_add_transition(fsm_t *fsm, char *from, char *to, fsm_predicate_group_t predicates);
+fsm_bool fsm_add_transition_id(fsm_t *fsm, fsm_state_id from, fsm_state_id to, fsm_predicate_group_t predicates);
 
 /// @brief Adds a transition from all states to a specific state
 /// @param fsm The FSM to add the transition to
 /// @param to The name of the state to transition to
 /// @param predicates The predicates that must be true for the transition to occur
+/// @return true if the transition was added
 /// @note The FSM will take ownership of the memory of the predicates, making a copy of it
-void fsm_add_transition_from_all(fsm_t *fsm, char *to, fsm_predicate_group_t predicates);
+/// @note This is a single transition from FSM_ANY_STATE, which also covers the states added later. Every state
+///       checks it after its own transitions, any-state transitions among themselves in the order they were added.
+///       The target is included, so it transitions to itself while the predicates hold. This used to append a
+///       copy per state in call order, so one added before a state's own transitions took priority over them.
+fsm_bool fsm_add_transition_from_all(fsm_t *fsm, char *to, fsm_predicate_group_t predicates);
 
 /// @brief Adds a transition to all states from a specific state
 /// @param fsm The FSM to add the transition to
 /// @param from The name of the state to transition from
 /// @param predicates The predicates that must be true for the transition to occur
+/// @return true if every transition was added
 /// @note The FSM will take ownership of the memory of the predicates, making a copy of it
-void fsm_add_transition_to_all(fsm_t *fsm, char *from, fsm_predicate_group_t predicates);
+/// @note Only the first of these transitions can ever be taken, see fsm_add_selector_transition to pick the
+///       target at run time instead
+fsm_bool fsm_add_transition_to_all(fsm_t *fsm, char *from, fsm_predicate_group_t predicates);
+
+/// @brief Adds a transition whose target is picked at run time by a selector, once its predicates hold
+/// @param fsm The FSM to add the transition to
+/// @param from The name of the state to transition from
+/// @param predicates The predicates that must be true before the selector is called, may be empty
+/// @param selector Returns the state to transition to, or FSM_STAY to have the next transition checked instead
+/// @return true if the transition was added
+/// @note The FSM will take ownership of the memory of the predicates, making a copy of it
+/// @note A dispatcher state then takes one check and a jump instead of a scan over one transition per target.
+///       A returned id that isn't a state is logged and treated like FSM_STAY. FSM_OPTION_DEPENDENCY_TRACKING
+///       always checks these transitions, as it can't know what the selector reads.
+fsm_bool fsm_add_selector_transition(fsm_t *fsm, char *from, fsm_predicate_group_t predicates,
+                                     fsm_transition_selector_fn selector);
+
+/// @brief Adds a selector transition by state id, `from` may be FSM_ANY_STATE, see fsm_add_selector_transition
+fsm_bool fsm_add_selector_transition_id(fsm_t *fsm, fsm_state_id from, fsm_predicate_group_t predicates,
+                                        fsm_transition_selector_fn selector);
 
 /// @brief Gets the number of states in the FSM
 /// @param fsm The FSM to get the state count of
@@ -202,438 +793,4460 @@ inline fsm_size_t fsm_transition_count(fsm_t *fsm) { return fsm->__transition_co
 
 /// @brief Gets the name of the current state of the FSM
 /// @param fsm The FSM to get the current state of
-inline char *fsm_current_state(fsm_t *fsm) { return fsm->states[fsm->__current_state_idx].name; }
+inline char *fsm_current_state(fsm_t *fsm) { return fsm->states[fsm->__instance.__state].name; }
+
+/// @brief Gets the id of the current state of the FSM
+/// @param fsm The FSM to get the current state of
+inline fsm_state_id fsm_current_state_id(fsm_t *fsm) { return fsm->__instance.__state; }
 
 /// @brief Checks if the FSM is running
 /// @param fsm The FSM to check if it is running
-inline fsm_bool fsm_is_running(fsm_t *fsm) { return fsm->__is_running; }
+inline fsm_bool fsm_is_running(fsm_t *fsm) { return (fsm->__instance.__flags & FSM_INSTANCE_RUNNING) != 0; }
+
+/// @brief Checks if the FSM has been finalized with fsm_finalize
+/// @param fsm The FSM to check
+inline fsm_bool fsm_is_finalized(fsm_t *fsm) { return fsm->__is_finalized; }
+
+/// @brief Gets what FSM_OPTION_ADAPTIVE_ORDER has observed of the predicates of a transition
+/// @param fsm The FSM, with FSM_OPTION_ADAPTIVE_ORDER set
+/// @param state The state the transition goes out of
+/// @param transition Which of the transitions fsm_run checks out of the state, in the order they were added,
+///        then the any-state ones, whose statistics every state shares
+/// @param stats Receives the statistics of the transition's predicates, in the order they're now checked
+/// @param capacity How many statistics fit in `stats`
+/// @return The number of predicates of the transition, 0 if there's no such transition or the option is off
+fsm_size_t fsm_get_predicate_stats(fsm_t *fsm, fsm_state_id state, fsm_size_t transition,
+                                   fsm_predicate_stats_t *stats, fsm_size_t capacity);
+
+/// @brief Gets the FSM's FSM_OPTION_xxx flags
+/// @param fsm The FSM to get the options of
+inline uint32_t fsm_get_options(fsm_t *fsm) { return fsm->__options; }
+
+/// @brief Checks if the last fsm_run stopped at the step bound while another transition was still ready
+/// @param fsm The FSM to check, using FSM_OPTION_RUN_TO_COMPLETION
+/// @note The tick finds out with one more transition scan at the bound, see FSM_OPTION_RUN_TO_COMPLETION
+inline fsm_bool fsm_step_bound_hit(fsm_t *fsm) { return (fsm->__instance.__flags & FSM_INSTANCE_STEP_BOUND_HIT) != 0; }
+
+/// @brief Gets the bits of the context granules covering [offset, offset + size)
+/// @note This is an internal function, do not use this directly
+inline uint64_t __fsm_field_mask(fsm_size_t offset, fsm_size_t size) {
+    fsm_size_t first = offset / FSM_TRACKING_GRANULE;
+    fsm_size_t last = (offset + (size ? size : 1) - 1) / FSM_TRACKING_GRANULE;
+    if (last - first >= 63) {
+        return ~(uint64_t)0;
+    }
+    uint64_t mask = 0;
+    for (fsm_size_t g = first; g <= last; g++) {
+        mask |= (uint64_t)1 << (g & 63);
+    }
+    return mask;
+}
+
+/// @brief Reports a write to a field of the FSM's context, so fsm_run checks the transitions reading it again
+/// @param fsm The FSM whose context was written
+/// @param offset The offset of the field in the context
+/// @param size The size of the field, pass the context's size to report that all of it changed
+/// @note Only needed with FSM_OPTION_DEPENDENCY_TRACKING or FSM_OPTION_SKIP_UNCHANGED, it's a couple of
+///       instructions for a constant field. This bumps the context generation too.
+inline void fsm_context_write(fsm_t *fsm, fsm_size_t offset, fsm_size_t size) {
+    fsm->__written |= __fsm_field_mask(offset, size);
+    fsm->__context_generation++;
+}
+
+/// @brief Reports that the FSM's context changed, without saying where, bumping its generation
+/// @param fsm The FSM whose context changed
+/// @note Every field counts as written for FSM_OPTION_DEPENDENCY_TRACKING
+inline void fsm_context_touch(fsm_t *fsm) {
+    fsm->__written = ~(uint64_t)0;
+    fsm->__context_generation++;
+}
+
+/// @brief Gets the generation of the FSM's context, which every reported change bumps
+/// @param fsm The FSM to get the context generation of
+inline uint64_t fsm_context_generation(fsm_t *fsm) { return fsm->__context_generation; }
+
+/// @brief Sets `field` of the FSM's context of type `type` to `value`, reporting the write
+/// @note The context is the FSM's own copy, the one fsm_create made
+#define FSM_CONTEXT_SET(fsm, type, field, value) \
+    ((void)(FSM_GET_CONTEXT(fsm, type)->field = (value)), FSM_CONTEXT_WRITE(fsm, type, field))
+
+/// @brief Reports a write to `field` of the FSM's context of type `type`, see fsm_context_write
+#define FSM_CONTEXT_WRITE(fsm, type, field) \
+    fsm_context_write(fsm, offsetof(type, field), sizeof(((type *)0)->field))
+
+/// @brief Gets the FSM's counters, which are all zero unless FSM_STATS is enabled
+/// @param fsm The FSM to get the counters of
+inline fsm_stats_t fsm_get_stats(fsm_t *fsm) { return fsm->__stats; }
+
+/// @brief Resets the FSM's counters
+/// @param fsm The FSM to reset the counters of
+void fsm_reset_stats(fsm_t *fsm);
 
 /// @brief Creates a new FSM given a context, using malloc and free as alloc/dealloc functions
-#define FSM_CREATE(context) fsm_create(malloc, free, context, sizeof(context))
+#define FSM_CREATE(context) fsm_create(malloc, free, context, sizeof(*(context)))
+
+/// @brief Creates a new arena-backed FSM given a context, using malloc and free for the arena blocks
+#define FSM_CREATE_ARENA(context, arena_size) \
+    fsm_create_arena(malloc, free, context, sizeof(*(context)), arena_size)
 
 /// @brief Gets the context of the FSM as a specific type
 /// @param fsm The FSM to get the context of
 /// @param type The type to cast the context to
-#define FSM_GET_CONTEXT(fsm, type) (type *)fsm->context
+#define FSM_GET_CONTEXT(fsm, type) ((type *)(fsm)->context)
 
 /**========================================================================
- *                           Macros and Logging
+ *                                 Events
  *========================================================================**/
 
-#define FSM_LINE __LINE__
-#define FSM_STR_HELPER(x) #x
-#define FSM_STR(x) FSM_STR_HELPER(x)
+/*
+ * Besides the transitions fsm_run checks every tick, a transition can wait for an event.
+ * Event transitions are never checked by fsm_run. Instead, fsm_dispatch looks the current state and
+ * the event up in a hash table of the compiled image, so dispatching an event the current state doesn't
+ * handle costs one lookup and runs no predicates at all. When several transitions handle the same event
+ * in the same state, the first one (in the order they were added) whose predicates all hold is taken.
+ */
 
-#define FSM_ERROR_COLOR "\033[0;31m"
-#define FSM_RESET_COLOR "\033[0m"
+/// @brief Adds a transition that is only taken when an event is dispatched
+/// @param fsm The FSM to add the transition to
+/// @param from The name of the state to transition from
+/// @param event The event that triggers the transition, anything but FSM_NO_EVENT
+/// @param to The name of the state to transition to
+/// @param predicates Guards that must all be true for the transition to occur, FSM_PREDICATE_GROUP_EMPTY for none
+/// @return true if the transition was added
+/// @note The FSM will take ownership of the memory of the predicates, making a copy of it
+fsm_bool fsm_add_event_transition(fsm_t *fsm, char *from, fsm_event_id event, char *to,
+                                  fsm_predicate_group_t predicates);
 
-#ifdef FSM_DEBUG
-#define FSM_DEUBG_PREFIX "[fsm.h:" FSM_STR(FSM_LINE) "] "
-#define FSM_LOG(fmt, ...) printf(FSM_DEUBG_PREFIX fmt, ##__VA_ARGS__)
-#define FSM_LOG_ERROR(fmt, ...) fprintf(stderr, FSM_ERROR_COLOR FSM_DEUBG_PREFIX FSM_RESET_COLOR fmt, ##__VA_ARGS__)
-#else
-#define FSM_LOG(fmt, ...) void(0)
-#define FSM_LOG_ERROR(fmt, ...) void(0)
-#endif  // FSM_DEBUG
+/// @brief Adds a transition that is only taken when an event is dispatched, by state id
+/// @note Behaves exactly like fsm_add_event_transition
+fsm_bool fsm_add_event_transition_id(fsm_t *fsm, fsm_state_id from, fsm_event_id event, fsm_state_id to,
+                                     fsm_predicate_group_t predicates);
+
+/// @brief Dispatches an event to the FSM, taking the first matching event transition out of the current state
+/// @param fsm The FSM to dispatch the event to
+/// @param event The event to dispatch
+/// @param payload Data describing the event, available to the predicates and state functions through
+///        fsm_event_payload while the event is dispatched
+/// @return true if a transition was taken
+/// @note Like fsm_run, this enters the current state first if the FSM isn't running yet.
+///       It only calls on_exit / on_enter, on_update is left to fsm_run.
+fsm_bool fsm_dispatch(fsm_t *fsm, fsm_event_id event, void *payload);
+
+/// @brief Gets the payload of the event being dispatched, or NULL when no event is being dispatched
+/// @param fsm The FSM passed to the predicate or state function
+inline void *fsm_event_payload(fsm_t *fsm) { return fsm->__event_payload; }
 
 /**========================================================================
- *                           Implementation
+ *                           Declarative Guards
  *========================================================================**/
 
-#ifdef FSM_IMPL
+/*
+ * Most predicates just compare a field of the context to a constant. Instead of writing those as
+ * functions, build them as guards: comparisons of a field (offset, type) to a constant, combined
+ * with AND / OR / NOT. Guards are compiled along with the FSM into bytecode for a small interpreter,
+ * so checking one doesn't make a single function call:
+ * - equal guards are merged when they're built, and a comparison checked by several of a state's
+ *   transitions is evaluated once per tick, like shared predicates are
+ * - the operands of AND / OR are evaluated cheapest first, and short-circuit
+ *
+ * Guard ids belong to the FSM they were built for. A transition's guard is checked before its predicates.
+ *
+ *  fsm_guard_id rested = FSM_GUARD_FIELD(fsm, agent_context_t, stamina, FSM_GE, 10);
+ *  fsm_guard_id calm = fsm_guard_not(fsm, FSM_GUARD_FIELD(fsm, agent_context_t, alert, FSM_NE, 0));
+ *  fsm_add_guard_transition(fsm, "Idle", "Walk", fsm_guard_and(fsm, rested, calm));
+ */
 
-#include <stdio.h>   // optional, for debug prints if needed
-#include <string.h>  // for memcpy, strlen, etc.
+/// @brief Builds a guard comparing an integer field of the context to a constant
+/// @param fsm The FSM the guard is for
+/// @param offset The offset of the field in the context
+/// @param type The type of the field, float fields are compared to (double)constant
+/// @param op How to compare the field to the constant
+/// @param constant The constant, compared as a uint64_t for unsigned fields
+/// @return The guard, or FSM_NO_GUARD if it couldn't be built
+fsm_guard_id fsm_guard_compare_int(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                   int64_t constant);
 
-#include "fsm.h"
+/// @brief Builds a guard comparing a floating point field of the context to a constant
+/// @note Behaves like fsm_guard_compare_int. Integer fields are compared to the constant without rounding it,
+///       so `>= 2.5` holds from 3 on, and `== 2.5` never holds
+fsm_guard_id fsm_guard_compare_float(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                     double constant);
 
-/// @brief Copies a string using the FSM's allocator
-/// @param fsm The FSM with the allocator
-/// @param src The string to copy
-/// @return A newly allocated copy of `src`, or NULL on failure
-char *__fsm_strdup(fsm_t *fsm, const char *src) {
-    if (!src) {
-        return NULL;
-    }
-    size_t len = strlen(src) + 1;
-    char *dst = (char *)fsm->__alloc_fn(len);
-    if (dst) {
-        memcpy(dst, src, len);
-    }
-    return dst;
-}
+/// @brief Builds a guard that holds when both guards do
+fsm_guard_id fsm_guard_and(fsm_t *fsm, fsm_guard_id a, fsm_guard_id b);
 
-/// @brief Helper to compare state pointers to find index
-fsm_size_t __fsm_state_ptr_index(fsm_t *fsm, fsm_state_t *state_ptr) {
-    for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
-        if (&fsm->states[i] == state_ptr) {
-            return i;
-        }
-    }
-    return (fsm_size_t)-1;  // Not found
-}
+/// @brief Builds a guard that holds when either guard does
+fsm_guard_id fsm_guard_or(fsm_t *fsm, fsm_guard_id a, fsm_guard_id b);
 
-fsm_size_t __fsm_state_index(fsm_t *fsm, char *name) {
-    if (!fsm || !name) {
-        return (fsm_size_t)-1;
-    }
-    for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
-        if (fsm->states[i].name && strcmp(fsm->states[i].name, name) == 0) {
-            return i;
-        }
-    }
-    return (fsm_size_t)-1;
-}
+/// @brief Builds a guard that holds when the given guard doesn't
+fsm_guard_id fsm_guard_not(fsm_t *fsm, fsm_guard_id guard);
 
-fsm_size_t __fsm_transition_index(fsm_t *fsm, char *from, char *to) {
-    if (!fsm || !from || !to) {
-        return (fsm_size_t)-1;
-    }
-    fsm_size_t from_idx = __fsm_state_index(fsm, from);
-    fsm_size_t to_idx = __fsm_state_index(fsm, to);
-    if (from_idx == (fsm_size_t)-1 || to_idx == (fsm_size_t)-1) {
-        return (fsm_size_t)-1;
-    }
+/// @brief Adds a transition taken when a guard holds, see fsm_add_transition
+fsm_bool fsm_add_guard_transition(fsm_t *fsm, char *from, char *to, fsm_guard_id guard);
 
-    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
-        __fsm_transition_t *t = &fsm->transitions[i];
-        // Compare pointer addresses
-        if (t->from == &fsm->states[from_idx] && t->to == &fsm->states[to_idx]) {
-            return i;
-        }
-    }
-    return (fsm_size_t)-1;
-}
+/// @brief Adds a transition taken when a guard holds, by state id, see fsm_add_transition_id
+fsm_bool fsm_add_guard_transition_id(fsm_t *fsm, fsm_state_id from, fsm_state_id to, fsm_guard_id guard);
 
-fsm_t *fsm_create(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, void *context, size_t context_size) {
-    if (!alloc_fn || !dealloc_fn) {
-        return NULL;
-    }
+/// @brief Gets the fsm_field_type_t of an expression
+#define FSM_FIELD_TYPE_OF(expression)                                                  \
+    _Generic((expression),                                                              \
+        _Bool: FSM_FIELD_U8,                                                            \
+        char: ((char)-1 < 0 ? FSM_FIELD_I8 : FSM_FIELD_U8),                             \
+        signed char: FSM_FIELD_I8,                                                      \
+        unsigned char: FSM_FIELD_U8,                                                    \
+        short: FSM_FIELD_I16,                                                           \
+        unsigned short: FSM_FIELD_U16,                                                  \
+        int: FSM_FIELD_I32,                                                             \
+        unsigned int: FSM_FIELD_U32,                                                    \
+        long: (sizeof(long) == 8 ? FSM_FIELD_I64 : FSM_FIELD_I32),                      \
+        unsigned long: (sizeof(unsigned long) == 8 ? FSM_FIELD_U64 : FSM_FIELD_U32),    \
+        long long: FSM_FIELD_I64,                                                       \
+        unsigned long long: FSM_FIELD_U64,                                              \
+        float: FSM_FIELD_F32,                                                           \
+        double: FSM_FIELD_F64)
 
-    // Allocate the FSM structure
-    fsm_t *fsm = (fsm_t *)alloc_fn(sizeof(fsm_t));
-    if (!fsm) {
-        return NULL;
-    }
+/// @brief Builds a guard comparing a field of the context struct to a constant, working out its offset and type
+/// @param fsm The FSM the guard is for
+/// @param context_type The type of the context
+/// @param field The name of the field
+/// @param op How to compare the field to the constant, one of the fsm_compare_op_t
+/// @param constant The constant to compare the field to, a floating point constant isn't rounded for integer fields
+#define FSM_GUARD_FIELD(fsm, context_type, field, op, constant)                                             \
+    _Generic((((context_type *)0)->field),                                                                  \
+        float: fsm_guard_compare_float,                                                                     \
+        double: fsm_guard_compare_float,                                                                    \
+        default: _Generic((constant),                                                                       \
+            float: fsm_guard_compare_float,                                                                 \
+            double: fsm_guard_compare_float,                                                                \
+            default: fsm_guard_compare_int))((fsm), offsetof(context_type, field),                          \
+                                             FSM_FIELD_TYPE_OF(((context_type *)0)->field), (op), (constant))
 
-    // Initialize everything
-    fsm->context = NULL;
-    fsm->states = NULL;
-    fsm->transitions = NULL;
+/*
+ * A guard can also be checked against many contexts at once, e.g. every instance of a pool in the
+ * same state, without compiling or running the FSM. The contexts are laid out either
+ * - as an array of structs, `stride` bytes apart, or
+ * - as a struct of arrays (stride FSM_GUARD_SOA): the field at offset `o` of context `i` is the
+ *   i-th element of the array of that field's type starting at offset `o`
+ * The comparisons run 8 (AVX2) or 4 (SSE2) contexts at a time on x86, for 32-bit fields and with
+ * AVX2 for 64-bit ones, and one at a time otherwise. The result is a bitmask, bit `i % 64` of
+ * `mask[i / 64]` is set when the guard holds for context `i`.
+ *
+ *  uint64_t mask[(AGENT_COUNT + 63) / 64];
+ *  fsm_guard_eval_batch(fsm, rested, agents, sizeof(*agents), AGENT_COUNT, mask);
+ *  fsm_predicate_group_eval_batch(fsm, FSM_PREDICATE_GROUP(is_far), agents, sizeof(*agents), AGENT_COUNT, mask);
+ */
 
-    fsm->__alloc_fn = alloc_fn;
-    fsm->__dealloc_fn = dealloc_fn;
+/// @brief Passed as the stride of fsm_guard_eval_batch when the contexts are a struct of arrays
+#define FSM_GUARD_SOA 0
 
-    fsm->__context_size = context_size;
-    fsm->__state_count = 0;
-    fsm->__transition_count = 0;
-    fsm->__current_state_idx = 0;
-    fsm->__is_running = false;
+/// @brief The instruction sets fsm_guard_eval_batch can use
+typedef enum fsm_simd_level {
+    FSM_SIMD_SCALAR,
+    FSM_SIMD_SSE2,
+    FSM_SIMD_AVX2,
+} fsm_simd_level_t;
 
-    // If we have a context and a nonzero size, copy it into FSM->context
-    if (context && context_size > 0) {
-        fsm->context = alloc_fn(context_size);
-        if (fsm->context == NULL) {
-            // Allocation failed, clean up
-            dealloc_fn(fsm);
-            return NULL;
-        }
-        memcpy(fsm->context, context, context_size);
-    }
+/// @brief Checks a guard against many contexts at once
+/// @param fsm The FSM the guard was built for, it may be finalized or owned by a definition
+/// @param guard The guard to check
+/// @param contexts The first context, or the struct of arrays
+/// @param stride The distance between two contexts in bytes, or FSM_GUARD_SOA
+/// @param count The number of contexts
+/// @param mask Receives the results, (count + 63) / 64 words, the bits past count are cleared
+/// @return true if the guard was checked, false if the arguments are invalid
+fsm_bool fsm_guard_eval_batch(const fsm_t *fsm, fsm_guard_id guard, const void *contexts, fsm_size_t stride,
+                              fsm_size_t count, uint64_t *mask);
 
-    return fsm;
-}
+/// @brief Narrows a mask from fsm_guard_eval_batch to the contexts every predicate of a group holds for
+/// @note The predicates are only called for the contexts still set in the mask, in order, stopping at
+///       the first that fails, just like when a transition is checked. The contexts can't be a struct of arrays.
+/// @return true if the predicates were checked, false if the arguments are invalid
+fsm_bool fsm_predicate_group_eval_batch(fsm_t *fsm, fsm_predicate_group_t predicates, void *contexts,
+                                        fsm_size_t stride, fsm_size_t count, uint64_t *mask);
 
-void fsm_run(fsm_t *fsm) {
-    if (!fsm) return;
+/// @brief Gets the instruction set fsm_guard_eval_batch uses on this CPU
+fsm_simd_level_t fsm_guard_batch_level(void);
 
-    // If we were not running before, mark running and call on_enter of the current state
-    if (!fsm->__is_running) {
-        if (fsm->__state_count == 0) {
-            // No states? Nothing to run.
-            return;
-        }
-        fsm->__is_running = true;
+/// @brief Stops fsm_guard_eval_batch from using instruction sets above a level, e.g. to compare against
+///        the scalar path. Not thread safe, call it before evaluating guards.
+void fsm_guard_batch_limit(fsm_simd_level_t level);
 
-        fsm_state_t *initial_state = &fsm->states[fsm->__current_state_idx];
-        if (initial_state->on_enter) {
-            initial_state->on_enter(fsm, fsm->context);
-        }
-    }
+/**========================================================================
+ *                     Shared Definitions and Instances
+ *========================================================================**/
 
-    // If we're not running for some reason, just return
-    if (!fsm->__is_running) {
-        return;
-    }
+/*
+ * When you run many identical machines, build the FSM once and turn it into a definition.
+ * The definition is immutable and reference counted, and every machine is just an fsm_instance_t:
+ * the id of its current state, a few flags, and a pointer to its context.
+ *
+ * State functions and predicates run on an instance receive the definition's FSM as their
+ * `fsm` argument, so use the context (not fsm_current_state) for anything per-instance.
+ */
 
-    // 1. Identify the current state
-    fsm_state_t *current_state = &fsm->states[fsm->__current_state_idx];
+/// @brief An immutable FSM definition, shared by any number of fsm_instance_t
+/// @note Please interact with the definition using the fsm_definition_xxx functions
+typedef struct fsm_definition {
+    fsm_t *__fsm;  // finalized, owned by the definition
+    fsm_size_t __ref_count;
+} fsm_definition_t;
 
-    // 2. Check transitions out of the current state
-    //    We'll apply the first valid transition encountered.
-    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
-        __fsm_transition_t *transition = &fsm->transitions[i];
-        if (transition->from == current_state) {
-            // Check if all predicates in transition->predicates are satisfied
-            fsm_bool transition_ok = true;
-            for (fsm_size_t p = 0; p < transition->predicates->predicate_count; p++) {
-                fsm_transition_predicate_fn predicate_fn = transition->predicates->predicates[p];
-                if (!predicate_fn(fsm, fsm->context)) {
-                    transition_ok = false;
-                    break;
-                }
-            }
+/// @brief Creates a definition from a fully built FSM, finalizing it
+/// @param fsm The FSM to turn into a definition, the definition takes ownership of it
+/// @return A definition with a reference count of 1, or NULL if the FSM has options a definition can't have
+///         (FSM_OPTION_ADAPTIVE_ORDER, FSM_OPTION_DEPENDENCY_TRACKING, FSM_OPTION_SKIP_UNCHANGED) or couldn't
+///         be finalized, in which case the caller still owns the FSM
+/// @note The FSM's current state (see fsm_set_state) becomes the initial state of new instances
+fsm_definition_t *fsm_definition_create(fsm_t *fsm);
 
-            // If all predicates are true, perform the transition
-            if (transition_ok) {
-                // on_exit of current state
-                if (current_state->on_exit) {
-                    current_state->on_exit(fsm, fsm->context);
-                }
+/// @brief Takes a reference to a definition
+/// @return The definition, for convenience
+/// @note Reference counting isn't atomic, retain and release from one thread at a time
+fsm_definition_t *fsm_definition_retain(fsm_definition_t *definition);
 
-                // Switch current_state_idx to the transition target
-                fsm_size_t new_idx = __fsm_state_ptr_index(fsm, transition->to);
-                if (new_idx != (fsm_size_t)-1) {
-                    fsm->__current_state_idx = new_idx;
-                }
+/// @brief Releases a reference to a definition, destroying it and its FSM when the last one goes away
+/// @note Instances don't hold references, keep the definition alive for as long as they're used
+void fsm_definition_release(fsm_definition_t *definition);
 
-                // on_enter of new state
-                if (transition->to->on_enter) {
-                    transition->to->on_enter(fsm, fsm->context);
-                }
+/// @brief Finds a state of the definition by name, see fsm_find_state
+fsm_state_id fsm_definition_find_state(fsm_definition_t *definition, const char *state_name);
 
-                // We handle one transition per fsm_run call (break after the first match)
-                break;
-            }
-        }
-    }
+/// @brief Gets the name of a state of the definition, or NULL if there is no such state
+const char *fsm_definition_state_name(fsm_definition_t *definition, fsm_state_id state);
 
-    // 3. Call on_update of the (possibly new) current state
-    current_state = &fsm->states[fsm->__current_state_idx];
-    if (current_state->on_update) {
-        current_state->on_update(fsm, fsm->context);
+/// @brief Gets the counters of a definition, accumulated over all its instances, see fsm_get_stats
+/// @note With FSM_THREADS, a runner's threads count on their own and fsm_runner_tick adds their counts
+///       once the tick is done, so read them between ticks
+fsm_stats_t fsm_definition_get_stats(fsm_definition_t *definition);
+
+/// @brief Initializes an instance of a definition, in the definition's initial state
+/// @param definition The definition to instantiate
+/// @param instance The instance to initialize
+/// @param context Context passed to state functions, the instance doesn't copy or own it
+void fsm_instance_init(fsm_definition_t *definition, fsm_instance_t *instance, void *context);
+
+/// @brief Runs an instance for one tick, exactly like fsm_run does for an FSM
+void fsm_instance_run(fsm_definition_t *definition, fsm_instance_t *instance);
+
+/// @brief Sets the current state of an instance, exactly like fsm_set_state_id does for an FSM
+void fsm_instance_set_state(fsm_definition_t *definition, fsm_instance_t *instance, fsm_state_id state);
+
+/// @brief Stops an instance, exactly like fsm_stop does for an FSM
+void fsm_instance_stop(fsm_definition_t *definition, fsm_instance_t *instance);
+
+/// @brief Dispatches an event to an instance, exactly like fsm_dispatch does for an FSM
+/// @note The payload is stored in the definition's FSM while the event is dispatched,
+///       so only dispatch to the instances of a definition from one thread at a time
+fsm_bool fsm_instance_dispatch(fsm_definition_t *definition, fsm_instance_t *instance, fsm_event_id event,
+                               void *payload);
+
+/// @brief Runs many instances of the same definition for one tick each, in order
+/// @param definition The definition all the instances share
+/// @param instances The instances to run, each behaves exactly as if fsm_instance_run was called on it
+/// @param count The number of instances
+/// @note This is much faster than calling fsm_run on as many separate FSMs: the definition's tables
+///       are shared and stay in cache, and contexts are prefetched FSM_BATCH_PREFETCH_DISTANCE instances
+///       ahead. Each instance still goes through the same tick as fsm_instance_run.
+void fsm_run_batch(fsm_definition_t *definition, fsm_instance_t *instances, fsm_size_t count);
+
+/// @brief Gets the id of the current state of an instance
+inline fsm_state_id fsm_instance_state(fsm_instance_t *instance) { return instance->__state; }
+
+/// @brief Checks if an instance is running
+inline fsm_bool fsm_instance_is_running(fsm_instance_t *instance) {
+    return (instance->__flags & FSM_INSTANCE_RUNNING) != 0;
+}
+
+/// @brief Checks if the last tick of an instance stopped at the step bound, see fsm_step_bound_hit
+inline fsm_bool fsm_instance_step_bound_hit(fsm_instance_t *instance) {
+    return (instance->__flags & FSM_INSTANCE_STEP_BOUND_HIT) != 0;
+}
+
+/**========================================================================
+ *                              Instance Pools
+ *========================================================================**/
+
+/*
+ * A pool stores the instances of a definition grouped by their current state, as a struct of arrays.
+ * A tick walks one state at a time over a contiguous run of contexts, so each state's functions and
+ * transitions stay hot in the instruction cache and branch predictor, instead of bouncing between
+ * states instance by instance. Instances that transition are moved to their new state's bucket
+ * (swap-remove) at the end of the tick, so the order in which instances are ticked is deterministic.
+ */
+
+/// @brief Handle to an instance in a pool, stable until the instance is removed
+typedef fsm_size_t fsm_pool_handle;
+
+/// @brief Returned in place of an fsm_pool_handle when an instance couldn't be added
+#define FSM_INVALID_HANDLE ((fsm_pool_handle)-1)
+
+/// @brief The instances of a pool that are in one state
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_pool_bucket {
+    void **contexts;
+    fsm_pool_handle *handles;
+    uint32_t *pending;  // the state each instance moves to at the end of the tick, or UINT32_MAX to stay
+    fsm_size_t count;
+    fsm_size_t capacity;
+} __fsm_pool_bucket_t;
+
+/// @brief Where an instance of a pool lives
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_pool_location {
+    uint32_t state;    // UINT32_MAX if the handle is free
+    fsm_size_t slot;   // the slot in the state's bucket, or the next free handle if the handle is free
+} __fsm_pool_location_t;
+
+/// @brief A pool of instances of one definition, grouped by their current state
+/// @note Please interact with the pool using the fsm_pool_xxx functions
+typedef struct fsm_pool {
+    fsm_definition_t *__definition;  // retained by the pool
+    __fsm_pool_bucket_t *__buckets;  // one per state
+
+    __fsm_pool_location_t *__locations;  // indexed by handle
+    fsm_size_t __location_count;
+    fsm_size_t __location_capacity;
+    fsm_pool_handle __free_handle;  // head of the free handle list, FSM_INVALID_HANDLE if empty
+
+    fsm_size_t __instance_count;
+} fsm_pool_t;
+
+/// @brief Creates an empty pool of instances of a definition
+/// @param definition The definition of the instances, the pool takes a reference to it
+/// @return A new pool, allocated with the definition's allocator, or NULL on failure
+fsm_pool_t *fsm_pool_create(fsm_definition_t *definition);
+
+/// @brief Destroys a pool, releasing its reference to the definition
+/// @note The contexts of the instances are not owned by the pool, and are left alone
+void fsm_pool_destroy(fsm_pool_t *pool);
+
+/// @brief Adds an instance to the pool, in the definition's initial state
+/// @param pool The pool to add the instance to
+/// @param context Context passed to state functions, the pool doesn't copy or own it
+/// @return The handle of the new instance, or FSM_INVALID_HANDLE if an allocation failed
+/// @note The initial state's on_enter is called right away
+fsm_pool_handle fsm_pool_add(fsm_pool_t *pool, void *context);
+
+/// @brief Removes an instance from the pool, without calling on_exit
+/// @return true if the handle referred to an instance of the pool
+/// @note Don't call this from inside fsm_pool_tick
+fsm_bool fsm_pool_remove(fsm_pool_t *pool, fsm_pool_handle handle);
+
+/// @brief Runs every instance of the pool for one tick, state by state
+/// @note Each instance behaves as if fsm_instance_run was called on it. Within a state, instances
+///       are ticked in slot order, and states are ticked in id order.
+void fsm_pool_tick(fsm_pool_t *pool);
+
+/// @brief Gets the number of instances of the pool in a state, in O(1)
+fsm_size_t fsm_pool_count_in_state(fsm_pool_t *pool, fsm_state_id state);
+
+/// @brief Gets the number of instances in the pool
+inline fsm_size_t fsm_pool_size(fsm_pool_t *pool) { return pool->__instance_count; }
+
+/// @brief Gets the current state of an instance of the pool, or FSM_INVALID_STATE for an invalid handle
+fsm_state_id fsm_pool_state(fsm_pool_t *pool, fsm_pool_handle handle);
+
+/// @brief Gets the context of an instance of the pool, or NULL for an invalid handle
+void *fsm_pool_context(fsm_pool_t *pool, fsm_pool_handle handle);
+
+/**========================================================================
+ *                        Multithreaded Pool Runner
+ *========================================================================**/
+
+#if FSM_THREADS
+
+/*
+ * A runner ticks a pool across a fixed set of threads. Each tick, the pool's buckets are cut into
+ * chunks of instances, every thread gets an even share of the chunks, and threads that run out of
+ * work steal chunks from the back of the others' shares. The calling thread takes part as thread 0.
+ *
+ * Every instance is still ticked exactly once per tick, exactly as fsm_pool_tick would, and the
+ * instances that transitioned are moved to their new buckets on the calling thread once all threads
+ * are done. The pool ends up the same no matter how the chunks were scheduled.
+ * State functions and predicates of different instances run concurrently, so they must only touch
+ * their own context (or synchronize).
+ */
+
+/// @brief Per-thread counters of a runner
+typedef struct fsm_runner_stats {
+    fsm_size_t instances_ticked;
+    fsm_size_t chunks_run;
+    fsm_size_t chunks_stolen;  // chunks this thread took from another thread's share
+} fsm_runner_stats_t;
+
+/// @brief A slice of one bucket of a pool, the unit of work of a runner
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_runner_chunk {
+    fsm_state_id state;
+    fsm_size_t begin;
+    fsm_size_t end;
+} __fsm_runner_chunk_t;
+
+/// @brief A thread of a runner
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_runner_thread {
+    /// @brief The thread's share of the chunks, the next chunk in the low 32 bits and the end in the high ones
+    /// @note The owner takes chunks from the front, thieves from the back, both with a compare-and-swap
+    _Atomic uint64_t range;
+    fsm_runner_stats_t stats;
+    fsm_stats_t fsm_stats;  // the FSM_STATS counted by this thread during a tick, see FSM_STATS_ADD
+    struct fsm_runner *runner;
+    fsm_size_t index;
+    pthread_t thread;
+} __fsm_runner_thread_t;
+
+/// @brief Ticks pools across a pool of threads with work stealing
+/// @note Please interact with the runner using the fsm_runner_xxx functions
+typedef struct fsm_runner {
+    __fsm_runner_thread_t *__threads;
+    fsm_size_t __thread_count;
+    fsm_size_t __chunk_size;
+
+    // The current tick's work
+    fsm_pool_t *__pool;
+    __fsm_runner_chunk_t *__chunks;
+    fsm_size_t __chunk_count;
+    fsm_size_t __chunk_capacity;
+
+    // Start / finish signalling between the calling thread and the workers
+    pthread_mutex_t __lock;
+    pthread_cond_t __start;
+    pthread_cond_t __done;
+    fsm_size_t __generation;  // bumped to start a tick
+    fsm_size_t __threads_done;
+    fsm_bool __stopping;
+
+    fsm_alloc_fn __alloc_fn;
+    fsm_dealloc_fn __dealloc_fn;
+} fsm_runner_t;
+
+/// @brief Creates a runner, starting its threads
+/// @param alloc_fn Memory allocation function
+/// @param dealloc_fn Memory deallocation function
+/// @param thread_count The number of threads ticking pools, including the calling thread,
+///        0 to use one per online processor
+/// @param chunk_size The number of instances in a chunk, 0 for a default of 1024
+/// @return A new runner, or NULL on failure
+fsm_runner_t *fsm_runner_create(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, fsm_size_t thread_count,
+                                fsm_size_t chunk_size);
+
+/// @brief Stops the runner's threads and destroys it
+void fsm_runner_destroy(fsm_runner_t *runner);
+
+/// @brief Ticks every instance of a pool once, across the runner's threads
+/// @note Returns once the whole tick is done, which acts as a barrier between ticks
+void fsm_runner_tick(fsm_runner_t *runner, fsm_pool_t *pool);
+
+/// @brief Gets the number of threads of the runner, including the calling thread
+inline fsm_size_t fsm_runner_thread_count(fsm_runner_t *runner) { return runner->__thread_count; }
+
+/// @brief Gets the counters of one of the runner's threads, accumulated since it was created or reset
+fsm_runner_stats_t fsm_runner_stats(fsm_runner_t *runner, fsm_size_t thread);
+
+/// @brief Resets the counters of all of the runner's threads
+void fsm_runner_reset_stats(fsm_runner_t *runner);
+
+/**========================================================================
+ *                        Cross-Thread Event Queue
+ *========================================================================**/
+
+/*
+ * An FSM can get a bounded, lock-free, multi-producer / single-consumer event queue. Any thread can
+ * fsm_post events to it, and the thread running the FSM dispatches them (see fsm_dispatch) at the
+ * start of every fsm_run, or whenever it calls fsm_drain_events. Events posted by one thread are
+ * dispatched in the order they were posted.
+ *
+ * The consumer copies events out in batches of FSM_QUEUE_DRAIN_BATCH before dispatching them, so the
+ * slots are handed back to producers without waiting on the state functions.
+ */
+
+/// @brief What fsm_post does when the queue is full
+typedef enum fsm_queue_overflow {
+    FSM_QUEUE_REJECT,  // fail, leaving the event to the caller
+    FSM_QUEUE_SPIN,    // wait for the consumer to make room
+} fsm_queue_overflow_t;
+
+/// @brief A slot of an event queue
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_event_queue_cell {
+    /// @brief Equal to the slot's position when it's free to write, position + 1 once it's written
+    _Atomic fsm_size_t sequence;
+    fsm_event_id event;
+    void *payload;
+} __fsm_event_queue_cell_t;
+
+/// @brief A bounded MPSC event queue, a ring of cells with per-cell sequence numbers
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_event_queue {
+    __fsm_event_queue_cell_t *cells;
+    fsm_size_t mask;  // capacity - 1, the capacity is a power of two
+    fsm_queue_overflow_t overflow;
+
+    // Producers and the consumer work on separate cache lines
+    char __pad0[FSM_IMAGE_ALIGNMENT];
+    _Atomic fsm_size_t enqueue_position;
+    char __pad1[FSM_IMAGE_ALIGNMENT];
+    fsm_size_t dequeue_position;  // only touched by the consumer
+    char __pad2[FSM_IMAGE_ALIGNMENT];
+} __fsm_event_queue_t;
+
+/// @brief Gives the FSM an event queue that other threads can fsm_post to
+/// @param fsm The FSM, which should not be running on another thread yet
+/// @param capacity The most events the queue holds at once, rounded up to a power of two
+/// @param overflow What fsm_post does when the queue is full
+/// @return true if the queue was created, false if the FSM already has one or an allocation failed
+fsm_bool fsm_attach_queue(fsm_t *fsm, fsm_size_t capacity, fsm_queue_overflow_t overflow);
+
+/// @brief Posts an event to the FSM's queue, it will be dispatched on the thread running the FSM
+/// @param fsm The FSM to post to, it must have a queue
+/// @param event The event to dispatch
+/// @param payload The event's payload, it must stay valid until the event is dispatched
+/// @return true if the event was queued, false if the queue is full and rejects events, or there's no queue
+/// @note This can be called from any number of threads at once
+fsm_bool fsm_post(fsm_t *fsm, fsm_event_id event, void *payload);
+
+/// @brief Dispatches the events waiting in the FSM's queue, in the order they were posted
+/// @param fsm The FSM to drain the queue of, only call this from the thread running the FSM
+/// @param max_events The most events to dispatch, events posted meanwhile may be left for the next drain
+/// @return The number of events dispatched
+/// @note fsm_run calls this with the queue's capacity before every tick
+fsm_size_t fsm_drain_events(fsm_t *fsm, fsm_size_t max_events);
+
+#endif  // FSM_THREADS
+
+/**========================================================================
+ *                              Static FSMs
+ *========================================================================**/
+
+/*
+ * A machine that's fixed at compile time can be written as an X-macro table instead of being built
+ * with fsm_add_state and fsm_add_transition. FSM_STATIC_DEFINE expands the table into an enum of its
+ * states and a few static inline functions, with a switch over the current state in place of the image.
+ * There are no names to look up, nothing on the heap and no function pointers, so the compiler is free
+ * to inline the state functions and guards into the run function.
+ *
+ * The table is a macro taking two macros, STATE and TRANSITION. Each STATE row is followed by the
+ * transitions out of that state, which are checked in order, taking the first whose guard holds:
+ *
+ *   #define AGENT_TABLE(STATE, TRANSITION)                                   \
+ *       STATE(AGENT_IDLE, FSM_STATIC_NONE, idle_on_update, FSM_STATIC_NONE) \
+ *       TRANSITION(AGENT_WALK, is_rested)                                   \
+ *       STATE(AGENT_WALK, FSM_STATIC_NONE, walk_on_update, FSM_STATIC_NONE) \
+ *       TRANSITION(AGENT_IDLE, is_exhausted)
+ *
+ *   FSM_STATIC_DEFINE(agent, agent_context_t, AGENT_TABLE)
+ *
+ * The columns of a STATE row are the state, then its on_enter, on_update and on_exit functions, and
+ * the columns of a TRANSITION row are the target state and the guard. State functions look like
+ * `void fn(agent_context_t *context)` and guards like `fsm_bool fn(agent_context_t *context)`, and they
+ * have to be declared before FSM_STATIC_DEFINE. FSM_STATIC_NONE stands in for a state function that
+ * does nothing, and FSM_STATIC_ALWAYS for a guard that always holds. The states become enum constants,
+ * so name them like any other constant, with a prefix of their own.
+ *
+ * For a machine called agent, this defines:
+ *   agent_state_t                        the enum of the states, in table order
+ *   agent_t                              the machine, its context, current state and whether it's running
+ *   agent_init(fsm, context)             sets up a stopped machine in the first state of the table
+ *   agent_run(fsm)                       like fsm_run, returns true if it took a transition
+ *   agent_run_n(fsm, n)                  like fsm_run_n
+ *   agent_set_state(fsm, state)          like fsm_set_state_id
+ *   agent_stop(fsm)                      like fsm_stop
+ *   agent_is_running(fsm)                like fsm_is_running
+ *   agent_current_state(fsm)             like fsm_current_state
+ *   agent_current_state_id(fsm)          like fsm_current_state_id
+ *   agent_state_name(state)              the state's name as written in the table, e.g. "AGENT_IDLE"
+ *   agent_state_count()                  like fsm_state_count
+ *   agent_transition_count()             like fsm_transition_count
+ */
+
+/// @brief A state function of a static FSM that does nothing
+#define FSM_STATIC_NONE(context) ((void)(context))
+
+/// @brief A guard of a static FSM that always holds
+#define FSM_STATIC_ALWAYS(context) ((void)(context), true)
+
+// The row macros FSM_STATIC_DEFINE expands the table with, in functions with `fsm`, `next` and `taken` in scope
+#define __FSM_STATIC_IGNORE(...)
+#define __FSM_STATIC_COUNT(...) +1
+#define __FSM_STATIC_ENUM(state, on_enter, on_update, on_exit) state,
+#define __FSM_STATIC_NAME(state, on_enter, on_update, on_exit) \
+    case state:                                                \
+        return #state;
+#define __FSM_STATIC_ENTER(state, on_enter, on_update, on_exit) \
+    case state:                                                 \
+        on_enter(fsm->context);                                 \
+        break;
+#define __FSM_STATIC_UPDATE(state, on_enter, on_update, on_exit) \
+    case state:                                                  \
+        on_update(fsm->context);                                 \
+        break;
+#define __FSM_STATIC_EXIT(state, on_enter, on_update, on_exit) \
+    case state:                                                \
+        on_exit(fsm->context);                                 \
+        break;
+// A state's transitions follow its row, so each case of the state ends where the next state's row starts
+#define __FSM_STATIC_FROM(state, on_enter, on_update, on_exit) \
+    break;                                                     \
+    case state:
+#define __FSM_STATIC_TO(to, guard) \
+    if (guard(fsm->context)) {     \
+        next = to;                 \
+        taken = true;              \
+        break;                     \
+    }
+
+/// @brief Defines a static FSM from an X-macro table, see above
+/// @param name The prefix of the generated type and functions
+/// @param context_type The type of the context the state functions and guards take a pointer to
+/// @param table The table, a macro taking the STATE and TRANSITION row macros
+#define FSM_STATIC_DEFINE(name, context_type, table)                                                        \
+    typedef enum name##_state { table(__FSM_STATIC_ENUM, __FSM_STATIC_IGNORE) } name##_state_t;             \
+                                                                                                            \
+    typedef struct {                                                                                        \
+        context_type *context;                                                                              \
+        name##_state_t state;                                                                               \
+        fsm_bool running;                                                                                   \
+    } name##_t;                                                                                             \
+                                                                                                            \
+    static inline fsm_size_t name##_state_count(void) {                                                     \
+        return 0 table(__FSM_STATIC_COUNT, __FSM_STATIC_IGNORE);                                            \
+    }                                                                                                       \
+                                                                                                            \
+    static inline fsm_size_t name##_transition_count(void) {                                                \
+        return 0 table(__FSM_STATIC_IGNORE, __FSM_STATIC_COUNT);                                            \
+    }                                                                                                       \
+                                                                                                            \
+    static inline const char *name##_state_name(name##_state_t state) {                                     \
+        switch (state) {                                                                                    \
+            table(__FSM_STATIC_NAME, __FSM_STATIC_IGNORE) default: return NULL;                             \
+        }                                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    static inline void name##_init(name##_t *fsm, context_type *context) {                                  \
+        fsm->context = context;                                                                             \
+        fsm->state = (name##_state_t)0;                                                                     \
+        fsm->running = false;                                                                               \
+    }                                                                                                       \
+                                                                                                            \
+    static inline name##_state_t name##_current_state_id(name##_t *fsm) { return fsm->state; }              \
+                                                                                                            \
+    static inline const char *name##_current_state(name##_t *fsm) { return name##_state_name(fsm->state); } \
+                                                                                                            \
+    static inline fsm_bool name##_is_running(name##_t *fsm) { return fsm->running; }                        \
+                                                                                                            \
+    static inline void name##_stop(name##_t *fsm) { fsm->running = false; }                                 \
+                                                                                                            \
+    static inline void __fsm_static_##name##_enter(name##_t *fsm) {                                         \
+        switch (fsm->state) {                                                                               \
+            table(__FSM_STATIC_ENTER, __FSM_STATIC_IGNORE) default: break;                                  \
+        }                                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    static inline void __fsm_static_##name##_exit(name##_t *fsm) {                                          \
+        switch (fsm->state) {                                                                               \
+            table(__FSM_STATIC_EXIT, __FSM_STATIC_IGNORE) default: break;                                   \
+        }                                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    static inline void name##_set_state(name##_t *fsm, name##_state_t state) {                              \
+        if ((fsm_size_t)state >= name##_state_count()) return;                                              \
+        if (fsm->running && state != fsm->state) {                                                          \
+            __fsm_static_##name##_exit(fsm);                                                                \
+            fsm->state = state;                                                                             \
+            __fsm_static_##name##_enter(fsm);                                                               \
+        } else {                                                                                            \
+            fsm->state = state;                                                                             \
+        }                                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    static inline fsm_bool name##_run(name##_t *fsm) {                                                      \
+        if (!fsm->running) {                                                                                \
+            fsm->running = true;                                                                            \
+            __fsm_static_##name##_enter(fsm);                                                               \
+        }                                                                                                   \
+                                                                                                            \
+        name##_state_t next = fsm->state;                                                                   \
+        fsm_bool taken = false;                                                                             \
+        switch (fsm->state) {                                                                               \
+            default:                                                                                        \
+                table(__FSM_STATIC_FROM, __FSM_STATIC_TO) break;                                            \
+        }                                                                                                   \
+        if (taken) {                                                                                        \
+            __fsm_static_##name##_exit(fsm);                                                                \
+            fsm->state = next;                                                                              \
+            __fsm_static_##name##_enter(fsm);                                                               \
+        }                                                                                                   \
+                                                                                                            \
+        switch (fsm->state) {                                                                               \
+            table(__FSM_STATIC_UPDATE, __FSM_STATIC_IGNORE) default: break;                                 \
+        }                                                                                                   \
+        return taken;                                                                                       \
+    }                                                                                                       \
+                                                                                                            \
+    static inline fsm_run_result_t name##_run_n(name##_t *fsm, fsm_size_t n) {                              \
+        fsm_run_result_t result = {0, 0};                                                                   \
+        for (; result.ticks < n; result.ticks++) {                                                          \
+            result.transitions += name##_run(fsm);                                                          \
+        }                                                                                                   \
+        return result;                                                                                      \
+    }
+
+/**========================================================================
+ *                           Macros and Logging
+ *========================================================================**/
+
+#define FSM_LINE __LINE__
+#define FSM_STR_HELPER(x) #x
+#define FSM_STR(x) FSM_STR_HELPER(x)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FSM_PREFETCH(addr) __builtin_prefetch(addr)
+#define FSM_CTZ64(x) ((fsm_size_t)__builtin_ctzll(x))
+#else
+#define FSM_PREFETCH(addr) ((void)(addr))
+#define FSM_CTZ64(x) __fsm_ctz64(x)
+// The index of the lowest set bit of x, which must not be 0
+static inline fsm_size_t __fsm_ctz64(uint64_t x) {
+    fsm_size_t n = 0;
+    while (!(x & 1)) x >>= 1, n++;
+    return n;
+}
+#endif
+
+#if FSM_STATS && FSM_THREADS
+// Runner threads share the definition's FSM, so they count into their own counters instead, which
+// fsm_runner_tick folds into the definition's once every thread is done
+#define FSM_STATS_ADD(fsm, counter, n) ((__fsm_thread_stats ? __fsm_thread_stats : &(fsm)->__stats)->counter += (n))
+#elif FSM_STATS
+#define FSM_STATS_ADD(fsm, counter, n) ((fsm)->__stats.counter += (n))
+#else
+#define FSM_STATS_ADD(fsm, counter, n) ((void)0)
+#endif  // FSM_STATS
+
+#define FSM_ERROR_COLOR "\033[0;31m"
+#define FSM_RESET_COLOR "\033[0m"
+
+#ifdef FSM_DEBUG
+#define FSM_DEUBG_PREFIX "[fsm.h:" FSM_STR(FSM_LINE) "] "
+#define FSM_LOG(fmt, ...) printf(FSM_DEUBG_PREFIX fmt, ##__VA_ARGS__)
+#define FSM_LOG_ERROR(fmt, ...) fprintf(stderr, FSM_ERROR_COLOR FSM_DEUBG_PREFIX FSM_RESET_COLOR fmt, ##__VA_ARGS__)
+#else
+#define FSM_LOG(fmt, ...) void(0)
+#define FSM_LOG_ERROR(fmt, ...) void(0)
+#endif  // FSM_DEBUG
+
+/**========================================================================
+ *                           Implementation
+ *========================================================================**/
+
+#ifdef FSM_IMPL
+
+#include <stdio.h>   // optional, for debug prints if needed
+#include <string.h>  // for memcpy, strlen, etc.
+
+#include "fsm.h"
+
+// The SIMD paths of fsm_guard_eval_batch are compiled for their instruction set with target attributes,
+// and only run when the CPU supports it
+#if FSM_SIMD && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define __FSM_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define __FSM_SIMD_X86 0
+#endif
+
+// Reads a cycle counter to time predicates for FSM_OPTION_ADAPTIVE_ORDER, 0 where there isn't one
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define FSM_CYCLES() ((uint64_t)__rdtsc())
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+static inline uint64_t __fsm_cycles(void) {
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+}
+#define FSM_CYCLES() __fsm_cycles()
+#else
+#define FSM_CYCLES() ((uint64_t)0)
+#endif
+
+// Emit the external definitions of the inline accessors, so they link even when not inlined
+extern inline fsm_size_t fsm_state_count(fsm_t *fsm);
+extern inline fsm_size_t fsm_transition_count(fsm_t *fsm);
+extern inline char *fsm_current_state(fsm_t *fsm);
+extern inline fsm_state_id fsm_current_state_id(fsm_t *fsm);
+extern inline fsm_bool fsm_is_running(fsm_t *fsm);
+extern inline fsm_bool fsm_is_finalized(fsm_t *fsm);
+extern inline uint32_t fsm_get_options(fsm_t *fsm);
+extern inline fsm_bool fsm_step_bound_hit(fsm_t *fsm);
+extern inline uint64_t __fsm_field_mask(fsm_size_t offset, fsm_size_t size);
+extern inline void fsm_context_write(fsm_t *fsm, fsm_size_t offset, fsm_size_t size);
+extern inline void fsm_context_touch(fsm_t *fsm);
+extern inline uint64_t fsm_context_generation(fsm_t *fsm);
+extern inline fsm_stats_t fsm_get_stats(fsm_t *fsm);
+extern inline void *fsm_event_payload(fsm_t *fsm);
+extern inline fsm_state_id fsm_instance_state(fsm_instance_t *instance);
+extern inline fsm_bool fsm_instance_is_running(fsm_instance_t *instance);
+extern inline fsm_bool fsm_instance_step_bound_hit(fsm_instance_t *instance);
+extern inline fsm_size_t fsm_pool_size(fsm_pool_t *pool);
+#if FSM_THREADS
+extern inline fsm_size_t fsm_runner_thread_count(fsm_runner_t *runner);
+#endif  // FSM_THREADS
+
+#if FSM_STATS && FSM_THREADS
+/// @brief Where FSM_STATS_ADD counts while a runner thread ticks a pool, NULL on any other thread
+_Thread_local fsm_stats_t *__fsm_thread_stats = NULL;
+#endif  // FSM_STATS && FSM_THREADS
+
+/// @brief Alignment of every arena allocation, enough for any of the FSM's own types
+#define FSM_ARENA_ALIGNMENT 16
+#define FSM_ARENA_ALIGN(size) (((size) + FSM_ARENA_ALIGNMENT - 1) & ~(fsm_size_t)(FSM_ARENA_ALIGNMENT - 1))
+
+/// @brief Allocates a new arena block with room for at least `size` bytes
+__fsm_arena_block_t *__fsm_arena_block_create(fsm_alloc_fn alloc_fn, fsm_size_t size) {
+    fsm_size_t header_size = FSM_ARENA_ALIGN(sizeof(__fsm_arena_block_t));
+    __fsm_arena_block_t *block = (__fsm_arena_block_t *)alloc_fn(header_size + size);
+    if (block) {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+/// @brief Bump-allocates from an arena block, returns NULL if the block is full
+void *__fsm_arena_block_alloc(__fsm_arena_block_t *block, fsm_size_t size) {
+    size = FSM_ARENA_ALIGN(size);
+    if (block->size - block->used < size) {
+        return NULL;
+    }
+    void *ptr = (char *)block + FSM_ARENA_ALIGN(sizeof(__fsm_arena_block_t)) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/// @brief Allocates memory for the FSM, from its arena if it has one, otherwise with __alloc_fn
+void *__fsm_alloc(fsm_t *fsm, fsm_size_t size) {
+    if (!fsm->__arena) {
+        return fsm->__alloc_fn(size);
+    }
+
+    void *ptr = __fsm_arena_block_alloc(fsm->__arena, size);
+    if (ptr) {
+        return ptr;
+    }
+
+    // The current block is full, chain a new one big enough for this allocation
+    fsm_size_t block_size = fsm->__arena_block_size;
+    if (block_size < FSM_ARENA_ALIGN(size)) {
+        block_size = FSM_ARENA_ALIGN(size);
+    }
+    __fsm_arena_block_t *block = __fsm_arena_block_create(fsm->__alloc_fn, block_size);
+    if (!block) {
+        return NULL;
+    }
+    block->next = fsm->__arena;
+    fsm->__arena = block;
+    return __fsm_arena_block_alloc(block, size);
+}
+
+/// @brief Frees memory allocated with __fsm_alloc
+/// @note Arena memory is only released when the FSM is destroyed, so this is a no-op in arena mode
+void __fsm_free(fsm_t *fsm, void *ptr) {
+    if (!fsm->__arena) {
+        fsm->__dealloc_fn(ptr);
+    }
+}
+
+/// @brief Allocates memory that's freed and allocated again over the FSM's lifetime, like compiled images
+/// @note In arena mode, freed chunks are kept on a free list and handed out again to allocations that fit,
+///       so recompiling an FSM that's edited while it runs doesn't grow its arena. Sizes are rounded up to
+///       a power of two, so an image growing a little at a time still fits in its predecessor's chunk.
+void *__fsm_alloc_reusable(fsm_t *fsm, fsm_size_t size) {
+    if (!fsm->__arena) {
+        return fsm->__alloc_fn(size);
+    }
+
+    // The smallest free chunk that fits
+    __fsm_arena_chunk_t **best = NULL;
+    for (__fsm_arena_chunk_t **link = &fsm->__arena_free; *link; link = &(*link)->next) {
+        if ((*link)->size >= size && (!best || (*link)->size < (*best)->size)) {
+            best = link;
+        }
+    }
+    fsm_size_t header_size = FSM_ARENA_ALIGN(sizeof(__fsm_arena_chunk_t));
+    __fsm_arena_chunk_t *chunk;
+    if (best) {
+        chunk = *best;
+        *best = chunk->next;
+    } else {
+        fsm_size_t chunk_size = FSM_ARENA_ALIGNMENT;
+        while (chunk_size < size) {
+            chunk_size *= 2;
+        }
+        chunk = (__fsm_arena_chunk_t *)__fsm_alloc(fsm, header_size + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+    }
+    chunk->next = NULL;
+    return (char *)chunk + header_size;
+}
+
+/// @brief Frees memory allocated with __fsm_alloc_reusable, in arena mode it can then be reused
+void __fsm_free_reusable(fsm_t *fsm, void *ptr) {
+    if (!fsm->__arena) {
+        fsm->__dealloc_fn(ptr);
+        return;
+    }
+    __fsm_arena_chunk_t *chunk = (__fsm_arena_chunk_t *)((char *)ptr - FSM_ARENA_ALIGN(sizeof(__fsm_arena_chunk_t)));
+    chunk->next = fsm->__arena_free;
+    fsm->__arena_free = chunk;
+}
+
+/// @brief Copies a string using the FSM's allocator
+/// @param fsm The FSM with the allocator
+/// @param src The string to copy
+/// @return A newly allocated copy of `src`, or NULL on failure
+char *__fsm_strdup(fsm_t *fsm, const char *src) {
+    if (!src) {
+        return NULL;
+    }
+    size_t len = strlen(src) + 1;
+    char *dst = (char *)__fsm_alloc(fsm, len);
+    if (dst) {
+        memcpy(dst, src, len);
+    }
+    return dst;
+}
+
+/// @brief Hashes a state name (FNV-1a)
+fsm_size_t __fsm_hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ULL;
+    }
+    return (fsm_size_t)hash;
+}
+
+/// @brief Inserts a state into a name table, assuming there is a free slot
+/// @return false if a state with the same name is already in the table
+fsm_bool __fsm_name_table_insert(__fsm_name_slot_t *table, fsm_size_t capacity, fsm_state_t *states,
+                                 fsm_size_t hash, fsm_state_id state) {
+    fsm_size_t mask = capacity - 1;
+    for (fsm_size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (table[i].state == FSM_INVALID_STATE) {
+            table[i].hash = hash;
+            table[i].state = state;
+            return true;
+        }
+        if (table[i].hash == hash && strcmp(states[table[i].state].name, states[state].name) == 0) {
+            return false;
+        }
+    }
+}
+
+/// @brief Makes sure the name table has room for state_count names, growing it if needed
+/// @return true if there is room, false if an allocation failed
+/// @note The table is kept at most half full, and at least doubles in size when it grows
+fsm_bool __fsm_name_table_reserve(fsm_t *fsm, fsm_size_t state_count) {
+    if (state_count * 2 <= fsm->__name_table_capacity) {
+        return true;
+    }
+
+    fsm_size_t capacity = fsm->__name_table_capacity ? fsm->__name_table_capacity * 2 : 16;
+    while (capacity < state_count * 2) {
+        capacity *= 2;
+    }
+    __fsm_name_slot_t *table = (__fsm_name_slot_t *)__fsm_alloc(fsm, sizeof(__fsm_name_slot_t) * capacity);
+    if (!table) {
+        return false;
+    }
+    for (fsm_size_t i = 0; i < capacity; i++) {
+        table[i].state = FSM_INVALID_STATE;
+    }
+
+    // Rehash everything that was in the old table
+    for (fsm_size_t i = 0; i < fsm->__name_table_capacity; i++) {
+        __fsm_name_slot_t *slot = &fsm->__name_table[i];
+        if (slot->state != FSM_INVALID_STATE) {
+            __fsm_name_table_insert(table, capacity, fsm->states, slot->hash, slot->state);
+        }
+    }
+
+    if (fsm->__name_table) {
+        __fsm_free(fsm, fsm->__name_table);
+    }
+    fsm->__name_table = table;
+    fsm->__name_table_capacity = capacity;
+    return true;
+}
+
+/// @brief Grows an array owned by the FSM so it can hold at least min_capacity elements
+/// @param fsm The FSM with the allocator
+/// @param array The array to grow, replaced with the new array on success
+/// @param element_size The size of one element
+/// @param count The number of elements in use, these are copied over
+/// @param capacity The capacity of the array, updated on success
+/// @param min_capacity The number of elements the array must be able to hold
+/// @return true if the array can hold min_capacity elements, false if an allocation failed
+/// @note The capacity at least doubles, so adding elements one at a time costs amortized O(1)
+fsm_bool __fsm_grow_array(fsm_t *fsm, void **array, fsm_size_t element_size, fsm_size_t count,
+                          fsm_size_t *capacity, fsm_size_t min_capacity) {
+    if (min_capacity <= *capacity) {
+        return true;
+    }
+
+    fsm_size_t new_capacity = *capacity ? *capacity * 2 : 8;
+    if (new_capacity < min_capacity) {
+        new_capacity = min_capacity;
+    }
+
+    void *new_array = __fsm_alloc(fsm, element_size * new_capacity);
+    if (!new_array) {
+        return false;
+    }
+
+    if (*array) {
+        memcpy(new_array, *array, element_size * count);
+        __fsm_free(fsm, *array);
+    }
+
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+/// @brief Checks that the FSM's definition can still change, logging an error if it was finalized
+fsm_bool __fsm_check_not_finalized(fsm_t *fsm, const char *operation) {
+    if (fsm->__is_finalized) {
+        FSM_LOG_ERROR("%s: the FSM has been finalized, its definition can't change\n", operation);
+        return false;
+    }
+    return true;
+}
+
+/// @brief The size of a field of the given type
+fsm_size_t __fsm_field_size(uint8_t type) {
+    static const uint8_t sizes[] = {1, 2, 4, 8, 1, 2, 4, 8, 4, 8};
+    return sizes[type];
+}
+
+/// @brief Hashes a guard node, the fields that aren't used by its kind must be zero
+fsm_size_t __fsm_guard_hash(__fsm_guard_node_t *node) {
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t fields[5] = {node->kind | (uint64_t)node->type << 8 | (uint64_t)node->compare << 16, node->offset,
+                          node->constant.u, node->operands[0], node->operands[1]};
+    for (int i = 0; i < 5; i++) {
+        hash = (hash ^ fields[i]) * 1099511628211ull;
+    }
+    return (fsm_size_t)(hash ^ (hash >> 32));
+}
+
+/// @brief Checks if two guard nodes are the same guard
+fsm_bool __fsm_guard_equal(__fsm_guard_node_t *a, __fsm_guard_node_t *b) {
+    return a->kind == b->kind && a->type == b->type && a->compare == b->compare && a->offset == b->offset &&
+           a->constant.u == b->constant.u && a->operands[0] == b->operands[0] && a->operands[1] == b->operands[1];
+}
+
+/// @brief Finds the hash table slot of a guard node, or the empty slot where it would go
+fsm_guard_id *__fsm_guard_slot(fsm_t *fsm, fsm_guard_id *table, fsm_size_t capacity, __fsm_guard_node_t *node) {
+    fsm_size_t mask = capacity - 1;
+    for (fsm_size_t i = __fsm_guard_hash(node) & mask;; i = (i + 1) & mask) {
+        if (table[i] == FSM_NO_GUARD || __fsm_guard_equal(&fsm->__guards[table[i]], node)) {
+            return &table[i];
+        }
+    }
+}
+
+/// @brief Adds a guard node to the FSM, or finds the existing node for the same guard
+/// @return The id of the node, or FSM_NO_GUARD if an allocation failed
+fsm_guard_id __fsm_guard_intern(fsm_t *fsm, __fsm_guard_node_t *node) {
+    if (!__fsm_check_not_finalized(fsm, "fsm_guard")) return FSM_NO_GUARD;
+
+    // Keep the table at most half full, rehashing everything when it grows
+    if ((fsm->__guard_count + 1) * 2 > fsm->__guard_table_capacity) {
+        fsm_size_t capacity = fsm->__guard_table_capacity ? fsm->__guard_table_capacity * 2 : 16;
+        fsm_guard_id *table = (fsm_guard_id *)__fsm_alloc(fsm, sizeof(fsm_guard_id) * capacity);
+        if (!table) {
+            return FSM_NO_GUARD;
+        }
+        for (fsm_size_t i = 0; i < capacity; i++) {
+            table[i] = FSM_NO_GUARD;
+        }
+        for (fsm_size_t i = 0; i < fsm->__guard_count; i++) {
+            *__fsm_guard_slot(fsm, table, capacity, &fsm->__guards[i]) = (fsm_guard_id)i;
+        }
+        if (fsm->__guard_table) {
+            __fsm_free(fsm, fsm->__guard_table);
+        }
+        fsm->__guard_table = table;
+        fsm->__guard_table_capacity = capacity;
+    }
+
+    fsm_guard_id *slot = __fsm_guard_slot(fsm, fsm->__guard_table, fsm->__guard_table_capacity, node);
+    if (*slot != FSM_NO_GUARD) {
+        return *slot;
+    }
+
+    if (!__fsm_grow_array(fsm, (void **)&fsm->__guards, sizeof(__fsm_guard_node_t), fsm->__guard_count,
+                          &fsm->__guard_capacity, fsm->__guard_count + 1)) {
+        return FSM_NO_GUARD;
+    }
+    fsm_guard_id id = (fsm_guard_id)fsm->__guard_count++;
+    fsm->__guards[id] = *node;
+    *slot = id;
+    return id;
+}
+
+/// @brief Builds a comparison guard node, converting the constant to the field's domain
+fsm_guard_id __fsm_guard_compare(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                 __fsm_guard_value_t constant) {
+    if (!fsm || type > FSM_FIELD_F64 || op > FSM_GE || offset > UINT32_MAX) {
+        return FSM_NO_GUARD;
+    }
+
+    __fsm_guard_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.kind = __FSM_GUARD_COMPARE;
+    node.type = (uint8_t)type;
+    node.compare = (uint8_t)op;
+    node.offset = (uint32_t)offset;
+    node.constant = constant;
+    node.operands[0] = node.operands[1] = FSM_NO_GUARD;
+    node.cost = type >= FSM_FIELD_F32 ? 2 : 1;
+    node.size = 1;
+    node.reads = __fsm_field_mask(offset, __fsm_field_size((uint8_t)type));
+    return __fsm_guard_intern(fsm, &node);
+}
+
+/// @brief Builds an AND / OR / NOT guard node
+fsm_guard_id __fsm_guard_combine(fsm_t *fsm, uint8_t kind, fsm_guard_id a, fsm_guard_id b) {
+    if (!fsm || a >= fsm->__guard_count || (kind != __FSM_GUARD_NOT && b >= fsm->__guard_count)) {
+        return FSM_NO_GUARD;
+    }
+
+    __fsm_guard_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.kind = kind;
+    node.operands[0] = a;
+    node.operands[1] = b;
+    node.cost = fsm->__guards[a].cost;
+    node.size = fsm->__guards[a].size + 1;  // a jump, or the NOT
+    node.reads = fsm->__guards[a].reads;
+    if (kind != __FSM_GUARD_NOT) {
+        node.cost += fsm->__guards[b].cost;
+        node.size += fsm->__guards[b].size;
+        node.reads |= fsm->__guards[b].reads;
+    }
+    return __fsm_guard_intern(fsm, &node);
+}
+
+fsm_guard_id fsm_guard_compare_int(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                   int64_t constant) {
+    __fsm_guard_value_t value;
+    if (type == FSM_FIELD_F32 || type == FSM_FIELD_F64) {
+        value.f = (double)constant;
+    } else {
+        value.i = constant;
+    }
+    return __fsm_guard_compare(fsm, offset, type, op, value);
+}
+
+/// @brief Builds a guard comparing an integer field to a floating point constant, as the comparison to the
+///        integer bound that holds for the same field values
+fsm_guard_id __fsm_guard_compare_integral(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                          double constant) {
+    if (type > FSM_FIELD_F64 || op > FSM_GE) {
+        return FSM_NO_GUARD;
+    }
+    fsm_bool is_unsigned = type >= FSM_FIELD_U8;
+    double lowest = is_unsigned ? 0.0 : -9223372036854775808.0;
+    double highest = is_unsigned ? 18446744073709551616.0 : 9223372036854775808.0;  // past the last value
+
+    // Comparisons that hold for every value, or for none, compare against the lowest value
+    __fsm_guard_value_t lowest_value;
+    if (is_unsigned) {
+        lowest_value.u = 0;
+    } else {
+        lowest_value.i = INT64_MIN;
+    }
+    int always = -1;  // 1 if the comparison always holds, 0 if it never does
+    if (constant != constant) {
+        always = op == FSM_NE;  // NaN compares unequal to everything
+    } else if (constant < lowest) {
+        always = op == FSM_NE || op == FSM_GT || op == FSM_GE;
+    } else if (constant >= highest) {
+        always = op == FSM_NE || op == FSM_LT || op == FSM_LE;
+    }
+    if (always >= 0) {
+        return __fsm_guard_compare(fsm, offset, type, always ? FSM_GE : FSM_LT, lowest_value);
+    }
+
+    __fsm_guard_value_t floor_value;
+    fsm_bool integral;
+    if (is_unsigned) {
+        floor_value.u = (uint64_t)constant;
+        integral = (double)floor_value.u == constant;
+    } else {
+        floor_value.i = (int64_t)constant;
+        integral = (double)floor_value.i == constant;
+        if (!integral && constant < 0) {
+            floor_value.i--;  // the cast truncated towards zero
+        }
+    }
+    if (integral) {
+        return __fsm_guard_compare(fsm, offset, type, op, floor_value);
+    }
+
+    // Between two integers, x < c and x >= c are about the one above, x <= c and x > c about the one below
+    __fsm_guard_value_t ceil_value = floor_value;
+    ceil_value.u++;  // the same in two's complement for signed values
+    switch (op) {
+        case FSM_EQ:
+            return __fsm_guard_compare(fsm, offset, type, FSM_LT, lowest_value);
+        case FSM_NE:
+            return __fsm_guard_compare(fsm, offset, type, FSM_GE, lowest_value);
+        case FSM_LT:
+        case FSM_GE:
+            return __fsm_guard_compare(fsm, offset, type, op, ceil_value);
+        default:
+            return __fsm_guard_compare(fsm, offset, type, op, floor_value);
+    }
+}
+
+fsm_guard_id fsm_guard_compare_float(fsm_t *fsm, fsm_size_t offset, fsm_field_type_t type, fsm_compare_op_t op,
+                                     double constant) {
+    if (type != FSM_FIELD_F32 && type != FSM_FIELD_F64) {
+        return __fsm_guard_compare_integral(fsm, offset, type, op, constant);
+    }
+    __fsm_guard_value_t value;
+    value.f = constant;
+    return __fsm_guard_compare(fsm, offset, type, op, value);
+}
+
+fsm_guard_id fsm_guard_and(fsm_t *fsm, fsm_guard_id a, fsm_guard_id b) {
+    return __fsm_guard_combine(fsm, __FSM_GUARD_AND, a, b);
+}
+
+fsm_guard_id fsm_guard_or(fsm_t *fsm, fsm_guard_id a, fsm_guard_id b) {
+    return __fsm_guard_combine(fsm, __FSM_GUARD_OR, a, b);
+}
+
+fsm_guard_id fsm_guard_not(fsm_t *fsm, fsm_guard_id guard) {
+    return __fsm_guard_combine(fsm, __FSM_GUARD_NOT, guard, FSM_NO_GUARD);
+}
+
+fsm_state_id fsm_find_state(fsm_t *fsm, const char *name) {
+    if (!fsm || !name || fsm->__name_table_capacity == 0) {
+        return FSM_INVALID_STATE;
+    }
+
+    fsm_size_t hash = __fsm_hash_name(name);
+    fsm_size_t mask = fsm->__name_table_capacity - 1;
+    for (fsm_size_t i = hash & mask;; i = (i + 1) & mask) {
+        __fsm_name_slot_t *slot = &fsm->__name_table[i];
+        if (slot->state == FSM_INVALID_STATE) {
+            return FSM_INVALID_STATE;
+        }
+        if (slot->hash == hash && strcmp(fsm->states[slot->state].name, name) == 0) {
+            return slot->state;
+        }
+    }
+}
+
+fsm_size_t __fsm_state_index(fsm_t *fsm, char *name) { return fsm_find_state(fsm, name); }
+
+#define FSM_IMAGE_ALIGN(size) (((size) + FSM_IMAGE_ALIGNMENT - 1) & ~(fsm_size_t)(FSM_IMAGE_ALIGNMENT - 1))
+
+/// @brief Hashes a (state, event) pair into the image's event table
+fsm_size_t __fsm_event_hash(uint32_t state, uint32_t event) {
+    uint64_t key = ((uint64_t)state << 32) | event;
+    return (fsm_size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/// @brief Finds the event table slot of a (state, event) pair
+/// @return The pair's slot, or the empty slot where it would go if it isn't in the table
+__fsm_image_event_slot_t *__fsm_image_event_slot(__fsm_image_event_slot_t *table, fsm_size_t capacity,
+                                                 uint32_t state, uint32_t event) {
+    fsm_size_t mask = capacity - 1;
+    for (fsm_size_t i = __fsm_event_hash(state, event) & mask;; i = (i + 1) & mask) {
+        __fsm_image_event_slot_t *slot = &table[i];
+        if (slot->state == UINT32_MAX || (slot->state == state && slot->event == event)) {
+            return slot;
+        }
+    }
+}
+
+/// @brief Gets the predicates of a compiled transition, wherever they are stored
+fsm_transition_predicate_fn *__fsm_image_predicates(__fsm_image_transition_t *transition) {
+    return transition->predicate_count > FSM_INLINE_PREDICATES ? transition->group.predicates
+                                                                : transition->group.inline_predicates;
+}
+
+/// @brief Copies a transition into its compiled record, moving big predicate groups to the pool
+void __fsm_compile_transition(__fsm_image_t *image, __fsm_transition_t *t, __fsm_image_transition_t *image_t,
+                              fsm_size_t *pool_used, fsm_size_t *selectors_used) {
+    image_t->to = (uint32_t)t->to;
+    if (t->selector) {
+        image_t->to = __FSM_TARGET_SELECTOR | (uint32_t)*selectors_used;
+        image->selectors[(*selectors_used)++] = t->selector;
+    }
+    image_t->guard = t->guard;  // the guard's id for now, replaced with its code by __fsm_compile_guards
+    image_t->predicate_count = (uint32_t)t->predicates.predicate_count;
+
+    fsm_transition_predicate_fn *predicates = image_t->group.inline_predicates;
+    if (t->predicates.predicate_count > FSM_INLINE_PREDICATES) {
+        predicates = image_t->group.predicates = &image->predicate_pool[*pool_used];
+        *pool_used += t->predicates.predicate_count;
+    }
+    for (fsm_size_t p = 0; p < t->predicates.predicate_count; p++) {
+        predicates[p] = t->predicates.predicates[p];
+    }
+}
+
+/// @brief A predicate seen while interning the predicates of a state, see __fsm_compile_memo
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_memo_entry {
+    fsm_transition_predicate_fn predicate;
+    uint32_t stamp;  // the entry is empty unless this is the stamp of the state being interned
+    uint32_t count;  // how many times the state's transitions check it
+    uint8_t slot;
+} __fsm_memo_entry_t;
+
+/// @brief Finds the interning table entry of a predicate, or the empty entry where it would go
+/// @param stamp Identifies the state being interned, entries left by other states count as empty,
+///        so the table never needs emptying
+__fsm_memo_entry_t *__fsm_memo_entry(__fsm_memo_entry_t *table, fsm_size_t capacity,
+                                     fsm_transition_predicate_fn predicate, uint32_t stamp) {
+    fsm_size_t mask = capacity - 1;
+    fsm_size_t hash = (fsm_size_t)(((uint64_t)(uintptr_t)predicate * 0x9E3779B97F4A7C15ull) >> 32);
+    for (fsm_size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (table[i].stamp != stamp) {
+            table[i].stamp = stamp;
+            table[i].predicate = predicate;
+            table[i].count = 0;
+            table[i].slot = FSM_MEMO_NONE;
+            return &table[i];
+        }
+        if (table[i].predicate == predicate) {
+            return &table[i];
+        }
+    }
+}
+
+/// @brief Interns the predicates of every state's transitions, filling the image's memo tables
+/// @param image The image, with its transitions already grouped by state
+/// @param table Scratch interning table, with zeroed stamps
+/// @param capacity Size of the table, a power of two at least twice the predicates of any one state
+/// @note A predicate checked by several transitions of a state gets a memo slot, the first
+///       FSM_MEMO_MAX of them anyway, so fsm_run calls it at most once per tick
+/// @note The table entries of state s are stamped s + 1, the any-state range is state state_count
+void __fsm_compile_memo(__fsm_image_t *image, __fsm_memo_entry_t *table, fsm_size_t capacity) {
+    uint32_t slots_used = 0;
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        __fsm_image_state_t *state = &image->states[s];
+        image->memo_offsets[s] = UINT32_MAX;
+
+        // Count how many times each predicate is checked
+        uint32_t stamp = (uint32_t)s + 1;
+        fsm_bool repeats = false;
+        for (uint32_t t = state->transition_begin; t < state->transition_end; t++) {
+            fsm_transition_predicate_fn *predicates = __fsm_image_predicates(&image->transitions[t]);
+            for (uint32_t p = 0; p < image->transitions[t].predicate_count; p++) {
+                __fsm_memo_entry_t *entry = __fsm_memo_entry(table, capacity, predicates[p], stamp);
+                repeats |= entry->count > 0;
+                entry->count++;
+            }
+        }
+
+        // Give repeated predicates a slot in the order they're first checked
+        uint8_t next_slot = 0;
+        if (repeats) {
+            image->memo_offsets[s] = slots_used;
+        }
+        for (uint32_t t = state->transition_begin; t < state->transition_end; t++) {
+            fsm_transition_predicate_fn *predicates = __fsm_image_predicates(&image->transitions[t]);
+            for (uint32_t p = 0; p < image->transitions[t].predicate_count; p++) {
+                __fsm_memo_entry_t *entry = __fsm_memo_entry(table, capacity, predicates[p], stamp);
+                if (repeats) {
+                    if (entry->slot == FSM_MEMO_NONE && entry->count > 1 && next_slot < FSM_MEMO_MAX) {
+                        entry->slot = next_slot++;
+                    }
+                    image->memo_slots[slots_used++] = entry->slot;
+                }
+            }
+        }
+    }
+}
+
+/// @brief Adds one requirement of a state's transition to its select bits, interning it
+/// @param bits The state's bits, after its header
+/// @param bit_count The number of bits so far
+/// @param index The bit index (plus one) of each predicate or guard seen so far, 0 if none
+/// @return The index of the requirement's bit
+uint32_t __fsm_select_require(__fsm_image_select_bit_t *bits, uint32_t *bit_count, uint32_t *index,
+                              fsm_transition_predicate_fn predicate, uint32_t guard, uint32_t transition) {
+    if (*index == 0) {
+        __fsm_image_select_bit_t *bit = &bits[(*bit_count)++];
+        bit->predicate = predicate;
+        bit->guard = guard;  // the guard's id for now, see __fsm_compile_select
+        bit->blocks = 0;
+        bit->settles = 0;
+        *index = *bit_count;
+    }
+    bits[*index - 1].blocks |= (uint64_t)1 << transition;
+    return *index - 1;
+}
+
+/// @brief Interns the predicates and guards of the transitions of every state selected with bitmasks
+/// @param image The image, with its transitions already grouped by state and holding their guard ids
+/// @param table Scratch interning table, see __fsm_compile_memo, stamped state_count + s + 2 for state s
+/// @param capacity Size of the table
+/// @param guard_index Scratch space, a zero per guard node, left zeroed
+/// @note The bits are numbered in the order the transitions check them, so the transitions become
+///       settled roughly in order while the bits are evaluated
+void __fsm_compile_select(fsm_t *fsm, __fsm_image_t *image, __fsm_memo_entry_t *table, fsm_size_t capacity,
+                          uint32_t *guard_index) {
+    uint32_t bits_used = 0;
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        __fsm_image_state_t *state = &image->states[s];
+        uint32_t transition_count = state->transition_end - state->transition_begin;
+        image->select_offsets[s] = UINT32_MAX;
+        if (!(fsm->__options & FSM_OPTION_BITMASK_SELECTION) || transition_count == 0 ||
+            transition_count > FSM_SELECT_MAX) {
+            continue;
+        }
+
+        __fsm_image_select_bit_t *header = &image->select_bits[bits_used];
+        image->select_offsets[s] = bits_used;
+        header->predicate = NULL;
+        header->blocks = transition_count == 64 ? 0 : ~(((uint64_t)1 << transition_count) - 1);
+        header->settles = 0;
+
+        uint32_t bit_count = 0;
+        for (uint32_t i = 0; i < transition_count; i++) {
+            __fsm_image_transition_t *t = &image->transitions[state->transition_begin + i];
+            uint32_t last = UINT32_MAX;
+            if (t->guard != FSM_NO_GUARD) {
+                last = __fsm_select_require(header + 1, &bit_count, &guard_index[t->guard], NULL, t->guard, i);
+            }
+            fsm_transition_predicate_fn *predicates = __fsm_image_predicates(t);
+            for (uint32_t p = 0; p < t->predicate_count; p++) {
+                __fsm_memo_entry_t *entry =
+                    __fsm_memo_entry(table, capacity, predicates[p], (uint32_t)(image->state_count + s + 2));
+                uint32_t bit = __fsm_select_require(header + 1, &bit_count, &entry->count, predicates[p], 0, i);
+                last = last == UINT32_MAX || bit > last ? bit : last;
+            }
+
+            // Once its last requirement is known to hold, the transition is decided
+            if (last == UINT32_MAX) {
+                header->settles |= (uint64_t)1 << i;
+            } else {
+                header[1 + last].settles |= (uint64_t)1 << i;
+            }
+        }
+        header->guard = bit_count;
+
+        for (uint32_t b = 1; b <= bit_count; b++) {
+            if (!header[b].predicate) {
+                guard_index[header[b].guard] = 0;
+            }
+        }
+        bits_used += 1 + bit_count;
+    }
+}
+
+/// @brief Points the guard bits of the states selected with bitmasks at their compiled code
+/// @note Any of the transitions sharing a guard will do, the first one is used
+void __fsm_link_select_guards(__fsm_image_t *image) {
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        if (image->select_offsets[s] == UINT32_MAX) {
+            continue;
+        }
+        __fsm_image_select_bit_t *header = &image->select_bits[image->select_offsets[s]];
+        for (uint32_t b = 1; b <= header->guard; b++) {
+            if (!header[b].predicate) {
+                uint32_t first = image->states[s].transition_begin + (uint32_t)FSM_CTZ64(header[b].blocks);
+                header[b].guard = image->transitions[first].guard;
+            }
+        }
+    }
+}
+
+/// @brief Counts how many times each comparison of a guard is checked
+void __fsm_guard_count_compares(fsm_t *fsm, fsm_guard_id id, uint32_t *counts) {
+    __fsm_guard_node_t *node = &fsm->__guards[id];
+    if (node->kind == __FSM_GUARD_COMPARE) {
+        counts[id]++;
+        return;
+    }
+    __fsm_guard_count_compares(fsm, node->operands[0], counts);
+    if (node->kind != __FSM_GUARD_NOT) {
+        __fsm_guard_count_compares(fsm, node->operands[1], counts);
+    }
+}
+
+/// @brief Clears the counts and memo slots of the comparisons of a guard
+void __fsm_guard_reset_memo(fsm_t *fsm, fsm_guard_id id, uint32_t *counts, uint8_t *slots) {
+    __fsm_guard_node_t *node = &fsm->__guards[id];
+    if (node->kind == __FSM_GUARD_COMPARE) {
+        counts[id] = 0;
+        slots[id] = FSM_MEMO_NONE;
+        return;
+    }
+    __fsm_guard_reset_memo(fsm, node->operands[0], counts, slots);
+    if (node->kind != __FSM_GUARD_NOT) {
+        __fsm_guard_reset_memo(fsm, node->operands[1], counts, slots);
+    }
+}
+
+/// @brief Gives the comparisons of a guard that are counted more than once a memo slot, if there are any left
+void __fsm_guard_assign_memo(fsm_t *fsm, fsm_guard_id id, uint32_t *counts, uint8_t *slots, uint8_t *next_slot) {
+    __fsm_guard_node_t *node = &fsm->__guards[id];
+    if (node->kind == __FSM_GUARD_COMPARE) {
+        if (slots[id] == FSM_MEMO_NONE && counts[id] > 1 && *next_slot < FSM_MEMO_MAX) {
+            slots[id] = (*next_slot)++;
+        }
+        return;
+    }
+    __fsm_guard_assign_memo(fsm, node->operands[0], counts, slots, next_slot);
+    if (node->kind != __FSM_GUARD_NOT) {
+        __fsm_guard_assign_memo(fsm, node->operands[1], counts, slots, next_slot);
+    }
+}
+
+/// @brief Emits the code of a guard, returning the index of the next instruction
+/// @param code The start of the guard's code, jump targets are relative to it
+/// @param at Where to emit the guard's code
+/// @param slots The memo slot of each comparison
+fsm_size_t __fsm_guard_emit(fsm_t *fsm, fsm_guard_id id, __fsm_guard_insn_t *code, fsm_size_t at, uint8_t *slots) {
+    __fsm_guard_node_t *node = &fsm->__guards[id];
+    switch (node->kind) {
+        case __FSM_GUARD_COMPARE: {
+            __fsm_guard_insn_t *insn = &code[at];
+            insn->op = (uint8_t)__FSM_GUARD_OP_COMPARE(node->type, node->compare);
+            insn->memo = slots[id];
+            insn->offset = node->offset;
+            insn->constant = node->constant;
+            return at + 1;
+        }
+        case __FSM_GUARD_NOT: {
+            at = __fsm_guard_emit(fsm, node->operands[0], code, at, slots);
+            code[at].op = __FSM_GUARD_OP_NOT;
+            return at + 1;
+        }
+        default: {
+            // Evaluate the cheaper operand first, and skip the other one if it decides the result
+            fsm_guard_id first = node->operands[0];
+            fsm_guard_id second = node->operands[1];
+            if (fsm->__guards[second].cost < fsm->__guards[first].cost) {
+                first = node->operands[1];
+                second = node->operands[0];
+            }
+
+            at = __fsm_guard_emit(fsm, first, code, at, slots);
+            fsm_size_t jump = at++;
+            at = __fsm_guard_emit(fsm, second, code, at, slots);
+            code[jump].op = node->kind == __FSM_GUARD_AND ? __FSM_GUARD_OP_JUMP_IF_FALSE : __FSM_GUARD_OP_JUMP_IF_TRUE;
+            code[jump].offset = (uint32_t)at;
+            return at;
+        }
+    }
+}
+
+/// @brief Shortens chains of jumps in a guard's code, like the ones nested ANDs and ORs leave
+void __fsm_guard_thread_jumps(__fsm_guard_insn_t *code, fsm_size_t size) {
+    for (fsm_size_t i = 0; i < size; i++) {
+        if (code[i].op != __FSM_GUARD_OP_JUMP_IF_FALSE && code[i].op != __FSM_GUARD_OP_JUMP_IF_TRUE) {
+            continue;
+        }
+
+        // When jumping, the register is known, so a jump landing on another jump knows where that one goes
+        uint32_t target = code[i].offset;
+        while (code[target].op == __FSM_GUARD_OP_JUMP_IF_FALSE || code[target].op == __FSM_GUARD_OP_JUMP_IF_TRUE) {
+            target = code[target].op == code[i].op ? code[target].offset : target + 1;
+        }
+        code[i].offset = target;
+    }
+}
+
+/// @brief Compiles a guard into the image's guard code, returning where the next guard's code goes
+/// @note A guard takes exactly its node's size plus one (the END) instructions
+fsm_size_t __fsm_guard_compile(fsm_t *fsm, __fsm_image_t *image, fsm_guard_id guard, fsm_size_t at,
+                               uint8_t *slots) {
+    __fsm_guard_insn_t *code = &image->guard_code[at];
+    fsm_size_t size = __fsm_guard_emit(fsm, guard, code, 0, slots);
+    code[size].op = __FSM_GUARD_OP_END;
+    __fsm_guard_thread_jumps(code, size);
+    return at + size + 1;
+}
+
+/// @brief Compiles the guards of every image transition, into the image's guard_code
+/// @param counts Scratch space, a zeroed count per guard node, left zeroed
+/// @param slots Scratch space, FSM_MEMO_NONE per guard node, left that way
+/// @note The image transitions hold their guard's id on the way in, and the offset of its code
+///       (or UINT32_MAX) on the way out. Like predicates (see __fsm_compile_memo), a comparison
+///       checked by several of a state's transitions gets a memo slot, the first FSM_MEMO_MAX of them anyway.
+void __fsm_compile_guards(fsm_t *fsm, __fsm_image_t *image, uint32_t *counts, uint8_t *slots) {
+    fsm_size_t code_used = 0;
+
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        __fsm_image_state_t *state = &image->states[s];
+        __fsm_image_transition_t *begin = &image->transitions[state->transition_begin];
+        __fsm_image_transition_t *end = &image->transitions[state->transition_end];
+
+        for (__fsm_image_transition_t *t = begin; t < end; t++) {
+            if (t->guard != FSM_NO_GUARD) {
+                __fsm_guard_count_compares(fsm, t->guard, counts);
+            }
+        }
+        uint8_t next_slot = 0;
+        for (__fsm_image_transition_t *t = begin; t < end; t++) {
+            if (t->guard != FSM_NO_GUARD) {
+                __fsm_guard_assign_memo(fsm, t->guard, counts, slots, &next_slot);
+            }
+        }
+
+        // Every guard of the state needs the memo slots, so they're only cleared once all are compiled
+        fsm_size_t state_code = code_used;
+        for (__fsm_image_transition_t *t = begin; t < end; t++) {
+            if (t->guard != FSM_NO_GUARD) {
+                code_used = __fsm_guard_compile(fsm, image, t->guard, code_used, slots);
+            }
+        }
+        for (__fsm_image_transition_t *t = begin; t < end; t++) {
+            if (t->guard == FSM_NO_GUARD) {
+                t->guard = UINT32_MAX;
+                continue;
+            }
+            __fsm_guard_reset_memo(fsm, t->guard, counts, slots);
+            uint32_t size = fsm->__guards[t->guard].size + 1;
+            t->guard = (uint32_t)state_code;
+            state_code += size;
+        }
+    }
+
+    // Event transitions are checked one (state, event) pair at a time, without a memo
+    for (fsm_size_t i = 0; i < image->event_transition_count; i++) {
+        __fsm_image_transition_t *t = &image->event_transitions[i];
+        if (t->guard == FSM_NO_GUARD) {
+            t->guard = UINT32_MAX;
+            continue;
+        }
+        uint32_t at = (uint32_t)code_used;
+        code_used = __fsm_guard_compile(fsm, image, t->guard, code_used, slots);
+        t->guard = at;
+    }
+}
+
+/// @brief Allocates the predicate statistics of FSM_OPTION_ADAPTIVE_ORDER for a freshly compiled image
+/// @param predicate_count The number of predicates of the transitions fsm_run checks
+/// @return The statistics, all zero, or NULL if the allocation failed
+__fsm_adaptive_t *__fsm_compile_adaptive(fsm_t *fsm, __fsm_image_t *image, fsm_size_t predicate_count) {
+    fsm_size_t stats_offset = FSM_ARENA_ALIGN(sizeof(__fsm_adaptive_t));
+    fsm_size_t offsets_offset = stats_offset + sizeof(fsm_predicate_stats_t) * predicate_count;
+    char *block = (char *)__fsm_alloc_reusable(fsm, offsets_offset + sizeof(uint32_t) * (image->state_count + 1));
+    if (!block) {
+        return NULL;
+    }
+
+    __fsm_adaptive_t *adaptive = (__fsm_adaptive_t *)block;
+    adaptive->stats = (fsm_predicate_stats_t *)(block + stats_offset);
+    adaptive->offsets = (uint32_t *)(block + offsets_offset);
+    adaptive->scans = 0;
+    adaptive->sampled_scans = 0;
+
+    uint32_t used = 0;
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        adaptive->offsets[s] = used;
+        for (uint32_t t = image->states[s].transition_begin; t < image->states[s].transition_end; t++) {
+            fsm_transition_predicate_fn *predicates = __fsm_image_predicates(&image->transitions[t]);
+            for (uint32_t p = 0; p < image->transitions[t].predicate_count; p++, used++) {
+                memset(&adaptive->stats[used], 0, sizeof(fsm_predicate_stats_t));
+                adaptive->stats[used].predicate = predicates[p];
+            }
+        }
+    }
+    return adaptive;
+}
+
+/// @brief Finds the reads declared for a predicate with fsm_predicate_reads, or NULL if it declared none
+/// @note A linear search, FSMs have few distinct predicates and this only runs while building and compiling
+__fsm_predicate_reads_t *__fsm_find_predicate_reads(fsm_t *fsm, fsm_transition_predicate_fn predicate) {
+    for (fsm_size_t i = 0; i < fsm->__predicate_reads_count; i++) {
+        if (fsm->__predicate_reads[i].predicate == predicate) {
+            return &fsm->__predicate_reads[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief Allocates the cached transition results of FSM_OPTION_DEPENDENCY_TRACKING for a freshly compiled image
+/// @return The cache, with nothing known yet, or NULL if the allocation failed
+/// @note This runs before the guards are compiled, while the transitions still hold their guard ids
+__fsm_tracking_t *__fsm_compile_tracking(fsm_t *fsm, __fsm_image_t *image) {
+    fsm_size_t most = 0;
+    for (fsm_size_t s = 0; s < image->state_count; s++) {
+        fsm_size_t count = image->states[s].transition_end - image->states[s].transition_begin;
+        most = count > most ? count : most;
+    }
+    __fsm_image_state_t *any = &image->states[image->state_count];
+    most += any->transition_end - any->transition_begin;  // a scan checks these after the state's own
+
+    fsm_size_t known_false_words = (most + 63) / 64;
+    fsm_size_t reads_offset = FSM_ARENA_ALIGN(sizeof(__fsm_tracking_t));
+    fsm_size_t known_false_offset = reads_offset + sizeof(uint64_t) * image->transition_count;
+    char *block = (char *)__fsm_alloc_reusable(fsm, known_false_offset + sizeof(uint64_t) * known_false_words);
+    if (!block) {
+        return NULL;
+    }
+
+    __fsm_tracking_t *tracking = (__fsm_tracking_t *)block;
+    tracking->reads = (uint64_t *)(block + reads_offset);
+    tracking->known_false = (uint64_t *)(block + known_false_offset);
+    tracking->known_false_words = known_false_words;
+    tracking->state = UINT32_MAX;
+    tracking->settled = false;
+    memset(tracking->known_false, 0, sizeof(uint64_t) * known_false_words);
+
+    for (fsm_size_t t = 0; t < image->transition_count; t++) {
+        __fsm_image_transition_t *transition = &image->transitions[t];
+        uint64_t reads = transition->guard == FSM_NO_GUARD ? 0 : fsm->__guards[transition->guard].reads;
+        fsm_transition_predicate_fn *predicates = __fsm_image_predicates(transition);
+        fsm_bool known = true;
+        for (uint32_t p = 0; p < transition->predicate_count && known; p++) {
+            __fsm_predicate_reads_t *declared = __fsm_find_predicate_reads(fsm, predicates[p]);
+            known = declared != NULL;
+            reads |= known ? declared->reads : 0;
+        }
+        tracking->reads[t] = known && !(transition->to & __FSM_TARGET_SELECTOR) ? reads : 0;
+    }
+    return tracking;
+}
+
+/// @brief Compiles the FSM's states and transitions into its runtime image
+/// @param fsm The FSM to compile
+/// @return true if the image is up to date, false if an allocation failed (the old image is kept)
+/// @note Transitions are grouped by their `from` state (and event transitions by their (state, event)
+///       pair) with a stable counting sort, so grouped transitions keep the order they were added in.
+///       This runs in O(states + transitions).
+fsm_bool __fsm_compile(fsm_t *fsm) {
+    fsm_size_t state_count = fsm->__state_count;
+    fsm_size_t transition_count = 0;
+    fsm_size_t event_transition_count = 0;
+
+    // Size every section: predicate groups too big to inline go to the pool, names to the blob,
+    // and every predicate checked by fsm_run may need a memo slot
+    fsm_size_t pool_count = 0;
+    fsm_size_t selector_count = 0;
+    fsm_size_t memo_slot_count = 0;
+    fsm_size_t guard_code_count = 0;
+    fsm_size_t select_bit_count = 0;
+    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
+        __fsm_transition_t *t = &fsm->transitions[i];
+        if (t->guard != FSM_NO_GUARD) {
+            guard_code_count += fsm->__guards[t->guard].size + 1;
+        }
+        if (t->event == FSM_NO_EVENT) {
+            transition_count++;
+            memo_slot_count += t->predicates.predicate_count;
+            select_bit_count += t->predicates.predicate_count + (t->guard != FSM_NO_GUARD);
+        } else {
+            event_transition_count++;
+        }
+        if (t->predicates.predicate_count > FSM_INLINE_PREDICATES) {
+            pool_count += t->predicates.predicate_count;
+        }
+        selector_count += t->selector != NULL;
+    }
+    fsm_size_t names_size = 0;
+    for (fsm_size_t i = 0; i < state_count; i++) {
+        names_size += (fsm->states[i].name ? strlen(fsm->states[i].name) : 0) + 1;
+    }
+
+    // Keep the event table at most half full, so lookups rarely probe more than one slot
+    fsm_size_t event_table_capacity = 0;
+    if (event_transition_count > 0) {
+        event_table_capacity = 4;
+        while (event_table_capacity < event_transition_count * 2) {
+            event_table_capacity *= 2;
+        }
+    }
+
+    fsm_size_t states_offset = 0;
+    fsm_size_t range_count = state_count + 1;  // the states, and the any-state transitions
+    fsm_size_t transitions_offset = FSM_IMAGE_ALIGN(states_offset + sizeof(__fsm_image_state_t) * range_count);
+    fsm_size_t event_transitions_offset =
+        FSM_IMAGE_ALIGN(transitions_offset + sizeof(__fsm_image_transition_t) * transition_count);
+    fsm_size_t event_table_offset =
+        FSM_IMAGE_ALIGN(event_transitions_offset + sizeof(__fsm_image_transition_t) * event_transition_count);
+    fsm_size_t pool_offset =
+        FSM_IMAGE_ALIGN(event_table_offset + sizeof(__fsm_image_event_slot_t) * event_table_capacity);
+    fsm_size_t selectors_offset = pool_offset + sizeof(fsm_transition_predicate_fn) * pool_count;
+    fsm_size_t guard_code_offset =
+        FSM_IMAGE_ALIGN(selectors_offset + sizeof(fsm_transition_selector_fn) * selector_count);
+    fsm_size_t memo_offsets_offset =
+        FSM_IMAGE_ALIGN(guard_code_offset + sizeof(__fsm_guard_insn_t) * guard_code_count);
+    fsm_size_t memo_slots_offset = memo_offsets_offset + sizeof(uint32_t) * range_count;
+    if (fsm->__options & FSM_OPTION_BITMASK_SELECTION) {
+        select_bit_count += range_count;  // the headers
+    } else {
+        select_bit_count = 0;
+    }
+    fsm_size_t select_offsets_offset = FSM_IMAGE_ALIGN(memo_slots_offset + sizeof(uint8_t) * memo_slot_count);
+    fsm_size_t select_bits_offset = FSM_IMAGE_ALIGN(select_offsets_offset + sizeof(uint32_t) * range_count);
+    fsm_size_t name_offsets_offset =
+        FSM_IMAGE_ALIGN(select_bits_offset + sizeof(__fsm_image_select_bit_t) * select_bit_count);
+    fsm_size_t names_offset = name_offsets_offset + sizeof(uint32_t) * state_count;
+    fsm_size_t image_size = names_offset + names_size;
+
+    // Scratch space to intern the predicates of one state at a time, see __fsm_compile_memo
+    fsm_size_t memo_table_capacity = 4;
+    while (memo_table_capacity < memo_slot_count * 2) {
+        memo_table_capacity *= 2;
+    }
+    __fsm_memo_entry_t *memo_table =
+        (__fsm_memo_entry_t *)fsm->__alloc_fn(sizeof(__fsm_memo_entry_t) * memo_table_capacity);
+    if (!memo_table) {
+        return false;
+    }
+    memset(memo_table, 0, sizeof(__fsm_memo_entry_t) * memo_table_capacity);
+
+    // And to count the comparisons of one state's guards, see __fsm_compile_guards and __fsm_compile_select
+    uint32_t *guard_counts = (uint32_t *)fsm->__alloc_fn((sizeof(uint32_t) + sizeof(uint8_t)) * fsm->__guard_count + 1);
+    if (!guard_counts) {
+        fsm->__dealloc_fn(memo_table);
+        return false;
+    }
+    uint8_t *guard_slots = (uint8_t *)(guard_counts + fsm->__guard_count);
+    memset(guard_counts, 0, sizeof(uint32_t) * fsm->__guard_count);
+    memset(guard_slots, FSM_MEMO_NONE, sizeof(uint8_t) * fsm->__guard_count);
+
+    void *block = __fsm_alloc_reusable(fsm, image_size + FSM_IMAGE_ALIGNMENT - 1);
+    if (!block) {
+        fsm->__dealloc_fn(guard_counts);
+        fsm->__dealloc_fn(memo_table);
+        return false;
+    }
+    char *base = (char *)FSM_IMAGE_ALIGN((uintptr_t)block);
+
+    __fsm_image_t image;
+    image.states = (__fsm_image_state_t *)(base + states_offset);
+    image.transitions = (__fsm_image_transition_t *)(base + transitions_offset);
+    image.event_transitions = (__fsm_image_transition_t *)(base + event_transitions_offset);
+    image.event_table = (__fsm_image_event_slot_t *)(base + event_table_offset);
+    image.predicate_pool = (fsm_transition_predicate_fn *)(base + pool_offset);
+    image.selectors = (fsm_transition_selector_fn *)(base + selectors_offset);
+    image.guard_code = (__fsm_guard_insn_t *)(base + guard_code_offset);
+    image.memo_offsets = (uint32_t *)(base + memo_offsets_offset);
+    image.memo_slots = (uint8_t *)(base + memo_slots_offset);
+    image.select_offsets = (uint32_t *)(base + select_offsets_offset);
+    image.select_bits = (__fsm_image_select_bit_t *)(base + select_bits_offset);
+    image.name_offsets = (uint32_t *)(base + name_offsets_offset);
+    image.names = base + names_offset;
+    image.state_count = state_count;
+    image.transition_count = transition_count;
+    image.event_transition_count = event_transition_count;
+    image.event_table_capacity = event_table_capacity;
+    image.__block = block;
+
+    // States, with their names in the cold blob
+    uint32_t name_offset = 0;
+    for (fsm_size_t i = 0; i < state_count; i++) {
+        fsm_state_t *state = &fsm->states[i];
+        __fsm_image_state_t *image_state = &image.states[i];
+        image_state->on_enter = state->on_enter;
+        image_state->on_update = state->on_update;
+        image_state->on_exit = state->on_exit;
+        image_state->on_step = state->on_step;
+        image_state->transition_begin = 0;
+        image_state->transition_end = 0;
+
+        fsm_size_t name_size = (state->name ? strlen(state->name) : 0) + 1;
+        memcpy(image.names + name_offset, state->name ? state->name : "", name_size);
+        image.name_offsets[i] = name_offset;
+        name_offset += (uint32_t)name_size;
+    }
+    memset(&image.states[state_count], 0, sizeof(__fsm_image_state_t));
+    for (fsm_size_t i = 0; i < event_table_capacity; i++) {
+        image.event_table[i].state = UINT32_MAX;
+    }
+
+    // Count the outgoing transitions of each state (the any-state ones in the last range) and each
+    // (state, event) pair, then turn the counts into ranges, leaving transition_end at the start of the
+    // range so it can be used as a cursor
+    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
+        __fsm_transition_t *t = &fsm->transitions[i];
+        if (t->event == FSM_NO_EVENT) {
+            image.states[t->from == FSM_ANY_STATE ? state_count : t->from].transition_end++;
+            continue;
+        }
+
+        __fsm_image_event_slot_t *slot =
+            __fsm_image_event_slot(image.event_table, event_table_capacity, (uint32_t)t->from, t->event);
+        if (slot->state == UINT32_MAX) {
+            slot->state = (uint32_t)t->from;
+            slot->event = t->event;
+            slot->transition_end = 0;
+        }
+        slot->transition_end++;
+    }
+    uint32_t range_begin = 0;
+    for (fsm_size_t i = 0; i < range_count; i++) {
+        uint32_t count = image.states[i].transition_end;
+        image.states[i].transition_begin = range_begin;
+        image.states[i].transition_end = range_begin;
+        range_begin += count;
+    }
+    range_begin = 0;
+    for (fsm_size_t i = 0; i < event_table_capacity; i++) {
+        __fsm_image_event_slot_t *slot = &image.event_table[i];
+        if (slot->state == UINT32_MAX) {
+            continue;
+        }
+        uint32_t count = slot->transition_end;
+        slot->transition_begin = range_begin;
+        slot->transition_end = range_begin;
+        range_begin += count;
+    }
+
+    // Scatter the transitions into their groups, which leaves transition_end at the end of the range.
+    // The any-state transitions are stored once, in their own range, so the memo, selection and ordering
+    // treat them like the transitions of one more state.
+    fsm_size_t pool_used = 0;
+    fsm_size_t selectors_used = 0;
+    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
+        __fsm_transition_t *t = &fsm->transitions[i];
+        __fsm_image_transition_t *image_t;
+        if (t->event == FSM_NO_EVENT) {
+            fsm_size_t range = t->from == FSM_ANY_STATE ? state_count : t->from;
+            image_t = &image.transitions[image.states[range].transition_end++];
+        } else {
+            __fsm_image_event_slot_t *slot =
+                __fsm_image_event_slot(image.event_table, event_table_capacity, (uint32_t)t->from, t->event);
+            image_t = &image.event_transitions[slot->transition_end++];
+        }
+        __fsm_compile_transition(&image, t, image_t, &pool_used, &selectors_used);
+    }
+
+    __fsm_compile_memo(&image, memo_table, memo_table_capacity);
+    __fsm_compile_select(fsm, &image, memo_table, memo_table_capacity, guard_counts);
+
+    // Nothing cached survives a recompile either, the transitions may have changed
+    __fsm_tracking_t *tracking = NULL;
+    if (fsm->__options & FSM_OPTION_DEPENDENCY_TRACKING) {
+        tracking = __fsm_compile_tracking(fsm, &image);
+        if (!tracking) {
+            fsm->__dealloc_fn(guard_counts);
+            fsm->__dealloc_fn(memo_table);
+            __fsm_free_reusable(fsm, block);
+            return false;
+        }
+    }
+
+    __fsm_compile_guards(fsm, &image, guard_counts, guard_slots);
+    __fsm_link_select_guards(&image);
+    fsm->__dealloc_fn(guard_counts);
+    fsm->__dealloc_fn(memo_table);
+
+    // The statistics follow the image's predicate order, so they start over with it
+    __fsm_adaptive_t *adaptive = NULL;
+    if (fsm->__options & FSM_OPTION_ADAPTIVE_ORDER) {
+        adaptive = __fsm_compile_adaptive(fsm, &image, memo_slot_count);
+        if (!adaptive) {
+            if (tracking) {
+                __fsm_free_reusable(fsm, tracking);
+            }
+            __fsm_free_reusable(fsm, block);
+            return false;
+        }
+    }
+    if (fsm->__adaptive) {
+        __fsm_free_reusable(fsm, fsm->__adaptive);
+    }
+    fsm->__adaptive = adaptive;
+    if (fsm->__tracking) {
+        __fsm_free_reusable(fsm, fsm->__tracking);
+    }
+    fsm->__tracking = tracking;
+
+    if (fsm->__image.__block) {
+        __fsm_free_reusable(fsm, fsm->__image.__block);
+    }
+    fsm->__image = image;
+    fsm->__image_dirty = false;
+    fsm->__settled_state = UINT32_MAX;  // the transitions may have changed
+    return true;
+}
+
+/// @brief Results memoized during one transition scan, one bit per memo slot
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_memo {
+    uint64_t known;    // slots whose result is known
+    uint64_t results;  // slots whose predicate / comparison held
+} __fsm_memo_t;
+
+// The cases of __fsm_guard_test for one field type: load the field, and compare it to the constant
+#define __FSM_GUARD_TEST_CASE(type, field_type, constant_member, compare, operator)    \
+    case __FSM_GUARD_OP_COMPARE(type, compare): {                                      \
+        field_type value;                                                              \
+        memcpy(&value, field, sizeof(value));                                          \
+        return value operator insn->constant.constant_member;                          \
+    }
+#define __FSM_GUARD_TEST_CASES(type, field_type, constant_member)          \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_EQ, ==) \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_NE, !=) \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_LT, <)  \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_LE, <=) \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_GT, >)  \
+    __FSM_GUARD_TEST_CASE(type, field_type, constant_member, FSM_GE, >=)
+
+/// @brief Evaluates one comparison of a guard against a context
+fsm_bool __fsm_guard_test(const __fsm_guard_insn_t *insn, const void *context) {
+    const char *field = (const char *)context + insn->offset;
+    switch (insn->op) {
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_I8, int8_t, i)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_I16, int16_t, i)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_I32, int32_t, i)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_I64, int64_t, i)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_U8, uint8_t, u)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_U16, uint16_t, u)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_U32, uint32_t, u)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_U64, uint64_t, u)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_F32, float, f)
+        __FSM_GUARD_TEST_CASES(FSM_FIELD_F64, double, f)
+        default: return false;
+    }
+}
+
+/// @brief Runs a compiled guard against a context
+/// @param code The guard's code
+/// @param context The context to read the fields from
+/// @param memo Results of the comparisons already evaluated in this scan, updated with the new ones
+fsm_bool __fsm_guard_run(const __fsm_guard_insn_t *code, const void *context, __fsm_memo_t *memo) {
+    fsm_bool value = false;
+    for (uint32_t pc = 0;; pc++) {
+        const __fsm_guard_insn_t *insn = &code[pc];
+        switch (insn->op) {
+            case __FSM_GUARD_OP_END:
+                return value;
+            case __FSM_GUARD_OP_JUMP_IF_FALSE:
+                if (!value) pc = insn->offset - 1;
+                break;
+            case __FSM_GUARD_OP_JUMP_IF_TRUE:
+                if (value) pc = insn->offset - 1;
+                break;
+            case __FSM_GUARD_OP_NOT:
+                value = !value;
+                break;
+            default: {
+                // A comparison, unless its result is memoized already
+                uint64_t bit = insn->memo == FSM_MEMO_NONE ? 0 : (uint64_t)1 << insn->memo;
+                if (memo->known & bit) {
+                    value = (memo->results & bit) != 0;
+                } else {
+                    value = __fsm_guard_test(insn, context);
+                    memo->known |= bit;
+                    memo->results |= value ? bit : 0;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/// @brief The contexts fsm_guard_eval_batch is checking a guard against
+/// @note This is an internal structure, do not use this directly
+typedef struct __fsm_guard_batch {
+    const fsm_t *fsm;
+    const char *contexts;
+    fsm_size_t stride;  // or FSM_GUARD_SOA
+    fsm_simd_level_t level;
+} __fsm_guard_batch_t;
+
+fsm_simd_level_t __fsm_simd_limit = FSM_SIMD_AVX2;
+
+/// @brief Checks if a comparison against a 32-bit field gives the same results when the constant is narrowed
+///        to 32 bits, so the SIMD paths can compare 32-bit lanes
+fsm_bool __fsm_guard_constant_fits_32(const __fsm_guard_node_t *node) {
+    switch (node->type) {
+        case FSM_FIELD_I32: return node->constant.i >= INT32_MIN && node->constant.i <= INT32_MAX;
+        case FSM_FIELD_U32: return node->constant.u <= UINT32_MAX;
+        case FSM_FIELD_F32:
+            // NaN compares the same either way
+            return (double)(float)node->constant.f == node->constant.f || node->constant.f != node->constant.f;
+        default: return false;
+    }
+}
+
+#if __FSM_SIMD_X86
+
+#define __FSM_TARGET_AVX2 __attribute__((target("avx2")))
+#define __FSM_TARGET_SSE2 __attribute__((target("sse2")))
+
+/// @brief Compares 8 lanes of signed 32-bit integers, returning one bit per lane
+static inline __FSM_TARGET_AVX2 uint32_t __fsm_avx2_compare_i32(__m256i value, __m256i constant, uint8_t compare) {
+    __m256i result;
+    uint32_t invert = 0;
+    switch (compare) {
+        case FSM_EQ: result = _mm256_cmpeq_epi32(value, constant); break;
+        case FSM_NE: result = _mm256_cmpeq_epi32(value, constant), invert = 0xFF; break;
+        case FSM_LT: result = _mm256_cmpgt_epi32(constant, value); break;
+        case FSM_GE: result = _mm256_cmpgt_epi32(constant, value), invert = 0xFF; break;
+        case FSM_GT: result = _mm256_cmpgt_epi32(value, constant); break;
+        default: result = _mm256_cmpgt_epi32(value, constant), invert = 0xFF; break;
+    }
+    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(result)) ^ invert;
+}
+
+/// @brief Compares 4 lanes of signed 64-bit integers, returning one bit per lane
+static inline __FSM_TARGET_AVX2 uint32_t __fsm_avx2_compare_i64(__m256i value, __m256i constant, uint8_t compare) {
+    __m256i result;
+    uint32_t invert = 0;
+    switch (compare) {
+        case FSM_EQ: result = _mm256_cmpeq_epi64(value, constant); break;
+        case FSM_NE: result = _mm256_cmpeq_epi64(value, constant), invert = 0xF; break;
+        case FSM_LT: result = _mm256_cmpgt_epi64(constant, value); break;
+        case FSM_GE: result = _mm256_cmpgt_epi64(constant, value), invert = 0xF; break;
+        case FSM_GT: result = _mm256_cmpgt_epi64(value, constant); break;
+        default: result = _mm256_cmpgt_epi64(value, constant), invert = 0xF; break;
+    }
+    return (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(result)) ^ invert;
+}
+
+/// @brief Compares 8 lanes of floats, with the same NaN semantics as C's operators
+static inline __FSM_TARGET_AVX2 uint32_t __fsm_avx2_compare_f32(__m256 value, __m256 constant, uint8_t compare) {
+    switch (compare) {
+        case FSM_EQ: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_EQ_OQ));
+        case FSM_NE: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_NEQ_UQ));
+        case FSM_LT: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_LT_OQ));
+        case FSM_LE: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_LE_OQ));
+        case FSM_GT: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_GT_OQ));
+        default: return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(value, constant, _CMP_GE_OQ));
+    }
+}
+
+/// @brief Compares 4 lanes of doubles, with the same NaN semantics as C's operators
+static inline __FSM_TARGET_AVX2 uint32_t __fsm_avx2_compare_f64(__m256d value, __m256d constant, uint8_t compare) {
+    switch (compare) {
+        case FSM_EQ: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_EQ_OQ));
+        case FSM_NE: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_NEQ_UQ));
+        case FSM_LT: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_LT_OQ));
+        case FSM_LE: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_LE_OQ));
+        case FSM_GT: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_GT_OQ));
+        default: return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(value, constant, _CMP_GE_OQ));
+    }
+}
+
+/// @brief Compares as many lanes of a field as AVX2 can take at once
+/// @param field The field of the first context
+/// @param step The distance between the field of two contexts
+/// @param lanes The number of contexts
+/// @param done Receives the number of contexts compared, the rest are left to the scalar path
+/// @return The results for the contexts compared
+__FSM_TARGET_AVX2 uint64_t __fsm_guard_batch_avx2(const __fsm_guard_node_t *node, const char *field,
+                                                  fsm_size_t step, uint32_t lanes, uint32_t *done) {
+    uint64_t mask = 0;
+    uint32_t i = 0;
+    fsm_size_t size = __fsm_field_size(node->type);
+    if (step > INT32_MAX / 8) {
+        *done = 0;  // too far apart to gather
+        return 0;
+    }
+    int32_t s = (int32_t)step;
+
+    if (size == 4 && __fsm_guard_constant_fits_32(node)) {
+        __m256i gather = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+        if (node->type == FSM_FIELD_F32) {
+            __m256 constant = _mm256_set1_ps((float)node->constant.f);
+            for (; i + 8 <= lanes; i += 8) {
+                const char *at = field + i * step;
+                __m256 value = step == 4 ? _mm256_loadu_ps((const float *)at)
+                                         : _mm256_i32gather_ps((const float *)at, gather, 1);
+                mask |= (uint64_t)__fsm_avx2_compare_f32(value, constant, node->compare) << i;
+            }
+        } else {
+            // Unsigned fields compare as signed with the sign bit flipped
+            __m256i bias = _mm256_set1_epi32(node->type == FSM_FIELD_U32 ? INT32_MIN : 0);
+            __m256i constant = _mm256_xor_si256(_mm256_set1_epi32((int32_t)node->constant.i), bias);
+            for (; i + 8 <= lanes; i += 8) {
+                const char *at = field + i * step;
+                __m256i value = step == 4 ? _mm256_loadu_si256((const __m256i *)at)
+                                          : _mm256_i32gather_epi32((const int *)at, gather, 1);
+                value = _mm256_xor_si256(value, bias);
+                mask |= (uint64_t)__fsm_avx2_compare_i32(value, constant, node->compare) << i;
+            }
+        }
+    } else if (size == 8) {
+        __m128i gather = _mm_setr_epi32(0, s, 2 * s, 3 * s);
+        if (node->type == FSM_FIELD_F64) {
+            __m256d constant = _mm256_set1_pd(node->constant.f);
+            for (; i + 4 <= lanes; i += 4) {
+                const char *at = field + i * step;
+                __m256d value = step == 8 ? _mm256_loadu_pd((const double *)at)
+                                          : _mm256_i32gather_pd((const double *)at, gather, 1);
+                mask |= (uint64_t)__fsm_avx2_compare_f64(value, constant, node->compare) << i;
+            }
+        } else {
+            __m256i bias = _mm256_set1_epi64x(node->type == FSM_FIELD_U64 ? INT64_MIN : 0);
+            __m256i constant = _mm256_xor_si256(_mm256_set1_epi64x(node->constant.i), bias);
+            for (; i + 4 <= lanes; i += 4) {
+                const char *at = field + i * step;
+                __m256i value = step == 8 ? _mm256_loadu_si256((const __m256i *)at)
+                                          : _mm256_i32gather_epi64((const long long *)at, gather, 1);
+                value = _mm256_xor_si256(value, bias);
+                mask |= (uint64_t)__fsm_avx2_compare_i64(value, constant, node->compare) << i;
+            }
+        }
+    }
+
+    *done = i;
+    return mask;
+}
+
+/// @brief Compares 4 lanes of signed 32-bit integers, returning one bit per lane
+static inline __FSM_TARGET_SSE2 uint32_t __fsm_sse2_compare_i32(__m128i value, __m128i constant, uint8_t compare) {
+    __m128i result;
+    uint32_t invert = 0;
+    switch (compare) {
+        case FSM_EQ: result = _mm_cmpeq_epi32(value, constant); break;
+        case FSM_NE: result = _mm_cmpeq_epi32(value, constant), invert = 0xF; break;
+        case FSM_LT: result = _mm_cmplt_epi32(value, constant); break;
+        case FSM_GE: result = _mm_cmplt_epi32(value, constant), invert = 0xF; break;
+        case FSM_GT: result = _mm_cmpgt_epi32(value, constant); break;
+        default: result = _mm_cmpgt_epi32(value, constant), invert = 0xF; break;
+    }
+    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(result)) ^ invert;
+}
+
+/// @brief Compares 4 lanes of floats, with the same NaN semantics as C's operators
+static inline __FSM_TARGET_SSE2 uint32_t __fsm_sse2_compare_f32(__m128 value, __m128 constant, uint8_t compare) {
+    switch (compare) {
+        case FSM_EQ: return (uint32_t)_mm_movemask_ps(_mm_cmpeq_ps(value, constant));
+        case FSM_NE: return (uint32_t)_mm_movemask_ps(_mm_cmpneq_ps(value, constant));
+        case FSM_LT: return (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(value, constant));
+        case FSM_LE: return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(value, constant));
+        case FSM_GT: return (uint32_t)_mm_movemask_ps(_mm_cmpgt_ps(value, constant));
+        default: return (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(value, constant));
+    }
+}
+
+/// @brief Compares as many lanes of a 32-bit field as SSE2 can take at once, see __fsm_guard_batch_avx2
+__FSM_TARGET_SSE2 uint64_t __fsm_guard_batch_sse2(const __fsm_guard_node_t *node, const char *field,
+                                                  fsm_size_t step, uint32_t lanes, uint32_t *done) {
+    uint64_t mask = 0;
+    uint32_t i = 0;
+    if (__fsm_field_size(node->type) != 4 || !__fsm_guard_constant_fits_32(node)) {
+        *done = 0;
+        return 0;
+    }
+
+    // Without gathers, strided fields are loaded one at a time and then compared together
+    if (node->type == FSM_FIELD_F32) {
+        __m128 constant = _mm_set1_ps((float)node->constant.f);
+        for (; i + 4 <= lanes; i += 4) {
+            const char *at = field + i * step;
+            __m128 value;
+            if (step == 4) {
+                value = _mm_loadu_ps((const float *)at);
+            } else {
+                float lane[4];
+                memcpy(&lane[0], at, sizeof(float));
+                memcpy(&lane[1], at + step, sizeof(float));
+                memcpy(&lane[2], at + 2 * step, sizeof(float));
+                memcpy(&lane[3], at + 3 * step, sizeof(float));
+                value = _mm_setr_ps(lane[0], lane[1], lane[2], lane[3]);
+            }
+            mask |= (uint64_t)__fsm_sse2_compare_f32(value, constant, node->compare) << i;
+        }
+    } else {
+        __m128i bias = _mm_set1_epi32(node->type == FSM_FIELD_U32 ? INT32_MIN : 0);
+        __m128i constant = _mm_xor_si128(_mm_set1_epi32((int32_t)node->constant.i), bias);
+        for (; i + 4 <= lanes; i += 4) {
+            const char *at = field + i * step;
+            __m128i value;
+            if (step == 4) {
+                value = _mm_loadu_si128((const __m128i *)at);
+            } else {
+                int32_t lane[4];
+                memcpy(&lane[0], at, sizeof(int32_t));
+                memcpy(&lane[1], at + step, sizeof(int32_t));
+                memcpy(&lane[2], at + 2 * step, sizeof(int32_t));
+                memcpy(&lane[3], at + 3 * step, sizeof(int32_t));
+                value = _mm_setr_epi32(lane[0], lane[1], lane[2], lane[3]);
+            }
+            value = _mm_xor_si128(value, bias);
+            mask |= (uint64_t)__fsm_sse2_compare_i32(value, constant, node->compare) << i;
+        }
+    }
+
+    *done = i;
+    return mask;
+}
+
+#endif  // __FSM_SIMD_X86
+
+// The cases of __fsm_guard_batch_compare for one field type, like __FSM_GUARD_TEST_CASES but with the
+// switch hoisted out of the loop over the contexts
+#define __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, compare, operator)   \
+    case __FSM_GUARD_OP_COMPARE(type, compare): {                                      \
+        for (uint32_t i = done; i < lanes; i++) {                                      \
+            field_type value;                                                          \
+            memcpy(&value, field + i * step, sizeof(value));                           \
+            mask |= (uint64_t)(value operator node->constant.constant_member) << i;    \
+        }                                                                              \
+        break;                                                                         \
+    }
+#define __FSM_GUARD_BATCH_CASES(type, field_type, constant_member)          \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_EQ, ==) \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_NE, !=) \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_LT, <)  \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_LE, <=) \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_GT, >)  \
+    __FSM_GUARD_BATCH_CASE(type, field_type, constant_member, FSM_GE, >=)
+
+/// @brief Compares a field of up to 64 contexts to a constant
+/// @param first The index of the first context
+/// @param lanes The number of contexts
+uint64_t __fsm_guard_batch_compare(const __fsm_guard_batch_t *batch, const __fsm_guard_node_t *node,
+                                   fsm_size_t first, uint32_t lanes) {
+    fsm_size_t step = batch->stride == FSM_GUARD_SOA ? __fsm_field_size(node->type) : batch->stride;
+    const char *field = batch->contexts + node->offset + first * step;
+    uint64_t mask = 0;
+    uint32_t done = 0;
+
+#if __FSM_SIMD_X86
+    if (batch->level >= FSM_SIMD_AVX2) {
+        mask = __fsm_guard_batch_avx2(node, field, step, lanes, &done);
+    } else if (batch->level >= FSM_SIMD_SSE2) {
+        mask = __fsm_guard_batch_sse2(node, field, step, lanes, &done);
+    }
+#endif  // __FSM_SIMD_X86
+
+    // Whatever the SIMD paths didn't take, one at a time
+    switch (__FSM_GUARD_OP_COMPARE(node->type, node->compare)) {
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_I8, int8_t, i)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_I16, int16_t, i)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_I32, int32_t, i)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_I64, int64_t, i)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_U8, uint8_t, u)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_U16, uint16_t, u)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_U32, uint32_t, u)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_U64, uint64_t, u)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_F32, float, f)
+        __FSM_GUARD_BATCH_CASES(FSM_FIELD_F64, double, f)
+        default: break;
+    }
+    return mask;
+}
+
+/// @brief Checks a guard against up to 64 contexts, short-circuiting AND / OR when every lane is decided
+uint64_t __fsm_guard_batch_block(const __fsm_guard_batch_t *batch, fsm_guard_id id, fsm_size_t first,
+                                 uint32_t lanes) {
+    const __fsm_guard_node_t *node = &batch->fsm->__guards[id];
+    uint64_t all = lanes == 64 ? ~(uint64_t)0 : ((uint64_t)1 << lanes) - 1;
+    switch (node->kind) {
+        case __FSM_GUARD_COMPARE:
+            return __fsm_guard_batch_compare(batch, node, first, lanes);
+        case __FSM_GUARD_NOT:
+            return ~__fsm_guard_batch_block(batch, node->operands[0], first, lanes) & all;
+        default: {
+            fsm_guard_id a = node->operands[0], b = node->operands[1];
+            if (batch->fsm->__guards[b].cost < batch->fsm->__guards[a].cost) {
+                a = node->operands[1];
+                b = node->operands[0];
+            }
+            uint64_t mask = __fsm_guard_batch_block(batch, a, first, lanes);
+            if (node->kind == __FSM_GUARD_AND) {
+                return mask ? mask & __fsm_guard_batch_block(batch, b, first, lanes) : 0;
+            }
+            return mask != all ? mask | __fsm_guard_batch_block(batch, b, first, lanes) : all;
+        }
+    }
+}
+
+fsm_simd_level_t fsm_guard_batch_level(void) {
+    fsm_simd_level_t level = FSM_SIMD_SCALAR;
+#if __FSM_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        level = FSM_SIMD_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        level = FSM_SIMD_SSE2;
+    }
+#endif  // __FSM_SIMD_X86
+    return level < __fsm_simd_limit ? level : __fsm_simd_limit;
+}
+
+void fsm_guard_batch_limit(fsm_simd_level_t level) { __fsm_simd_limit = level; }
+
+fsm_bool fsm_guard_eval_batch(const fsm_t *fsm, fsm_guard_id guard, const void *contexts, fsm_size_t stride,
+                              fsm_size_t count, uint64_t *mask) {
+    if (!fsm || guard >= fsm->__guard_count || (!contexts && count > 0) || (!mask && count > 0)) {
+        FSM_LOG_ERROR("fsm_guard_eval_batch: invalid guard or contexts\n");
+        return false;
+    }
+
+    __fsm_guard_batch_t batch = {fsm, (const char *)contexts, stride, fsm_guard_batch_level()};
+    for (fsm_size_t first = 0; first < count; first += 64) {
+        uint32_t lanes = count - first < 64 ? (uint32_t)(count - first) : 64;
+        mask[first / 64] = __fsm_guard_batch_block(&batch, guard, first, lanes);
+    }
+    return true;
+}
+
+fsm_bool fsm_predicate_group_eval_batch(fsm_t *fsm, fsm_predicate_group_t predicates, void *contexts,
+                                        fsm_size_t stride, fsm_size_t count, uint64_t *mask) {
+    if (!fsm || stride == 0 || (!contexts && count > 0) || (!mask && count > 0) ||
+        (!predicates.predicates && predicates.predicate_count > 0)) {
+        FSM_LOG_ERROR("fsm_predicate_group_eval_batch: invalid predicates or contexts\n");
+        return false;
+    }
+
+    for (fsm_size_t word = 0; word < (count + 63) / 64; word++) {
+        // Only the contexts still set, lowest first
+        for (uint64_t bits = mask[word]; bits; bits &= bits - 1) {
+            fsm_size_t i = word * 64 + FSM_CTZ64(bits);
+            void *context = (char *)contexts + i * stride;
+            for (fsm_size_t p = 0; p < predicates.predicate_count; p++) {
+                FSM_STATS_ADD(fsm, predicate_calls, 1);
+                if (!predicates.predicates[p](fsm, context)) {
+                    mask[word] &= ~((uint64_t)1 << (i % 64));
+                    break;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/// @brief Checks if the guard and every predicate of a compiled transition hold
+/// @param guard_memo The comparisons memoized in this scan
+fsm_bool __fsm_image_transition_ok(fsm_t *fsm, __fsm_image_transition_t *transition, void *context,
+                                   __fsm_memo_t *guard_memo) {
+    if (transition->guard != UINT32_MAX &&
+        !__fsm_guard_run(&fsm->__image.guard_code[transition->guard], context, guard_memo)) {
+        return false;
+    }
+
+    fsm_transition_predicate_fn *predicates = __fsm_image_predicates(transition);
+    for (uint32_t p = 0; p < transition->predicate_count; p++) {
+        FSM_STATS_ADD(fsm, predicate_calls, 1);
+        if (!predicates[p](fsm, context)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Gets the target of a compiled transition whose guard and predicates hold, asking its selector if it has one
+/// @return The state to transition to, or FSM_INVALID_STATE if the selector chose to stay
+fsm_state_id __fsm_image_target(fsm_t *fsm, __fsm_image_transition_t *transition, void *context) {
+    if (!(transition->to & __FSM_TARGET_SELECTOR)) {
+        return transition->to;
+    }
+
+    fsm_state_id next = fsm->__image.selectors[transition->to & ~__FSM_TARGET_SELECTOR](fsm, context);
+    if (next != FSM_STAY && next >= fsm->__image.state_count) {
+        FSM_LOG_ERROR("A transition selector returned %zu, which isn't a state, staying\n", next);
+        return FSM_INVALID_STATE;
+    }
+    return next;
+}
+
+/// @brief Checks if the guard and every predicate of a compiled transition hold, reusing the results
+///        memoized this tick
+/// @param slots The memo slots of the transition's predicates
+/// @param memo The predicates memoized in this scan
+/// @param guard_memo The comparisons memoized in this scan
+fsm_bool __fsm_image_transition_ok_memo(fsm_t *fsm, __fsm_image_transition_t *transition, void *context,
+                                        uint8_t *slots, __fsm_memo_t *memo, __fsm_memo_t *guard_memo) {
+    if (transition->guard != UINT32_MAX &&
+        !__fsm_guard_run(&fsm->__image.guard_code[transition->guard], context, guard_memo)) {
+        return false;
+    }
+
+    fsm_transition_predicate_fn *predicates = __fsm_image_predicates(transition);
+    for (uint32_t p = 0; p < transition->predicate_count; p++) {
+        fsm_bool ok;
+        if (slots[p] == FSM_MEMO_NONE) {
+            FSM_STATS_ADD(fsm, predicate_calls, 1);
+            ok = predicates[p](fsm, context);
+        } else if (memo->known & ((uint64_t)1 << slots[p])) {
+            FSM_STATS_ADD(fsm, predicate_calls_saved, 1);
+            ok = (memo->results & ((uint64_t)1 << slots[p])) != 0;
+        } else {
+            FSM_STATS_ADD(fsm, predicate_calls, 1);
+            ok = predicates[p](fsm, context);
+            memo->known |= (uint64_t)1 << slots[p];
+            memo->results |= (uint64_t)ok << slots[p];
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Like __fsm_image_transition_ok_memo, timing the predicates it calls for FSM_OPTION_ADAPTIVE_ORDER
+/// @param slots The memo slots of the transition's predicates, or NULL if the state has no memo
+/// @param stats The statistics of the transition's predicates
+fsm_bool __fsm_image_transition_ok_sampled(fsm_t *fsm, __fsm_image_transition_t *transition, void *context,
+                                           uint8_t *slots, __fsm_memo_t *memo, __fsm_memo_t *guard_memo,
+                                           fsm_predicate_stats_t *stats) {
+    if (transition->guard != UINT32_MAX &&
+        !__fsm_guard_run(&fsm->__image.guard_code[transition->guard], context, guard_memo)) {
+        return false;
+    }
+
+    fsm_transition_predicate_fn *predicates = __fsm_image_predicates(transition);
+    for (uint32_t p = 0; p < transition->predicate_count; p++) {
+        uint64_t bit = !slots || slots[p] == FSM_MEMO_NONE ? 0 : (uint64_t)1 << slots[p];
+        fsm_bool ok;
+        if (memo->known & bit) {
+            FSM_STATS_ADD(fsm, predicate_calls_saved, 1);
+            ok = (memo->results & bit) != 0;
+        } else {
+            FSM_STATS_ADD(fsm, predicate_calls, 1);
+            uint64_t start = FSM_CYCLES();
+            ok = predicates[p](fsm, context);
+            stats[p].cycles += FSM_CYCLES() - start;
+            stats[p].samples++;
+            stats[p].passes += ok ? 1 : 0;
+            memo->known |= bit;
+            memo->results |= ok ? bit : 0;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Checks if predicate a of a transition should go before b, with FSM_OPTION_ADAPTIVE_ORDER
+/// @note A predicate costing c cycles that holds with probability p rejects the transition for an expected
+///       c / (1 - p), so the lowest ratio goes first. Predicates without enough samples keep their place.
+fsm_bool __fsm_adaptive_before(const fsm_predicate_stats_t *a, const fsm_predicate_stats_t *b) {
+    if (a->samples < 8 || b->samples < 8) {
+        return false;
+    }
+    // c_a / (1 - p_a) < c_b / (1 - p_b), without dividing, with a cost of at least one cycle per call
+    double cost_a = (double)(a->cycles > a->samples ? a->cycles : a->samples) / (double)a->samples;
+    double cost_b = (double)(b->cycles > b->samples ? b->cycles : b->samples) / (double)b->samples;
+    double fail_a = (double)(a->samples - a->passes) / (double)a->samples;
+    double fail_b = (double)(b->samples - b->passes) / (double)b->samples;
+    return cost_a * fail_b < cost_b * fail_a;
+}
+
+/// @brief Reorders the predicates of every transition fsm_run checks by their statistics, then halves them
+/// @note The image's predicates, the state's memo slots and the statistics are permuted together
+void __fsm_adaptive_reorder(fsm_t *fsm) {
+    __fsm_image_t *image = &fsm->__image;
+    __fsm_adaptive_t *adaptive = fsm->__adaptive;
+    for (fsm_size_t s = 0; s <= image->state_count; s++) {
+        if (image->select_offsets[s] != UINT32_MAX) {
+            continue;  // bitmask selection doesn't check predicates in order
+        }
+        fsm_predicate_stats_t *stats = &adaptive->stats[adaptive->offsets[s]];
+        uint8_t *slots = image->memo_offsets[s] == UINT32_MAX ? NULL : &image->memo_slots[image->memo_offsets[s]];
+
+        for (uint32_t t = image->states[s].transition_begin; t < image->states[s].transition_end; t++) {
+            __fsm_image_transition_t *transition = &image->transitions[t];
+            fsm_transition_predicate_fn *predicates = __fsm_image_predicates(transition);
+
+            // A stable insertion sort, groups are small
+            for (uint32_t i = 1; i < transition->predicate_count; i++) {
+                for (uint32_t j = i; j > 0 && __fsm_adaptive_before(&stats[j], &stats[j - 1]); j--) {
+                    fsm_predicate_stats_t stat = stats[j];
+                    stats[j] = stats[j - 1];
+                    stats[j - 1] = stat;
+                    fsm_transition_predicate_fn predicate = predicates[j];
+                    predicates[j] = predicates[j - 1];
+                    predicates[j - 1] = predicate;
+                    if (slots) {
+                        uint8_t slot = slots[j];
+                        slots[j] = slots[j - 1];
+                        slots[j - 1] = slot;
+                    }
+                }
+            }
+            for (uint32_t i = 0; i < transition->predicate_count; i++) {
+                stats[i].samples /= 2;
+                stats[i].passes /= 2;
+                stats[i].cycles /= 2;
+            }
+
+            stats += transition->predicate_count;
+            slots = slots ? slots + transition->predicate_count : NULL;
+        }
+    }
+}
+
+/// @brief Finds the first transition out of a state whose guard and predicates all hold, timing the
+///        predicates for FSM_OPTION_ADAPTIVE_ORDER, and reordering them once enough scans were timed
+fsm_state_id __fsm_select_transition_sampled(fsm_t *fsm, fsm_state_id state, void *context) {
+    __fsm_image_state_t *image_state = &fsm->__image.states[state];
+    uint32_t memo_offset = fsm->__image.memo_offsets[state];
+    uint8_t *slots = memo_offset == UINT32_MAX ? NULL : &fsm->__image.memo_slots[memo_offset];
+    fsm_predicate_stats_t *stats = &fsm->__adaptive->stats[fsm->__adaptive->offsets[state]];
+    __fsm_memo_t memo = {0, 0};
+    __fsm_memo_t guard_memo = {0, 0};
+
+    fsm_state_id next = FSM_INVALID_STATE;
+    for (uint32_t i = image_state->transition_begin; i < image_state->transition_end; i++) {
+        __fsm_image_transition_t *transition = &fsm->__image.transitions[i];
+        if (__fsm_image_transition_ok_sampled(fsm, transition, context, slots, &memo, &guard_memo, stats) &&
+            (next = __fsm_image_target(fsm, transition, context)) != FSM_INVALID_STATE) {
+            break;
+        }
+        slots = slots ? slots + transition->predicate_count : NULL;
+        stats += transition->predicate_count;
+    }
+
+    if (++fsm->__adaptive->sampled_scans % FSM_ADAPTIVE_PERIOD == 0) {
+        __fsm_adaptive_reorder(fsm);
+    }
+    return next;
+}
+
+/// @brief Finds the first transition out of a state whose guard and predicates all hold, for a state
+///        selected with bitmasks (see FSM_OPTION_BITMASK_SELECTION)
+/// @return The state to transition to, or FSM_INVALID_STATE if no transition applies
+/// @note Each distinct predicate and guard is evaluated at most once, clearing the transitions that need
+///       it when it fails. It stops as soon as the first transition left is settled, and skips the
+///       requirements of transitions that already failed.
+fsm_state_id __fsm_select_transition_bitmask(fsm_t *fsm, fsm_state_id state, void *context) {
+    __fsm_image_select_bit_t *header = &fsm->__image.select_bits[fsm->__image.select_offsets[state]];
+    __fsm_memo_t guard_memo = {0, 0};
+    uint64_t blocked = header->blocks;
+    uint64_t settled = header->settles;
+
+    for (uint32_t b = 1;;) {
+        uint64_t open = ~blocked;
+        if (!open) {
+            return FSM_INVALID_STATE;
+        }
+        if (open & (0 - open) & settled) {
+            uint32_t first = fsm->__image.states[state].transition_begin + (uint32_t)FSM_CTZ64(open);
+            fsm_state_id next = __fsm_image_target(fsm, &fsm->__image.transitions[first], context);
+            if (next != FSM_INVALID_STATE) {
+                return next;
+            }
+            blocked |= open & (0 - open);  // its selector chose to stay, on to the next transition
+            continue;
+        }
+
+        // Every transition is settled by its last bit, so this never runs past the state's bits
+        __fsm_image_select_bit_t *bit = &header[b++];
+        settled |= bit->settles;
+        if (!(bit->blocks & open)) {
+            continue;
+        }
+
+        fsm_bool ok;
+        if (bit->predicate) {
+            FSM_STATS_ADD(fsm, predicate_calls, 1);
+            ok = bit->predicate(fsm, context);
+        } else {
+            ok = __fsm_guard_run(&fsm->__image.guard_code[bit->guard], context, &guard_memo);
+        }
+        if (!ok) {
+            blocked |= bit->blocks;
+        }
+    }
+}
+
+/// @brief Finds the first transition out of a state whose guard and predicates all hold, skipping the
+///        transitions known to be false since nothing they read was written (see FSM_OPTION_DEPENDENCY_TRACKING)
+/// @note This checks the state's transitions, then the any-state ones. It also times the predicates for
+///       FSM_OPTION_ADAPTIVE_ORDER on the scans it samples. Ranges selected with bitmasks are checked as usual.
+fsm_state_id __fsm_select_transition_tracked(fsm_t *fsm, fsm_state_id state, void *context) {
+    __fsm_tracking_t *tracking = fsm->__tracking;
+    uint64_t written = fsm->__written;
+    fsm->__written = 0;
+    if (tracking->state != (uint32_t)state) {
+        memset(tracking->known_false, 0, sizeof(uint64_t) * tracking->known_false_words);
+        tracking->state = (uint32_t)state;
+        tracking->settled = false;
+    } else if (tracking->settled && !written) {
+        return FSM_INVALID_STATE;  // the common case of an idle tick, nothing changed since every one was false
+    }
+
+    fsm_bool sampled = fsm->__adaptive && fsm->__adaptive->scans++ % FSM_ADAPTIVE_SAMPLE_INTERVAL == 0;
+    fsm_state_id next = FSM_INVALID_STATE;
+    fsm_bool settled = true;
+    uint32_t k = 0;  // the transition's index in the scan, its bit in known_false
+    fsm_state_id ranges[2] = {state, fsm->__image.state_count};
+    for (int r = 0; r < 2 && next == FSM_INVALID_STATE; r++) {
+        __fsm_image_state_t *image_state = &fsm->__image.states[ranges[r]];
+        if (fsm->__image.select_offsets[ranges[r]] != UINT32_MAX) {
+            next = __fsm_select_transition_bitmask(fsm, ranges[r], context);
+            k += image_state->transition_end - image_state->transition_begin;
+            settled = false;
+            continue;
+        }
+
+        uint32_t memo_offset = fsm->__image.memo_offsets[ranges[r]];
+        uint8_t *slots = memo_offset == UINT32_MAX ? NULL : &fsm->__image.memo_slots[memo_offset];
+        fsm_predicate_stats_t *stats = sampled ? &fsm->__adaptive->stats[fsm->__adaptive->offsets[ranges[r]]] : NULL;
+        __fsm_memo_t memo = {0, 0};
+        __fsm_memo_t guard_memo = {0, 0};
+
+        for (uint32_t i = image_state->transition_begin; i < image_state->transition_end; i++, k++) {
+            __fsm_image_transition_t *transition = &fsm->__image.transitions[i];
+            uint64_t reads = tracking->reads[i];
+            uint64_t *known_false = &tracking->known_false[k / 64];
+            uint64_t bit = (uint64_t)1 << (k % 64);
+
+            if (!(*known_false & bit) || (reads & written)) {
+                fsm_bool ok;
+                if (stats) {
+                    ok = __fsm_image_transition_ok_sampled(fsm, transition, context, slots, &memo, &guard_memo, stats);
+                } else if (slots) {
+                    ok = __fsm_image_transition_ok_memo(fsm, transition, context, slots, &memo, &guard_memo);
+                } else {
+                    ok = __fsm_image_transition_ok(fsm, transition, context, &guard_memo);
+                }
+                if (ok && (next = __fsm_image_target(fsm, transition, context)) != FSM_INVALID_STATE) {
+                    break;
+                }
+                *known_false |= reads ? bit : 0;
+                settled &= reads != 0;
+            }
+            slots = slots ? slots + transition->predicate_count : NULL;
+            stats = stats ? stats + transition->predicate_count : NULL;
+        }
+    }
+
+    if (next != FSM_INVALID_STATE) {
+        // The transitions after the one taken didn't see this scan's writes, so forget them all
+        tracking->state = UINT32_MAX;
+        settled = false;
+    }
+    tracking->settled = settled;
+
+    if (sampled && ++fsm->__adaptive->sampled_scans % FSM_ADAPTIVE_PERIOD == 0) {
+        __fsm_adaptive_reorder(fsm);
+    }
+    return next;
+}
+
+/// @brief Finds the first transition of one range of the image (a state's, or the any-state one) whose guard
+///        and predicates all hold
+/// @note Predicates and guard comparisons shared by several of the range's transitions are only
+///       evaluated once, their result is memoized for the rest of the scan
+fsm_state_id __fsm_select_range(fsm_t *fsm, fsm_state_id state, void *context) {
+    if (fsm->__image.select_offsets[state] != UINT32_MAX) {
+        return __fsm_select_transition_bitmask(fsm, state, context);
+    }
+    if (fsm->__adaptive && fsm->__adaptive->scans++ % FSM_ADAPTIVE_SAMPLE_INTERVAL == 0) {
+        return __fsm_select_transition_sampled(fsm, state, context);
+    }
+
+    __fsm_image_state_t *image_state = &fsm->__image.states[state];
+    uint32_t memo_offset = fsm->__image.memo_offsets[state];
+
+    // The memoized results only live for this scan, so they're kept on the stack
+    __fsm_memo_t guard_memo = {0, 0};
+
+    // The transitions out of a state are contiguous in the image, take the first valid one
+    if (memo_offset == UINT32_MAX) {
+        for (uint32_t i = image_state->transition_begin; i < image_state->transition_end; i++) {
+            __fsm_image_transition_t *transition = &fsm->__image.transitions[i];
+            if (__fsm_image_transition_ok(fsm, transition, context, &guard_memo)) {
+                fsm_state_id next = __fsm_image_target(fsm, transition, context);
+                if (next != FSM_INVALID_STATE) {
+                    return next;
+                }
+            }
+        }
+        return FSM_INVALID_STATE;
+    }
+
+    __fsm_memo_t memo = {0, 0};
+    uint8_t *slots = &fsm->__image.memo_slots[memo_offset];
+    for (uint32_t i = image_state->transition_begin; i < image_state->transition_end; i++) {
+        __fsm_image_transition_t *transition = &fsm->__image.transitions[i];
+        if (__fsm_image_transition_ok_memo(fsm, transition, context, slots, &memo, &guard_memo)) {
+            fsm_state_id next = __fsm_image_target(fsm, transition, context);
+            if (next != FSM_INVALID_STATE) {
+                return next;
+            }
+        }
+        slots += transition->predicate_count;
+    }
+    return FSM_INVALID_STATE;
+}
+
+/// @brief Finds the first transition out of a state whose guard and predicates all hold
+/// @param fsm The FSM whose image to use, passed to the predicates
+/// @param state The state to check the transitions of
+/// @param context The context passed to the predicates
+/// @return The state to transition to, or FSM_INVALID_STATE if no transition applies
+/// @note The state's own transitions go first, then the any-state transitions, which are stored once
+fsm_state_id __fsm_select_transition(fsm_t *fsm, fsm_state_id state, void *context) {
+    if (fsm->__tracking) {
+        return __fsm_select_transition_tracked(fsm, state, context);
+    }
+    fsm_state_id next = __fsm_select_range(fsm, state, context);
+    __fsm_image_state_t *any = &fsm->__image.states[fsm->__image.state_count];
+    if (next == FSM_INVALID_STATE && any->transition_begin != any->transition_end) {
+        next = __fsm_select_range(fsm, fsm->__image.state_count, context);
+    }
+    return next;
+}
+
+/// @brief Finds the first transition handling an event in a state whose guard and predicates all hold
+/// @return The state to transition to, or FSM_INVALID_STATE if no transition applies
+fsm_state_id __fsm_select_event_transition(fsm_t *fsm, fsm_state_id state, fsm_event_id event, void *context) {
+    __fsm_image_t *image = &fsm->__image;
+    if (image->event_table_capacity == 0) {
+        return FSM_INVALID_STATE;
+    }
+
+    __fsm_image_event_slot_t *slot =
+        __fsm_image_event_slot(image->event_table, image->event_table_capacity, (uint32_t)state, event);
+    __fsm_memo_t guard_memo = {0, 0};  // event guards have no memo slots, this stays empty
+    for (uint32_t i = slot->transition_begin; slot->state != UINT32_MAX && i < slot->transition_end; i++) {
+        __fsm_image_transition_t *transition = &image->event_transitions[i];
+        if (__fsm_image_transition_ok(fsm, transition, context, &guard_memo)) {
+            fsm_state_id next = __fsm_image_target(fsm, transition, context);
+            if (next != FSM_INVALID_STATE) {
+                return next;
+            }
+        }
+    }
+    return FSM_INVALID_STATE;
+}
+
+fsm_size_t __fsm_transition_index(fsm_t *fsm, char *from, char *to) {
+    if (!fsm || !from || !to) {
+        return (fsm_size_t)-1;
+    }
+    fsm_state_id from_idx = __fsm_state_index(fsm, from);
+    fsm_state_id to_idx = __fsm_state_index(fsm, to);
+    if (from_idx == (fsm_size_t)-1 || to_idx == (fsm_size_t)-1) {
+        return (fsm_size_t)-1;
+    }
+
+    for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
+        __fsm_transition_t *t = &fsm->transitions[i];
+        if (t->from == from_idx && t->to == to_idx) {
+            return i;
+        }
+    }
+    return (fsm_size_t)-1;
+}
+
+/// @brief Initializes a freshly allocated FSM, with no states or transitions
+void __fsm_init(fsm_t *fsm, fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, size_t context_size) {
+    fsm->context = NULL;
+    fsm->states = NULL;
+    fsm->transitions = NULL;
+    memset(&fsm->__image, 0, sizeof(fsm->__image));
+    fsm->__name_table = NULL;
+    fsm->__name_table_capacity = 0;
+
+    fsm->__alloc_fn = alloc_fn;
+    fsm->__dealloc_fn = dealloc_fn;
+    fsm->__arena = NULL;
+    fsm->__arena_block_size = 0;
+    fsm->__arena_free = NULL;
+
+    fsm->__context_size = context_size;
+    fsm->__state_count = 0;
+    fsm->__state_capacity = 0;
+    fsm->__transition_count = 0;
+    fsm->__transition_capacity = 0;
+    fsm->__instance.__state = 0;
+    fsm->__instance.__flags = 0;
+    fsm->__instance.context = NULL;
+    fsm->__event_payload = NULL;
+    fsm->__queue = NULL;
+    memset(&fsm->__stats, 0, sizeof(fsm->__stats));
+    fsm->__guards = NULL;
+    fsm->__guard_count = 0;
+    fsm->__guard_capacity = 0;
+    fsm->__guard_table = NULL;
+    fsm->__guard_table_capacity = 0;
+    fsm->__adaptive = NULL;
+    fsm->__tracking = NULL;
+    fsm->__written = 0;
+    fsm->__context_generation = 0;
+    fsm->__settled_state = UINT32_MAX;
+    fsm->__settled_generation = 0;
+    fsm->__predicate_reads = NULL;
+    fsm->__predicate_reads_count = 0;
+    fsm->__predicate_reads_capacity = 0;
+    fsm->__options = 0;
+    fsm->__step_bound = FSM_STEP_BOUND;
+    fsm->__is_finalized = false;
+    fsm->__image_dirty = true;
+}
+
+fsm_t *fsm_create(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, void *context, size_t context_size) {
+    if (!alloc_fn || !dealloc_fn) {
+        return NULL;
+    }
+
+    // Allocate the FSM structure
+    fsm_t *fsm = (fsm_t *)alloc_fn(sizeof(fsm_t));
+    if (!fsm) {
+        return NULL;
+    }
+
+    // Initialize everything
+    __fsm_init(fsm, alloc_fn, dealloc_fn, context_size);
+
+    // If we have a context and a nonzero size, copy it into FSM->context
+    if (context && context_size > 0) {
+        fsm->context = alloc_fn(context_size);
+        if (fsm->context == NULL) {
+            // Allocation failed, clean up
+            dealloc_fn(fsm);
+            return NULL;
+        }
+        memcpy(fsm->context, context, context_size);
+    }
+    fsm->__instance.context = fsm->context;
+
+    return fsm;
+}
+
+fsm_t *fsm_create_arena(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, void *context, size_t context_size,
+                        size_t arena_size) {
+    if (!alloc_fn || !dealloc_fn) {
+        return NULL;
+    }
+
+    // The first block always has room for the FSM structure and its context
+    fsm_size_t min_size = FSM_ARENA_ALIGN(sizeof(fsm_t)) + FSM_ARENA_ALIGN(context_size);
+    __fsm_arena_block_t *block = __fsm_arena_block_create(alloc_fn, arena_size > min_size ? arena_size : min_size);
+    if (!block) {
+        return NULL;
+    }
+
+    fsm_t *fsm = (fsm_t *)__fsm_arena_block_alloc(block, sizeof(fsm_t));
+    __fsm_init(fsm, alloc_fn, dealloc_fn, context_size);
+    fsm->__arena = block;
+    fsm->__arena_block_size = arena_size;
+
+    // The context goes right after the FSM, in the same block
+    if (context && context_size > 0) {
+        fsm->context = __fsm_alloc(fsm, context_size);
+        memcpy(fsm->context, context, context_size);
+    }
+    fsm->__instance.context = fsm->context;
+
+    return fsm;
+}
+
+/// @brief Updates a context in a state, then takes the transition its on_step returned, if any
+/// @return The state on_step transitioned to, or FSM_INVALID_STATE if the context stayed in `state`
+/// @note The transition calls on_exit and on_enter like one found by checking predicates, the new state
+///       is updated on the next tick
+fsm_state_id __fsm_state_update(fsm_t *fsm, fsm_state_id state, void *context) {
+    __fsm_image_state_t *states = fsm->__image.states;
+    if (states[state].on_update) {
+        states[state].on_update(fsm, context);
+    }
+    if (!states[state].on_step) {
+        return FSM_INVALID_STATE;
+    }
+
+    fsm_state_id next = states[state].on_step(fsm, context);
+    if (next == FSM_STAY) {
+        return FSM_INVALID_STATE;
+    }
+    if (next >= fsm->__image.state_count) {
+        FSM_LOG_ERROR("on_step of state %zu returned %zu, which isn't a state, staying\n", state, next);
+        return FSM_INVALID_STATE;
+    }
+
+    if (states[state].on_exit) {
+        states[state].on_exit(fsm, context);
+    }
+    if (states[next].on_enter) {
+        states[next].on_enter(fsm, context);
+    }
+    return next;
+}
+
+/// @brief Runs one tick of an instance against the FSM's compiled image
+/// @param fsm The FSM whose image to use, passed to the state functions and predicates
+/// @param instance The instance to run, either the FSM's own or one of a definition's
+/// @return The number of transitions taken, including the one on_step asked for
+fsm_size_t __fsm_instance_run(fsm_t *fsm, fsm_instance_t *instance) {
+    __fsm_image_state_t *states = fsm->__image.states;
+    void *context = instance->context;
+
+    // If we were not running before, mark running and call on_enter of the current state
+    if (!(instance->__flags & FSM_INSTANCE_RUNNING)) {
+        if (fsm->__image.state_count == 0) {
+            // No states? Nothing to run.
+            return 0;
+        }
+        instance->__flags |= FSM_INSTANCE_RUNNING;
+
+        __fsm_image_state_t *initial_state = &states[instance->__state];
+        if (initial_state->on_enter) {
+            initial_state->on_enter(fsm, context);
+        }
+    }
+
+    // If we're not running for some reason, just return
+    if (!(instance->__flags & FSM_INSTANCE_RUNNING)) {
+        return 0;
+    }
+
+    // 1. Identify the current state
+    __fsm_image_state_t *current_state = &states[instance->__state];
+
+    // 2. Check transitions out of the current state
+    //    We'll apply the first valid transition encountered, one transition per run, or with
+    //    FSM_OPTION_RUN_TO_COMPLETION keep going from the new state until none applies or the bound is hit.
+    //    With FSM_OPTION_SKIP_UNCHANGED, a state whose transitions were all false stays put until the
+    //    context changes (only the FSM's own instance ever settles, definitions can't have the option)
+    //    At the bound, running to completion scans once more without taking the transition, which tells if one
+    //    was still ready (a livelock, most likely)
+    fsm_bool run_to_completion = (fsm->__options & FSM_OPTION_RUN_TO_COMPLETION) != 0;
+    fsm_size_t step_bound = run_to_completion ? fsm->__step_bound : 1;
+    fsm_size_t steps = 0;
+    instance->__flags &= ~FSM_INSTANCE_STEP_BOUND_HIT;
+    while (steps < step_bound || run_to_completion) {
+        fsm_state_id next = FSM_INVALID_STATE;
+        uint64_t generation = fsm->__context_generation;
+        if (instance->__state != fsm->__settled_state || generation != fsm->__settled_generation) {
+            next = __fsm_select_transition(fsm, instance->__state, context);
+            if (next == FSM_INVALID_STATE && (fsm->__options & FSM_OPTION_SKIP_UNCHANGED)) {
+                fsm->__settled_state = instance->__state;
+                fsm->__settled_generation = generation;
+            }
+        }
+        if (next == FSM_INVALID_STATE) {
+            break;
+        }
+        if (steps == step_bound) {
+            instance->__flags |= FSM_INSTANCE_STEP_BOUND_HIT;
+            break;
+        }
+
+        // on_exit of current state
+        if (current_state->on_exit) {
+            current_state->on_exit(fsm, context);
+        }
+
+        // Switch the current state to the transition target
+        instance->__state = (uint32_t)next;
+        current_state = &states[next];
+        steps++;
+
+        // on_enter of new state
+        if (current_state->on_enter) {
+            current_state->on_enter(fsm, context);
+        }
+    }
+
+    // 3. Call on_update / on_step of the (possibly new) current state
+    fsm_state_id stepped = __fsm_state_update(fsm, instance->__state, context);
+    if (stepped != FSM_INVALID_STATE) {
+        instance->__state = (uint32_t)stepped;
+        steps++;
+    }
+    return steps;
+}
+
+/// @brief Sets the current state of an instance, calling on_exit / on_enter if it's running
+void __fsm_instance_set_state(fsm_t *fsm, fsm_instance_t *instance, fsm_state_id idx) {
+    // If the instance is running and we have a different current state, handle on_exit/ on_enter
+    if ((instance->__flags & FSM_INSTANCE_RUNNING) && idx != instance->__state) {
+        __fsm_image_state_t *old_state = &fsm->__image.states[instance->__state];
+        __fsm_image_state_t *new_state = &fsm->__image.states[idx];
+
+        if (old_state->on_exit) {
+            old_state->on_exit(fsm, instance->context);
+        }
+        instance->__state = (uint32_t)idx;
+        if (new_state->on_enter) {
+            new_state->on_enter(fsm, instance->context);
+        }
+    } else {
+        // Not running, or same index, just set it
+        instance->__state = (uint32_t)idx;
+    }
+}
+
+/// @brief Dispatches an event to an instance against the FSM's compiled image
+/// @return true if a transition was taken
+fsm_bool __fsm_instance_dispatch(fsm_t *fsm, fsm_instance_t *instance, fsm_event_id event, void *payload) {
+    __fsm_image_state_t *states = fsm->__image.states;
+    void *context = instance->context;
+
+    // Enter the current state first, exactly like __fsm_instance_run
+    if (!(instance->__flags & FSM_INSTANCE_RUNNING)) {
+        if (fsm->__image.state_count == 0) {
+            return false;
+        }
+        instance->__flags |= FSM_INSTANCE_RUNNING;
+        if (states[instance->__state].on_enter) {
+            states[instance->__state].on_enter(fsm, context);
+        }
+    }
+
+    // The payload stays set through on_exit / on_enter, restoring it allows dispatching from a state function
+    void *previous_payload = fsm->__event_payload;
+    fsm->__event_payload = payload;
+
+    fsm_state_id next = __fsm_select_event_transition(fsm, instance->__state, event, context);
+    if (next != FSM_INVALID_STATE) {
+        if (states[instance->__state].on_exit) {
+            states[instance->__state].on_exit(fsm, context);
+        }
+        instance->__state = (uint32_t)next;
+        if (states[next].on_enter) {
+            states[next].on_enter(fsm, context);
+        }
+    }
+
+    fsm->__event_payload = previous_payload;
+    return next != FSM_INVALID_STATE;
+}
+
+void fsm_run(fsm_t *fsm) {
+    if (!fsm) return;
+
+    // Pick up any states or transitions added since the last run
+    if (fsm->__image_dirty && !__fsm_compile(fsm)) {
+        FSM_LOG_ERROR("Failed to compile the FSM, skipping this run\n");
+        return;
+    }
+
+#if FSM_THREADS
+    // Events posted from other threads are handled before the tick, at most one queue's worth
+    if (fsm->__queue) {
+        fsm_drain_events(fsm, fsm->__queue->mask + 1);
+    }
+#endif  // FSM_THREADS
+
+    __fsm_instance_run(fsm, &fsm->__instance);
+}
+
+/// @brief Runs up to max_ticks ticks of the FSM's own instance, like as many fsm_run calls
+/// @param stop Checked before every tick, stops running once it returns true, or NULL
+/// @note A state function may change the FSM, so whether it needs recompiling is checked every tick, and
+///       so is the event queue, other threads post to it
+fsm_run_result_t __fsm_run_ticks(fsm_t *fsm, fsm_transition_predicate_fn stop, fsm_size_t max_ticks) {
+    fsm_run_result_t result = {0, 0};
+    fsm_instance_t *instance = &fsm->__instance;
+    for (; result.ticks < max_ticks; result.ticks++) {
+        if (fsm->__image_dirty && !__fsm_compile(fsm)) {
+            FSM_LOG_ERROR("Failed to compile the FSM, stopping after %zu ticks\n", result.ticks);
+            break;
+        }
+
+#if FSM_THREADS
+        if (fsm->__queue) {
+            fsm_drain_events(fsm, fsm->__queue->mask + 1);
+        }
+#endif  // FSM_THREADS
+
+        if (stop && stop(fsm, instance->context)) {
+            break;
+        }
+        // Like fsm_run, the first tick starts a stopped FSM, but one stopped by its state functions stays stopped
+        if (result.ticks > 0 && !(instance->__flags & FSM_INSTANCE_RUNNING)) {
+            break;
+        }
+        result.transitions += __fsm_instance_run(fsm, instance);
+    }
+    return result;
+}
+
+fsm_run_result_t fsm_run_n(fsm_t *fsm, fsm_size_t n) {
+    if (!fsm) return (fsm_run_result_t){0, 0};
+    return __fsm_run_ticks(fsm, NULL, n);
+}
+
+fsm_run_result_t fsm_run_until(fsm_t *fsm, fsm_transition_predicate_fn stop_predicate, fsm_size_t max_ticks) {
+    if (!fsm || !stop_predicate) return (fsm_run_result_t){0, 0};
+    return __fsm_run_ticks(fsm, stop_predicate, max_ticks);
+}
+
+fsm_bool fsm_dispatch(fsm_t *fsm, fsm_event_id event, void *payload) {
+    if (!fsm || event == FSM_NO_EVENT) return false;
+
+    if (fsm->__image_dirty && !__fsm_compile(fsm)) {
+        FSM_LOG_ERROR("Failed to compile the FSM, dropping the event\n");
+        return false;
+    }
+
+    return __fsm_instance_dispatch(fsm, &fsm->__instance, event, payload);
+}
+
+void fsm_reset_stats(fsm_t *fsm) {
+    if (!fsm) return;
+    memset(&fsm->__stats, 0, sizeof(fsm->__stats));
+}
+
+fsm_bool fsm_finalize(fsm_t *fsm) {
+    if (!fsm) return false;
+    if (fsm->__is_finalized) return true;
+
+    if (fsm->__image_dirty && !__fsm_compile(fsm)) {
+        FSM_LOG_ERROR("Failed to compile the FSM, it was not finalized\n");
+        return false;
+    }
+
+    fsm->__is_finalized = true;
+    return true;
+}
+
+fsm_size_t fsm_get_predicate_stats(fsm_t *fsm, fsm_state_id state, fsm_size_t transition,
+                                   fsm_predicate_stats_t *stats, fsm_size_t capacity) {
+    if (!fsm || !(fsm->__options & FSM_OPTION_ADAPTIVE_ORDER)) return 0;
+    if (fsm->__image_dirty && !__fsm_compile(fsm)) return 0;
+    if (state >= fsm->__image.state_count) return 0;
+
+    __fsm_image_state_t *image_state = &fsm->__image.states[state];
+    if (transition >= image_state->transition_end - image_state->transition_begin) {
+        transition -= image_state->transition_end - image_state->transition_begin;
+        state = fsm->__image.state_count;  // one of the any-state transitions
+        image_state = &fsm->__image.states[state];
+        if (transition >= image_state->transition_end - image_state->transition_begin) return 0;
+    }
+
+    fsm_predicate_stats_t *found = &fsm->__adaptive->stats[fsm->__adaptive->offsets[state]];
+    for (uint32_t t = image_state->transition_begin; t < image_state->transition_begin + transition; t++) {
+        found += fsm->__image.transitions[t].predicate_count;
+    }
+    fsm_size_t count = fsm->__image.transitions[image_state->transition_begin + transition].predicate_count;
+    for (fsm_size_t i = 0; stats && i < count && i < capacity; i++) {
+        stats[i] = found[i];
+    }
+    return count;
+}
+
+fsm_bool fsm_set_options(fsm_t *fsm, uint32_t options) {
+    if (!fsm || !__fsm_check_not_finalized(fsm, "fsm_set_options")) return false;
+
+    fsm->__options = options;
+    fsm->__image_dirty = true;
+    return true;
+}
+
+fsm_bool fsm_predicate_reads(fsm_t *fsm, fsm_transition_predicate_fn predicate, fsm_size_t offset, fsm_size_t size) {
+    if (!fsm || !predicate || !__fsm_check_not_finalized(fsm, "fsm_predicate_reads")) return false;
+
+    __fsm_predicate_reads_t *declared = __fsm_find_predicate_reads(fsm, predicate);
+    if (!declared) {
+        if (!__fsm_grow_array(fsm, (void **)&fsm->__predicate_reads, sizeof(__fsm_predicate_reads_t),
+                              fsm->__predicate_reads_count, &fsm->__predicate_reads_capacity,
+                              fsm->__predicate_reads_count + 1)) {
+            return false;
+        }
+        declared = &fsm->__predicate_reads[fsm->__predicate_reads_count++];
+        declared->predicate = predicate;
+        declared->reads = 0;
+    }
+    declared->reads |= __fsm_field_mask(offset, size);
+    fsm->__image_dirty = true;
+    return true;
+}
+
+fsm_bool fsm_set_step_bound(fsm_t *fsm, fsm_size_t step_bound) {
+    if (!fsm || step_bound == 0) return false;
+
+    fsm->__step_bound = step_bound;
+    return true;
+}
+
+void fsm_stop(fsm_t *fsm) {
+    if (!fsm) return;
+    if (!fsm_is_running(fsm)) return;
+
+    fsm->__instance.__flags &= ~FSM_INSTANCE_RUNNING;
+
+    // Optionally, you could invoke the on_exit handler here if desired:
+    /*
+    fsm_state_t *current_state = &fsm->states[fsm->__instance.__state];
+    if (current_state->on_exit) {
+        current_state->on_exit(fsm, fsm->context);
+    }
+    */
+}
+
+void fsm_destroy(fsm_t *fsm) {
+    if (!fsm) return;
+
+    // In arena mode everything, including the FSM itself, lives in the arena blocks
+    if (fsm->__arena) {
+        fsm_dealloc_fn dealloc_fn = fsm->__dealloc_fn;
+        __fsm_arena_block_t *block = fsm->__arena;
+        while (block) {
+            __fsm_arena_block_t *next = block->next;
+            dealloc_fn(block);
+            block = next;
+        }
+        return;
+    }
+
+    // Free states
+    if (fsm->states) {
+        // Free each state's name
+        for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
+            if (fsm->states[i].name) {
+                __fsm_free(fsm, fsm->states[i].name);
+                fsm->states[i].name = NULL;
+            }
+        }
+        __fsm_free(fsm, fsm->states);
+        fsm->states = NULL;
+    }
+
+    // Free transitions
+    if (fsm->transitions) {
+        for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
+            __fsm_transition_t *t = &fsm->transitions[i];
+            // Free the predicates array if it exists
+            if (t->predicates.predicates) {
+                __fsm_free(fsm, t->predicates.predicates);
+                t->predicates.predicates = NULL;
+            }
+        }
+        __fsm_free(fsm, fsm->transitions);
+        fsm->transitions = NULL;
+    }
+
+    if (fsm->__image.__block) {
+        __fsm_free_reusable(fsm, fsm->__image.__block);
+        fsm->__image.__block = NULL;
+    }
+    if (fsm->__adaptive) {
+        __fsm_free_reusable(fsm, fsm->__adaptive);
+        fsm->__adaptive = NULL;
+    }
+    if (fsm->__tracking) {
+        __fsm_free_reusable(fsm, fsm->__tracking);
+        fsm->__tracking = NULL;
+    }
+
+    if (fsm->__name_table) {
+        __fsm_free(fsm, fsm->__name_table);
+        fsm->__name_table = NULL;
+    }
+
+    if (fsm->__guards) {
+        __fsm_free(fsm, fsm->__guards);
+        fsm->__guards = NULL;
+    }
+    if (fsm->__guard_table) {
+        __fsm_free(fsm, fsm->__guard_table);
+        fsm->__guard_table = NULL;
+    }
+    if (fsm->__predicate_reads) {
+        __fsm_free(fsm, fsm->__predicate_reads);
+        fsm->__predicate_reads = NULL;
+    }
+
+#if FSM_THREADS
+    if (fsm->__queue) {
+        __fsm_free(fsm, fsm->__queue->cells);
+        __fsm_free(fsm, fsm->__queue);
+        fsm->__queue = NULL;
+    }
+#endif  // FSM_THREADS
+
+    // Free context
+    if (fsm->context) {
+        __fsm_free(fsm, fsm->context);
+        fsm->context = NULL;
+    }
+
+    // Finally, free the FSM structure itself
+    fsm->__dealloc_fn(fsm);
+}
+
+void fsm_set_state(fsm_t *fsm, char *state_name) {
+    if (!fsm || !state_name || fsm->__state_count == 0) {
+        return;
+    }
+
+    // An unknown name maps to FSM_INVALID_STATE, which fsm_set_state_id ignores
+    fsm_set_state_id(fsm, __fsm_state_index(fsm, state_name));
+}
+
+void fsm_set_state_id(fsm_t *fsm, fsm_state_id idx) {
+    if (!fsm || idx >= fsm->__state_count) {
+        // State not found
+        return;
+    }
+
+    // The state functions come from the image, so make sure it knows about the state
+    if (fsm_is_running(fsm) && fsm->__image_dirty && !__fsm_compile(fsm)) {
+        FSM_LOG_ERROR("Failed to compile the FSM, the state was not changed\n");
+        return;
+    }
+
+    __fsm_instance_set_state(fsm, &fsm->__instance, idx);
+}
+
+fsm_state_id fsm_add_state(fsm_t *fsm, fsm_state_t state) {
+    if (!fsm) return FSM_INVALID_STATE;
+    if (!__fsm_check_not_finalized(fsm, "fsm_add_state")) return FSM_INVALID_STATE;
+
+    // Make sure there's space for one more state, and one more name
+    fsm_size_t new_count = fsm->__state_count + 1;
+    if (!fsm_reserve_states(fsm, new_count)) {
+        return FSM_INVALID_STATE;  // Allocation failed
+    }
+
+    // Initialize the new state at the end
+    fsm_size_t idx = fsm->__state_count;
+    fsm->states[idx].name = __fsm_strdup(fsm, state.name);
+    fsm->states[idx].on_enter = state.on_enter;
+    fsm->states[idx].on_update = state.on_update;
+    fsm->states[idx].on_exit = state.on_exit;
+    fsm->states[idx].on_step = state.on_step;
+
+    // Index the interned name, if a state with this name already exists the first one keeps it
+    if (fsm->states[idx].name) {
+        __fsm_name_table_insert(fsm->__name_table, fsm->__name_table_capacity, fsm->states,
+                                __fsm_hash_name(fsm->states[idx].name), idx);
+    }
+
+    fsm->__state_count = new_count;
+    fsm->__image_dirty = true;
+    return idx;
+}
+
+fsm_bool fsm_reserve_states(fsm_t *fsm, fsm_size_t state_count) {
+    if (!fsm) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_reserve_states")) return false;
+
+    // Reserve the name table first, growing it doesn't depend on the states array moving
+    if (!__fsm_name_table_reserve(fsm, state_count)) {
+        return false;
+    }
+
+    return __fsm_grow_array(fsm, (void **)&fsm->states, sizeof(fsm_state_t), fsm->__state_count,
+                            &fsm->__state_capacity, state_count);
+}
+
+fsm_bool fsm_reserve_transitions(fsm_t *fsm, fsm_size_t transition_count) {
+    if (!fsm) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_reserve_transitions")) return false;
+
+    return __fsm_grow_array(fsm, (void **)&fsm->transitions, sizeof(__fsm_transition_t),
+                            fsm->__transition_count, &fsm->__transition_capacity, transition_count);
+}
+
+/// @brief Appends a transition to the FSM, the caller checks that the FSM isn't finalized
+fsm_bool __fsm_add_transition(fsm_t *fsm, fsm_state_id from_idx, fsm_state_id to_idx, fsm_event_id event,
+                              fsm_guard_id guard, fsm_predicate_group_t predicates,
+                              fsm_transition_selector_fn selector) {
+    if (from_idx == FSM_ANY_STATE ? event != FSM_NO_EVENT : from_idx >= fsm->__state_count) {
+        return false;  // Invalid origin, event transitions need a specific one
+    }
+    if (!selector && to_idx >= fsm->__state_count) {
+        return false;  // Invalid target
+    }
+    if (guard != FSM_NO_GUARD && guard >= fsm->__guard_count) {
+        return false;  // Not one of this FSM's guards
+    }
+
+    // Make sure there's space for one more transition
+    fsm_size_t new_count = fsm->__transition_count + 1;
+    if (!fsm_reserve_transitions(fsm, new_count)) {
+        return false;  // Allocation failed
+    }
+
+    // Set up the new transition
+    __fsm_transition_t *t = &fsm->transitions[fsm->__transition_count];
+    t->from = from_idx;
+    t->to = to_idx;
+    t->event = event;
+    t->guard = guard;
+    t->selector = selector;
+
+    // Copy the array of predicate functions, the group itself is stored in the transition
+    t->predicates.predicate_count = predicates.predicate_count;
+    t->predicates.predicates = NULL;
+    if (predicates.predicate_count > 0) {
+        size_t pred_array_size = sizeof(fsm_transition_predicate_fn) * predicates.predicate_count;
+        t->predicates.predicates = (fsm_transition_predicate_fn *)__fsm_alloc(fsm, pred_array_size);
+        if (!t->predicates.predicates) {
+            // The transition isn't counted yet, so there's nothing to roll back
+            return false;
+        }
+
+        memcpy(t->predicates.predicates, predicates.predicates, pred_array_size);
+    }
+
+    fsm->__transition_count = new_count;
+    fsm->__image_dirty = true;
+    return true;
+}
+
+fsm_bool fsm_add_transition(fsm_t *fsm, char *from, char *to, fsm_predicate_group_t predicates) {
+    if (!fsm || !from || !to) {
+        return false;
+    }
+
+    // Unknown names map to FSM_INVALID_STATE, which fsm_add_transition_id rejects
+    return fsm_add_transition_id(fsm, __fsm_state_index(fsm, from), __fsm_state_index(fsm, to), predicates);
+}
+
+fsm_bool fsm_add_transition_id(fsm_t *fsm, fsm_state_id from_idx, fsm_state_id to_idx,
+                               fsm_predicate_group_t predicates) {
+    if (!fsm) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_add_transition")) return false;
+    return __fsm_add_transition(fsm, from_idx, to_idx, FSM_NO_EVENT, FSM_NO_GUARD, predicates, NULL);
+}
+
+fsm_bool fsm_add_event_transition(fsm_t *fsm, char *from, fsm_event_id event, char *to,
+                                  fsm_predicate_group_t predicates) {
+    if (!fsm || !from || !to) {
+        return false;
+    }
+
+    // Unknown names map to FSM_INVALID_STATE, which fsm_add_event_transition_id rejects
+    return fsm_add_event_transition_id(fsm, __fsm_state_index(fsm, from), event, __fsm_state_index(fsm, to),
+                                       predicates);
+}
+
+fsm_bool fsm_add_event_transition_id(fsm_t *fsm, fsm_state_id from_idx, fsm_event_id event, fsm_state_id to_idx,
+                                     fsm_predicate_group_t predicates) {
+    if (!fsm || event == FSM_NO_EVENT) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_add_event_transition")) return false;
+    return __fsm_add_transition(fsm, from_idx, to_idx, event, FSM_NO_GUARD, predicates, NULL);
+}
+
+fsm_bool fsm_add_guard_transition(fsm_t *fsm, char *from, char *to, fsm_guard_id guard) {
+    if (!fsm || !from || !to) {
+        return false;
+    }
+
+    // Unknown names map to FSM_INVALID_STATE, which fsm_add_guard_transition_id rejects
+    return fsm_add_guard_transition_id(fsm, __fsm_state_index(fsm, from), __fsm_state_index(fsm, to), guard);
+}
+
+fsm_bool fsm_add_guard_transition_id(fsm_t *fsm, fsm_state_id from_idx, fsm_state_id to_idx, fsm_guard_id guard) {
+    if (!fsm || guard == FSM_NO_GUARD) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_add_guard_transition")) return false;
+    return __fsm_add_transition(fsm, from_idx, to_idx, FSM_NO_EVENT, guard, FSM_PREDICATE_GROUP_EMPTY, NULL);
+}
+
+fsm_bool fsm_add_selector_transition(fsm_t *fsm, char *from, fsm_predicate_group_t predicates,
+                                     fsm_transition_selector_fn selector) {
+    if (!fsm || !from) {
+        return false;
+    }
+
+    // Unknown names map to FSM_INVALID_STATE, which fsm_add_selector_transition_id rejects
+    return fsm_add_selector_transition_id(fsm, __fsm_state_index(fsm, from), predicates, selector);
+}
+
+fsm_bool fsm_add_selector_transition_id(fsm_t *fsm, fsm_state_id from_idx, fsm_predicate_group_t predicates,
+                                        fsm_transition_selector_fn selector) {
+    if (!fsm || !selector) return false;
+    if (!__fsm_check_not_finalized(fsm, "fsm_add_selector_transition")) return false;
+    return __fsm_add_transition(fsm, from_idx, FSM_INVALID_STATE, FSM_NO_EVENT, FSM_NO_GUARD, predicates, selector);
+}
+
+fsm_bool fsm_add_transition_from_all(fsm_t *fsm, char *to, fsm_predicate_group_t predicates) {
+    if (!fsm || !to || fsm->__state_count == 0) {
+        return false;
+    }
+
+    fsm_state_id to_idx = __fsm_state_index(fsm, to);
+    if (to_idx == FSM_INVALID_STATE) {
+        return false;  // Invalid target
+    }
+
+    // Stored once, the image keeps a single any-state range that every state checks after its own
+    return fsm_add_transition_id(fsm, FSM_ANY_STATE, to_idx, predicates);
+}
+
+fsm_bool fsm_add_transition_to_all(fsm_t *fsm, char *from, fsm_predicate_group_t predicates) {
+    if (!fsm || !from || fsm->__state_count == 0) {
+        return false;
+    }
+
+    fsm_state_id from_idx = __fsm_state_index(fsm, from);
+    if (from_idx == FSM_INVALID_STATE) {
+        return false;  // Invalid origin
+    }
+
+    // For each state in the FSM, add a transition from the "from" state
+    fsm_bool all_added = true;
+    for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
+        // Avoid creating self-transitions if undesired:
+        /*
+        if (i == from_idx) {
+            continue;
+        }
+        */
+        all_added &= fsm_add_transition_id(fsm, from_idx, i, predicates);
+    }
+    return all_added;
+}
+
+fsm_definition_t *fsm_definition_create(fsm_t *fsm) {
+    if (!fsm) {
+        return NULL;
+    }
+
+    // Instances may run on several threads, which can't share the adaptive statistics, and the cached
+    // transition results are about a single machine
+    uint32_t single_machine_options =
+        FSM_OPTION_ADAPTIVE_ORDER | FSM_OPTION_DEPENDENCY_TRACKING | FSM_OPTION_SKIP_UNCHANGED;
+    if (fsm->__options & single_machine_options) {
+        FSM_LOG_ERROR("fsm_definition_create: options 0x%x only work on a single FSM, clear them first\n",
+                      (unsigned)(fsm->__options & single_machine_options));
+        return NULL;
+    }
+
+    // Allocated outside of any arena, so it can be freed on its own
+    fsm_definition_t *definition = (fsm_definition_t *)fsm->__alloc_fn(sizeof(fsm_definition_t));
+    if (!definition) {
+        return NULL;
+    }
+    if (!fsm_finalize(fsm)) {
+        fsm->__dealloc_fn(definition);
+        return NULL;
     }
+    definition->__fsm = fsm;
+    definition->__ref_count = 1;
+    return definition;
 }
 
-void fsm_stop(fsm_t *fsm) {
-    if (!fsm) return;
-    if (!fsm->__is_running) return;
+fsm_definition_t *fsm_definition_retain(fsm_definition_t *definition) {
+    if (definition) {
+        definition->__ref_count++;
+    }
+    return definition;
+}
+
+void fsm_definition_release(fsm_definition_t *definition) {
+    if (!definition || --definition->__ref_count > 0) {
+        return;
+    }
 
-    fsm->__is_running = false;
+    fsm_t *fsm = definition->__fsm;
+    fsm_dealloc_fn dealloc_fn = fsm->__dealloc_fn;
+    fsm_destroy(fsm);
+    dealloc_fn(definition);
+}
 
-    // Optionally, you could invoke the on_exit handler here if desired:
-    /*
-    fsm_state_t *current_state = &fsm->states[fsm->__current_state_idx];
-    if (current_state->on_exit) {
-        current_state->on_exit(fsm, fsm->context);
+fsm_state_id fsm_definition_find_state(fsm_definition_t *definition, const char *state_name) {
+    if (!definition) return FSM_INVALID_STATE;
+    return fsm_find_state(definition->__fsm, state_name);
+}
+
+const char *fsm_definition_state_name(fsm_definition_t *definition, fsm_state_id state) {
+    if (!definition || state >= definition->__fsm->__image.state_count) {
+        return NULL;
     }
-    */
+    __fsm_image_t *image = &definition->__fsm->__image;
+    return image->names + image->name_offsets[state];
 }
 
-void fsm_destroy(fsm_t *fsm) {
-    if (!fsm) return;
+fsm_stats_t fsm_definition_get_stats(fsm_definition_t *definition) {
+    if (!definition) {
+        fsm_stats_t empty = {0};
+        return empty;
+    }
+    return definition->__fsm->__stats;
+}
 
-    // Free states
-    if (fsm->states) {
-        // Free each state's name
-        for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
-            if (fsm->states[i].name) {
-                fsm->__dealloc_fn(fsm->states[i].name);
-                fsm->states[i].name = NULL;
+void fsm_instance_init(fsm_definition_t *definition, fsm_instance_t *instance, void *context) {
+    if (!definition || !instance) return;
+
+    instance->__state = definition->__fsm->__instance.__state;
+    instance->__flags = 0;
+    instance->context = context;
+}
+
+void fsm_instance_run(fsm_definition_t *definition, fsm_instance_t *instance) {
+    if (!definition || !instance) return;
+    __fsm_instance_run(definition->__fsm, instance);
+}
+
+void fsm_run_batch(fsm_definition_t *definition, fsm_instance_t *instances, fsm_size_t count) {
+    if (!definition || !instances) return;
+
+    fsm_t *fsm = definition->__fsm;
+    fsm_size_t prefetched = count > FSM_BATCH_PREFETCH_DISTANCE ? count - FSM_BATCH_PREFETCH_DISTANCE : 0;
+
+    // The instance array is walked linearly, so only the contexts it points at need prefetching
+    fsm_size_t i = 0;
+    for (; i < prefetched; i++) {
+        FSM_PREFETCH(instances[i + FSM_BATCH_PREFETCH_DISTANCE].context);
+        __fsm_instance_run(fsm, &instances[i]);
+    }
+    for (; i < count; i++) {
+        __fsm_instance_run(fsm, &instances[i]);
+    }
+}
+
+void fsm_instance_set_state(fsm_definition_t *definition, fsm_instance_t *instance, fsm_state_id state) {
+    if (!definition || !instance || state >= definition->__fsm->__image.state_count) {
+        return;
+    }
+    __fsm_instance_set_state(definition->__fsm, instance, state);
+}
+
+void fsm_instance_stop(fsm_definition_t *definition, fsm_instance_t *instance) {
+    if (!definition || !instance) return;
+    instance->__flags &= ~FSM_INSTANCE_RUNNING;
+}
+
+fsm_bool fsm_instance_dispatch(fsm_definition_t *definition, fsm_instance_t *instance, fsm_event_id event,
+                               void *payload) {
+    if (!definition || !instance || event == FSM_NO_EVENT) return false;
+    return __fsm_instance_dispatch(definition->__fsm, instance, event, payload);
+}
+
+/// @brief Marks a pool bucket slot, or a pool location, as not moving / not in use
+#define __FSM_POOL_NONE UINT32_MAX
+
+/// @brief Grows an array owned by a pool, the same way __fsm_grow_array does for an FSM
+/// @note Pools add and remove instances for their whole lifetime, so they never use the definition's arena
+fsm_bool __fsm_pool_grow_array(fsm_pool_t *pool, void **array, fsm_size_t element_size, fsm_size_t count,
+                               fsm_size_t new_capacity) {
+    fsm_t *fsm = pool->__definition->__fsm;
+    void *new_array = fsm->__alloc_fn(element_size * new_capacity);
+    if (!new_array) {
+        return false;
+    }
+    if (*array) {
+        memcpy(new_array, *array, element_size * count);
+        fsm->__dealloc_fn(*array);
+    }
+    *array = new_array;
+    return true;
+}
+
+/// @brief Appends an instance to a bucket, returning its slot or __FSM_POOL_NONE if an allocation failed
+fsm_size_t __fsm_pool_bucket_push(fsm_pool_t *pool, __fsm_pool_bucket_t *bucket, void *context,
+                                  fsm_pool_handle handle) {
+    if (bucket->count == bucket->capacity) {
+        fsm_size_t capacity = bucket->capacity ? bucket->capacity * 2 : 16;
+        if (!__fsm_pool_grow_array(pool, (void **)&bucket->contexts, sizeof(void *), bucket->count, capacity) ||
+            !__fsm_pool_grow_array(pool, (void **)&bucket->handles, sizeof(fsm_pool_handle), bucket->count,
+                                   capacity) ||
+            !__fsm_pool_grow_array(pool, (void **)&bucket->pending, sizeof(uint32_t), bucket->count, capacity)) {
+            return __FSM_POOL_NONE;
+        }
+        bucket->capacity = capacity;
+    }
+
+    fsm_size_t slot = bucket->count++;
+    bucket->contexts[slot] = context;
+    bucket->handles[slot] = handle;
+    bucket->pending[slot] = __FSM_POOL_NONE;
+    return slot;
+}
+
+/// @brief Removes a slot from a bucket by moving the last instance into it
+void __fsm_pool_bucket_swap_remove(fsm_pool_t *pool, __fsm_pool_bucket_t *bucket, fsm_size_t slot) {
+    fsm_size_t last = --bucket->count;
+    if (slot != last) {
+        bucket->contexts[slot] = bucket->contexts[last];
+        bucket->handles[slot] = bucket->handles[last];
+        bucket->pending[slot] = bucket->pending[last];
+        pool->__locations[bucket->handles[slot]].slot = slot;
+    }
+}
+
+/// @brief Moves the instances that transitioned during a tick to their new buckets
+/// @note Buckets are walked in state order and slots from last to first, so the resulting layout
+///       only depends on which instances transitioned, not on the order they were ticked in
+void __fsm_pool_apply_moves(fsm_pool_t *pool) {
+    fsm_size_t state_count = pool->__definition->__fsm->__image.state_count;
+    for (fsm_size_t s = 0; s < state_count; s++) {
+        __fsm_pool_bucket_t *bucket = &pool->__buckets[s];
+        for (fsm_size_t slot = bucket->count; slot-- > 0;) {
+            uint32_t next = bucket->pending[slot];
+            if (next == __FSM_POOL_NONE) {
+                continue;
+            }
+
+            fsm_pool_handle handle = bucket->handles[slot];
+            fsm_size_t new_slot = __fsm_pool_bucket_push(pool, &pool->__buckets[next], bucket->contexts[slot], handle);
+            if (new_slot == __FSM_POOL_NONE) {
+                // Out of memory: the instance already is in its new state, but stays filed under the old one
+                FSM_LOG_ERROR("Failed to move a pool instance to its new state\n");
+                bucket->pending[slot] = __FSM_POOL_NONE;
+                continue;
             }
+            pool->__locations[handle].state = next;
+            pool->__locations[handle].slot = new_slot;
+            __fsm_pool_bucket_swap_remove(pool, bucket, slot);
         }
-        fsm->__dealloc_fn(fsm->states);
-        fsm->states = NULL;
     }
+}
 
-    // Free transitions
-    if (fsm->transitions) {
-        for (fsm_size_t i = 0; i < fsm->__transition_count; i++) {
-            __fsm_transition_t *t = &fsm->transitions[i];
-            // Free the predicates array if it exists
-            if (t->predicates) {
-                if (t->predicates->predicates) {
-                    fsm->__dealloc_fn(t->predicates->predicates);
-                }
-                fsm->__dealloc_fn(t->predicates);
-                t->predicates = NULL;
+/// @brief Ticks the instances in slots [begin, end) of one state's bucket, recording their transitions
+/// @note This doesn't move any instance, see __fsm_pool_apply_moves
+void __fsm_pool_tick_range(fsm_pool_t *pool, fsm_state_id state, fsm_size_t begin, fsm_size_t end) {
+    fsm_t *fsm = pool->__definition->__fsm;
+    __fsm_image_state_t *states = fsm->__image.states;
+    __fsm_image_state_t *current_state = &states[state];
+    __fsm_image_state_t *any = &states[fsm->__image.state_count];
+    __fsm_pool_bucket_t *bucket = &pool->__buckets[state];
+
+    // States without transitions (or step function) just update, which is a tight loop over the contexts
+    if (current_state->transition_begin == current_state->transition_end &&
+        any->transition_begin == any->transition_end && !current_state->on_step) {
+        if (current_state->on_update) {
+            for (fsm_size_t i = begin; i < end; i++) {
+                current_state->on_update(fsm, bucket->contexts[i]);
             }
         }
-        fsm->__dealloc_fn(fsm->transitions);
-        fsm->transitions = NULL;
+        return;
     }
 
-    // Free context
-    if (fsm->context) {
-        fsm->__dealloc_fn(fsm->context);
-        fsm->context = NULL;
+    for (fsm_size_t i = begin; i < end; i++) {
+        void *context = bucket->contexts[i];
+        fsm_state_id next = __fsm_select_transition(fsm, state, context);
+        if (next == FSM_INVALID_STATE) {
+            fsm_state_id stepped = __fsm_state_update(fsm, state, context);
+            if (stepped != FSM_INVALID_STATE) {
+                bucket->pending[i] = (uint32_t)stepped;
+            }
+            continue;
+        }
+
+        // Same order as fsm_instance_run: exit, enter, then update the new state
+        if (current_state->on_exit) {
+            current_state->on_exit(fsm, context);
+        }
+        if (states[next].on_enter) {
+            states[next].on_enter(fsm, context);
+        }
+        fsm_state_id stepped = __fsm_state_update(fsm, next, context);
+        bucket->pending[i] = (uint32_t)(stepped != FSM_INVALID_STATE ? stepped : next);
     }
+}
 
-    // Finally, free the FSM structure itself
-    fsm->__dealloc_fn(fsm);
+fsm_pool_t *fsm_pool_create(fsm_definition_t *definition) {
+    if (!definition) return NULL;
+
+    fsm_t *fsm = definition->__fsm;
+    fsm_size_t state_count = fsm->__image.state_count;
+
+    fsm_pool_t *pool = (fsm_pool_t *)fsm->__alloc_fn(sizeof(fsm_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    // One bucket per state, plus one so the allocation is never empty
+    pool->__buckets = (__fsm_pool_bucket_t *)fsm->__alloc_fn(sizeof(__fsm_pool_bucket_t) * (state_count + 1));
+    if (!pool->__buckets) {
+        fsm->__dealloc_fn(pool);
+        return NULL;
+    }
+    memset(pool->__buckets, 0, sizeof(__fsm_pool_bucket_t) * (state_count + 1));
+
+    pool->__definition = fsm_definition_retain(definition);
+    pool->__locations = NULL;
+    pool->__location_count = 0;
+    pool->__location_capacity = 0;
+    pool->__free_handle = FSM_INVALID_HANDLE;
+    pool->__instance_count = 0;
+    return pool;
 }
 
-void fsm_set_state(fsm_t *fsm, char *state_name) {
-    if (!fsm || !state_name || fsm->__state_count == 0) {
-        return;
+void fsm_pool_destroy(fsm_pool_t *pool) {
+    if (!pool) return;
+
+    fsm_t *fsm = pool->__definition->__fsm;
+    for (fsm_size_t s = 0; s < fsm->__image.state_count; s++) {
+        __fsm_pool_bucket_t *bucket = &pool->__buckets[s];
+        if (bucket->capacity > 0) {
+            fsm->__dealloc_fn(bucket->contexts);
+            fsm->__dealloc_fn(bucket->handles);
+            fsm->__dealloc_fn(bucket->pending);
+        }
+    }
+    fsm->__dealloc_fn(pool->__buckets);
+    if (pool->__locations) {
+        fsm->__dealloc_fn(pool->__locations);
     }
 
-    fsm_size_t idx = __fsm_state_index(fsm, state_name);
-    if (idx == (fsm_size_t)-1) {
-        // State not found
-        return;
+    fsm_definition_t *definition = pool->__definition;
+    fsm_dealloc_fn dealloc_fn = fsm->__dealloc_fn;
+    dealloc_fn(pool);
+    fsm_definition_release(definition);
+}
+
+fsm_pool_handle fsm_pool_add(fsm_pool_t *pool, void *context) {
+    if (!pool) return FSM_INVALID_HANDLE;
+
+    fsm_t *fsm = pool->__definition->__fsm;
+    if (fsm->__image.state_count == 0) {
+        return FSM_INVALID_HANDLE;
     }
 
-    // If the FSM is running and we have a different current state, handle on_exit/ on_enter
-    if (fsm->__is_running && idx != fsm->__current_state_idx) {
-        fsm_state_t *old_state = &fsm->states[fsm->__current_state_idx];
-        fsm_state_t *new_state = &fsm->states[idx];
+    // Reuse a free handle if there is one, otherwise make a new one
+    if (pool->__free_handle == FSM_INVALID_HANDLE && pool->__location_count == pool->__location_capacity) {
+        fsm_size_t capacity = pool->__location_capacity ? pool->__location_capacity * 2 : 16;
+        if (!__fsm_pool_grow_array(pool, (void **)&pool->__locations, sizeof(__fsm_pool_location_t),
+                                   pool->__location_count, capacity)) {
+            return FSM_INVALID_HANDLE;
+        }
+        pool->__location_capacity = capacity;
+    }
+    fsm_pool_handle handle = pool->__free_handle != FSM_INVALID_HANDLE ? pool->__free_handle : pool->__location_count;
 
-        if (old_state->on_exit) {
-            old_state->on_exit(fsm, fsm->context);
+    uint32_t state = fsm->__instance.__state;
+    fsm_size_t slot = __fsm_pool_bucket_push(pool, &pool->__buckets[state], context, handle);
+    if (slot == __FSM_POOL_NONE) {
+        return FSM_INVALID_HANDLE;
+    }
+
+    // Only take the handle once the instance is in its bucket
+    if (handle == pool->__free_handle) {
+        pool->__free_handle = pool->__locations[handle].slot;
+    } else {
+        pool->__location_count++;
+    }
+    pool->__locations[handle].state = state;
+    pool->__locations[handle].slot = slot;
+    pool->__instance_count++;
+
+    if (fsm->__image.states[state].on_enter) {
+        fsm->__image.states[state].on_enter(fsm, context);
+    }
+    return handle;
+}
+
+fsm_bool fsm_pool_remove(fsm_pool_t *pool, fsm_pool_handle handle) {
+    if (!pool || handle >= pool->__location_count || pool->__locations[handle].state == __FSM_POOL_NONE) {
+        return false;
+    }
+
+    __fsm_pool_location_t *location = &pool->__locations[handle];
+    __fsm_pool_bucket_swap_remove(pool, &pool->__buckets[location->state], location->slot);
+
+    location->state = __FSM_POOL_NONE;
+    location->slot = pool->__free_handle;
+    pool->__free_handle = handle;
+    pool->__instance_count--;
+    return true;
+}
+
+void fsm_pool_tick(fsm_pool_t *pool) {
+    if (!pool) return;
+
+    fsm_size_t state_count = pool->__definition->__fsm->__image.state_count;
+    for (fsm_size_t s = 0; s < state_count; s++) {
+        __fsm_pool_tick_range(pool, s, 0, pool->__buckets[s].count);
+    }
+    __fsm_pool_apply_moves(pool);
+}
+
+fsm_size_t fsm_pool_count_in_state(fsm_pool_t *pool, fsm_state_id state) {
+    if (!pool || state >= pool->__definition->__fsm->__image.state_count) {
+        return 0;
+    }
+    return pool->__buckets[state].count;
+}
+
+fsm_state_id fsm_pool_state(fsm_pool_t *pool, fsm_pool_handle handle) {
+    if (!pool || handle >= pool->__location_count || pool->__locations[handle].state == __FSM_POOL_NONE) {
+        return FSM_INVALID_STATE;
+    }
+    return pool->__locations[handle].state;
+}
+
+void *fsm_pool_context(fsm_pool_t *pool, fsm_pool_handle handle) {
+    fsm_state_id state = fsm_pool_state(pool, handle);
+    if (state == FSM_INVALID_STATE) {
+        return NULL;
+    }
+    return pool->__buckets[state].contexts[pool->__locations[handle].slot];
+}
+
+#if FSM_THREADS
+
+#include <sched.h>   // for sched_yield
+#include <unistd.h>  // for sysconf
+
+#define __FSM_RUNNER_RANGE(next, end) (((uint64_t)(end) << 32) | (uint64_t)(next))
+
+/// @brief Takes the next chunk from the front of a thread's own share
+/// @return The chunk index, or -1 if the share is empty
+fsm_size_t __fsm_runner_pop(__fsm_runner_thread_t *thread) {
+    uint64_t range = atomic_load_explicit(&thread->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t next = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (next >= end) {
+            return (fsm_size_t)-1;
         }
-        fsm->__current_state_idx = idx;
-        if (new_state->on_enter) {
-            new_state->on_enter(fsm, fsm->context);
+        if (atomic_compare_exchange_weak(&thread->range, &range, __FSM_RUNNER_RANGE(next + 1, end))) {
+            return next;
         }
-    } else {
-        // Not running, or same index, just set it
-        fsm->__current_state_idx = idx;
     }
 }
 
-void fsm_add_state(fsm_t *fsm, fsm_state_t state) {
-    if (!fsm) return;
+/// @brief Steals a chunk from the back of another thread's share
+/// @return The chunk index, or -1 if the share is empty
+fsm_size_t __fsm_runner_steal(__fsm_runner_thread_t *victim) {
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t next = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (next >= end) {
+            return (fsm_size_t)-1;
+        }
+        if (atomic_compare_exchange_weak(&victim->range, &range, __FSM_RUNNER_RANGE(next, end - 1))) {
+            return end - 1;
+        }
+    }
+}
 
-    // Allocate space for one more state
-    fsm_size_t new_count = fsm->__state_count + 1;
-    fsm_state_t *new_states = (fsm_state_t *)fsm->__alloc_fn(sizeof(fsm_state_t) * new_count);
-    if (!new_states) {
-        return;  // Allocation failed
+/// @brief Runs chunks until neither this thread nor any other has any left
+void __fsm_runner_work(__fsm_runner_thread_t *thread) {
+    fsm_runner_t *runner = thread->runner;
+    fsm_pool_t *pool = runner->__pool;
+#if FSM_STATS
+    __fsm_thread_stats = &thread->fsm_stats;
+#endif  // FSM_STATS
+
+    for (;;) {
+        fsm_size_t chunk = __fsm_runner_pop(thread);
+
+        // Out of work: look for a victim, starting with the next thread over
+        for (fsm_size_t i = 1; chunk == (fsm_size_t)-1 && i < runner->__thread_count; i++) {
+            chunk = __fsm_runner_steal(&runner->__threads[(thread->index + i) % runner->__thread_count]);
+            if (chunk != (fsm_size_t)-1) {
+                thread->stats.chunks_stolen++;
+            }
+        }
+        if (chunk == (fsm_size_t)-1) {
+#if FSM_STATS
+            __fsm_thread_stats = NULL;
+#endif  // FSM_STATS
+            return;
+        }
+
+        __fsm_runner_chunk_t *c = &runner->__chunks[chunk];
+        __fsm_pool_tick_range(pool, c->state, c->begin, c->end);
+        thread->stats.instances_ticked += c->end - c->begin;
+        thread->stats.chunks_run++;
     }
+}
 
-    // Copy the old states
-    if (fsm->states) {
-        memcpy(new_states, fsm->states, sizeof(fsm_state_t) * fsm->__state_count);
-        fsm->__dealloc_fn(fsm->states);
-        fsm->states = NULL;
+/// @brief Entry point of the runner's worker threads (every thread but thread 0)
+void *__fsm_runner_thread_main(void *arg) {
+    __fsm_runner_thread_t *thread = (__fsm_runner_thread_t *)arg;
+    fsm_runner_t *runner = thread->runner;
+    fsm_size_t seen_generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&runner->__lock);
+        while (runner->__generation == seen_generation && !runner->__stopping) {
+            pthread_cond_wait(&runner->__start, &runner->__lock);
+        }
+        if (runner->__stopping) {
+            pthread_mutex_unlock(&runner->__lock);
+            return NULL;
+        }
+        seen_generation = runner->__generation;
+        pthread_mutex_unlock(&runner->__lock);
+
+        __fsm_runner_work(thread);
+
+        pthread_mutex_lock(&runner->__lock);
+        if (++runner->__threads_done == runner->__thread_count - 1) {
+            pthread_cond_signal(&runner->__done);
+        }
+        pthread_mutex_unlock(&runner->__lock);
+    }
+}
+
+fsm_runner_t *fsm_runner_create(fsm_alloc_fn alloc_fn, fsm_dealloc_fn dealloc_fn, fsm_size_t thread_count,
+                                fsm_size_t chunk_size) {
+    if (!alloc_fn || !dealloc_fn) {
+        return NULL;
+    }
+    if (thread_count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = online > 0 ? (fsm_size_t)online : 1;
     }
 
-    fsm->states = new_states;
+    fsm_runner_t *runner = (fsm_runner_t *)alloc_fn(sizeof(fsm_runner_t));
+    if (!runner) {
+        return NULL;
+    }
+    runner->__threads = (__fsm_runner_thread_t *)alloc_fn(sizeof(__fsm_runner_thread_t) * thread_count);
+    if (!runner->__threads) {
+        dealloc_fn(runner);
+        return NULL;
+    }
 
-    // Initialize the new state at the end
-    fsm_size_t idx = fsm->__state_count;
-    fsm->states[idx].name = __fsm_strdup(fsm, state.name);
-    fsm->states[idx].on_enter = state.on_enter;
-    fsm->states[idx].on_update = state.on_update;
-    fsm->states[idx].on_exit = state.on_exit;
+    runner->__thread_count = thread_count;
+    runner->__chunk_size = chunk_size ? chunk_size : 1024;
+    runner->__pool = NULL;
+    runner->__chunks = NULL;
+    runner->__chunk_count = 0;
+    runner->__chunk_capacity = 0;
+    runner->__generation = 0;
+    runner->__threads_done = 0;
+    runner->__stopping = false;
+    runner->__alloc_fn = alloc_fn;
+    runner->__dealloc_fn = dealloc_fn;
+    pthread_mutex_init(&runner->__lock, NULL);
+    pthread_cond_init(&runner->__start, NULL);
+    pthread_cond_init(&runner->__done, NULL);
 
-    fsm->__state_count = new_count;
+    for (fsm_size_t i = 0; i < thread_count; i++) {
+        __fsm_runner_thread_t *thread = &runner->__threads[i];
+        atomic_init(&thread->range, 0);
+        memset(&thread->stats, 0, sizeof(thread->stats));
+        memset(&thread->fsm_stats, 0, sizeof(thread->fsm_stats));
+        thread->runner = runner;
+        thread->index = i;
+    }
+
+    // Thread 0 is whoever calls fsm_runner_tick, start the others
+    for (fsm_size_t i = 1; i < thread_count; i++) {
+        if (pthread_create(&runner->__threads[i].thread, NULL, __fsm_runner_thread_main, &runner->__threads[i]) != 0) {
+            FSM_LOG_ERROR("Failed to start runner thread %zu, running with %zu threads\n", i, i);
+            runner->__thread_count = i;
+            break;
+        }
+    }
+
+    return runner;
 }
 
-void fsm_add_transition(fsm_t *fsm, char *from, char *to, fsm_predicate_group_t predicates) {
-    if (!fsm || !from || !to) {
-        return;
+void fsm_runner_destroy(fsm_runner_t *runner) {
+    if (!runner) return;
+
+    pthread_mutex_lock(&runner->__lock);
+    runner->__stopping = true;
+    pthread_cond_broadcast(&runner->__start);
+    pthread_mutex_unlock(&runner->__lock);
+
+    for (fsm_size_t i = 1; i < runner->__thread_count; i++) {
+        pthread_join(runner->__threads[i].thread, NULL);
     }
 
-    // Find the 'from' state index
-    fsm_size_t from_idx = __fsm_state_index(fsm, from);
-    fsm_size_t to_idx = __fsm_state_index(fsm, to);
-    if (from_idx == (fsm_size_t)-1 || to_idx == (fsm_size_t)-1) {
-        return;  // Invalid states
+    pthread_mutex_destroy(&runner->__lock);
+    pthread_cond_destroy(&runner->__start);
+    pthread_cond_destroy(&runner->__done);
+
+    if (runner->__chunks) {
+        runner->__dealloc_fn(runner->__chunks);
     }
+    runner->__dealloc_fn(runner->__threads);
+    runner->__dealloc_fn(runner);
+}
 
-    // Allocate space for one more transition
-    fsm_size_t new_count = fsm->__transition_count + 1;
-    __fsm_transition_t *new_transitions =
-        (__fsm_transition_t *)fsm->__alloc_fn(sizeof(__fsm_transition_t) * new_count);
-    if (!new_transitions) {
-        return;  // Allocation failed
+void fsm_runner_tick(fsm_runner_t *runner, fsm_pool_t *pool) {
+    if (!runner || !pool) return;
+
+    // Cut every bucket into chunks
+    fsm_size_t state_count = pool->__definition->__fsm->__image.state_count;
+    fsm_size_t chunk_count = 0;
+    for (fsm_size_t s = 0; s < state_count; s++) {
+        chunk_count += (pool->__buckets[s].count + runner->__chunk_size - 1) / runner->__chunk_size;
+    }
+    if (chunk_count > runner->__chunk_capacity) {
+        __fsm_runner_chunk_t *chunks =
+            (__fsm_runner_chunk_t *)runner->__alloc_fn(sizeof(__fsm_runner_chunk_t) * chunk_count);
+        if (!chunks) {
+            FSM_LOG_ERROR("Failed to allocate runner chunks, ticking on the calling thread\n");
+            fsm_pool_tick(pool);
+            return;
+        }
+        if (runner->__chunks) {
+            runner->__dealloc_fn(runner->__chunks);
+        }
+        runner->__chunks = chunks;
+        runner->__chunk_capacity = chunk_count;
     }
 
-    // Copy the old transitions
-    if (fsm->transitions) {
-        memcpy(new_transitions, fsm->transitions,
-               sizeof(__fsm_transition_t) * fsm->__transition_count);
-        fsm->__dealloc_fn(fsm->transitions);
-        fsm->transitions = NULL;
+    fsm_size_t chunk = 0;
+    for (fsm_size_t s = 0; s < state_count; s++) {
+        for (fsm_size_t begin = 0; begin < pool->__buckets[s].count; begin += runner->__chunk_size) {
+            fsm_size_t end = begin + runner->__chunk_size;
+            runner->__chunks[chunk].state = s;
+            runner->__chunks[chunk].begin = begin;
+            runner->__chunks[chunk].end = end < pool->__buckets[s].count ? end : pool->__buckets[s].count;
+            chunk++;
+        }
     }
+    runner->__chunk_count = chunk_count;
+    runner->__pool = pool;
 
-    fsm->transitions = new_transitions;
+    // Give every thread an even, contiguous share of the chunks
+    for (fsm_size_t i = 0; i < runner->__thread_count; i++) {
+        uint64_t begin = chunk_count * i / runner->__thread_count;
+        uint64_t end = chunk_count * (i + 1) / runner->__thread_count;
+        atomic_store(&runner->__threads[i].range, __FSM_RUNNER_RANGE(begin, end));
+    }
 
-    // Set up the new transition
-    __fsm_transition_t *t = &fsm->transitions[fsm->__transition_count];
-    t->from = &fsm->states[from_idx];
-    t->to = &fsm->states[to_idx];
-
-    // Copy predicate group
-    t->predicates = (fsm_predicate_group_t *)fsm->__alloc_fn(sizeof(fsm_predicate_group_t));
-    if (!t->predicates) {
-        // roll back?
-        // For simplicity, do nothing more here. If you want to be robust, handle partial failures.
-        return;
+    // Start the workers, do our share, then wait for everyone to finish
+    pthread_mutex_lock(&runner->__lock);
+    runner->__threads_done = 0;
+    runner->__generation++;
+    pthread_cond_broadcast(&runner->__start);
+    pthread_mutex_unlock(&runner->__lock);
+
+    __fsm_runner_work(&runner->__threads[0]);
+
+    pthread_mutex_lock(&runner->__lock);
+    while (runner->__threads_done < runner->__thread_count - 1) {
+        pthread_cond_wait(&runner->__done, &runner->__lock);
     }
+    pthread_mutex_unlock(&runner->__lock);
 
-    // Copy the array of predicate functions
-    t->predicates->predicate_count = predicates.predicate_count;
-    size_t pred_array_size = sizeof(fsm_transition_predicate_fn) * predicates.predicate_count;
-    t->predicates->predicates =
-        (fsm_transition_predicate_fn *)fsm->__alloc_fn(pred_array_size);
-    if (!t->predicates->predicates) {
-        // Similarly, handle partial fail if desired
-        return;
+#if FSM_STATS
+    // Every thread counted on its own, the definition's counters only change here, on the calling thread
+    fsm_stats_t *stats = &pool->__definition->__fsm->__stats;
+    for (fsm_size_t i = 0; i < runner->__thread_count; i++) {
+        stats->predicate_calls += runner->__threads[i].fsm_stats.predicate_calls;
+        stats->predicate_calls_saved += runner->__threads[i].fsm_stats.predicate_calls_saved;
+        memset(&runner->__threads[i].fsm_stats, 0, sizeof(fsm_stats_t));
     }
+#endif  // FSM_STATS
 
-    memcpy(t->predicates->predicates, predicates.predicates, pred_array_size);
+    // Moving instances between buckets isn't thread-safe, and doing it here keeps it deterministic
+    __fsm_pool_apply_moves(pool);
+    runner->__pool = NULL;
+}
 
-    fsm->__transition_count = new_count;
+fsm_runner_stats_t fsm_runner_stats(fsm_runner_t *runner, fsm_size_t thread) {
+    fsm_runner_stats_t stats = {0};
+    if (runner && thread < runner->__thread_count) {
+        stats = runner->__threads[thread].stats;
+    }
+    return stats;
 }
 
-void fsm_add_transition_from_all(fsm_t *fsm, char *to, fsm_predicate_group_t predicates) {
-    if (!fsm || !to || fsm->__state_count == 0) {
-        return;
+void fsm_runner_reset_stats(fsm_runner_t *runner) {
+    if (!runner) return;
+    for (fsm_size_t i = 0; i < runner->__thread_count; i++) {
+        memset(&runner->__threads[i].stats, 0, sizeof(runner->__threads[i].stats));
     }
+}
 
-    fsm_size_t to_idx = __fsm_state_index(fsm, to);
-    if (to_idx == (fsm_size_t)-1) {
-        return;  // Invalid target
+fsm_bool fsm_attach_queue(fsm_t *fsm, fsm_size_t capacity, fsm_queue_overflow_t overflow) {
+    if (!fsm || fsm->__queue) return false;
+
+    fsm_size_t cell_count = 2;
+    while (cell_count < capacity) {
+        cell_count *= 2;
     }
 
-    // For each state in the FSM, add a transition to the "to" state
-    for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
-        // Avoid creating self-transitions if undesired.  If you want to allow
-        // from==to transitions, remove this check:
-        /*
-        if (i == to_idx) {
-            continue;
-        }
-        */
-        fsm_add_transition(fsm, fsm->states[i].name, to, predicates);
+    __fsm_event_queue_t *queue = (__fsm_event_queue_t *)__fsm_alloc(fsm, sizeof(__fsm_event_queue_t));
+    if (!queue) {
+        return false;
     }
+    queue->cells = (__fsm_event_queue_cell_t *)__fsm_alloc(fsm, sizeof(__fsm_event_queue_cell_t) * cell_count);
+    if (!queue->cells) {
+        __fsm_free(fsm, queue);
+        return false;
+    }
+
+    queue->mask = cell_count - 1;
+    queue->overflow = overflow;
+    for (fsm_size_t i = 0; i < cell_count; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    atomic_init(&queue->enqueue_position, 0);
+    queue->dequeue_position = 0;
+
+    fsm->__queue = queue;
+    return true;
 }
 
-void fsm_add_transition_to_all(fsm_t *fsm, char *from, fsm_predicate_group_t predicates) {
-    if (!fsm || !from || fsm->__state_count == 0) {
-        return;
+fsm_bool fsm_post(fsm_t *fsm, fsm_event_id event, void *payload) {
+    if (!fsm || !fsm->__queue || event == FSM_NO_EVENT) return false;
+
+    __fsm_event_queue_t *queue = fsm->__queue;
+    fsm_size_t position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+    __fsm_event_queue_cell_t *cell;
+    for (;;) {
+        cell = &queue->cells[position & queue->mask];
+        fsm_size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0) {
+            // The cell is free, claim it by moving the enqueue position past it
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // The cell still holds an event from one lap ago: the queue is full
+            if (queue->overflow == FSM_QUEUE_REJECT) {
+                return false;
+            }
+            sched_yield();
+            position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+        } else {
+            // Another producer claimed the cell first
+            position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+        }
     }
 
-    fsm_size_t from_idx = __fsm_state_index(fsm, from);
-    if (from_idx == (fsm_size_t)-1) {
-        return;  // Invalid origin
+    cell->event = event;
+    cell->payload = payload;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+    return true;
+}
+
+fsm_size_t fsm_drain_events(fsm_t *fsm, fsm_size_t max_events) {
+    if (!fsm || !fsm->__queue) return 0;
+    if (fsm->__image_dirty && !__fsm_compile(fsm)) {
+        FSM_LOG_ERROR("Failed to compile the FSM, leaving the events queued\n");
+        return 0;
     }
 
-    // For each state in the FSM, add a transition from the "from" state
-    for (fsm_size_t i = 0; i < fsm->__state_count; i++) {
-        // Avoid creating self-transitions if undesired:
-        /*
-        if (i == from_idx) {
-            continue;
+    __fsm_event_queue_t *queue = fsm->__queue;
+    fsm_event_id events[FSM_QUEUE_DRAIN_BATCH];
+    void *payloads[FSM_QUEUE_DRAIN_BATCH];
+    fsm_size_t drained = 0;
+
+    while (drained < max_events) {
+        // Copy a batch out and free its cells before running any state function
+        fsm_size_t batch = 0;
+        while (batch < FSM_QUEUE_DRAIN_BATCH && drained + batch < max_events) {
+            fsm_size_t position = queue->dequeue_position;
+            __fsm_event_queue_cell_t *cell = &queue->cells[position & queue->mask];
+            if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != position + 1) {
+                break;  // empty, or the next producer hasn't finished writing
+            }
+
+            events[batch] = cell->event;
+            payloads[batch] = cell->payload;
+            batch++;
+            atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+            queue->dequeue_position = position + 1;
         }
-        */
-        fsm_add_transition(fsm, from, fsm->states[i].name, predicates);
+        if (batch == 0) {
+            break;
+        }
+
+        for (fsm_size_t i = 0; i < batch; i++) {
+            __fsm_instance_dispatch(fsm, &fsm->__instance, events[i], payloads[i]);
+        }
+        drained += batch;
     }
+    return drained;
 }
 
+#endif  // FSM_THREADS
+
 #endif  // FSM_IMPL
 
 #ifdef __cplusplus